@@ -35,9 +35,13 @@ LOCAL_MODULE_PATH := $(TARGET_OUT_SHARED_LIBRARIES)/hw
 
 LOCAL_MODULE_TAGS := optional
 
-LOCAL_CFLAGS := -Wall
+LOCAL_CFLAGS := -Wall -ftree-vectorize
+LOCAL_ARM_NEON := true
 
-LOCAL_SRC_FILES := sensors-client.cpp
+LOCAL_SRC_FILES := \
+        sensors-client.cpp \
+        sensors-codec.cpp \
+        sensors-derive.cpp
 
 LOCAL_SHARED_LIBRARIES := liblog libcutils libdl
 LOCAL_PRELINK_MODULE := false
@@ -46,10 +50,18 @@ include $(BUILD_SHARED_LIBRARY)
 
 include $(CLEAR_VARS)
 
-LOCAL_CFLAGS := -Wall
+LOCAL_CFLAGS := -Wall -ftree-vectorize
+LOCAL_ARM_NEON := true
 
 LOCAL_SRC_FILES:= \
-        sensors-server.cpp
+        sensors-server.cpp \
+        sensors-codec.cpp \
+        sensors-history.cpp \
+        sensors-fusion.cpp \
+        sensors-calib.cpp \
+        sensors-filter.cpp \
+        sensors-qos.cpp \
+        sensors-derive.cpp
 
 LOCAL_SHARED_LIBRARIES := \
         libcutils libhardware
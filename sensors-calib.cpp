@@ -0,0 +1,325 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sensors-calib.h"
+
+// Gyroscope: weight of a new sample in the running mean and variance,
+// limits of variance and rate of a device lying still, time it has to lie
+// still, weight of a new mean in the bias and change worth reporting
+#define SCALIB_GYRO_ALPHA 0.02f
+#define SCALIB_GYRO_VAR_MAX 2.5e-5f
+#define SCALIB_GYRO_RATE_MAX 0.1f
+#define SCALIB_GYRO_STILL_NS 1000000000LL
+#define SCALIB_GYRO_BETA 0.01f
+#define SCALIB_GYRO_CHANGE 0.002f
+
+// Magnetometer: minimum distance between collected samples, range every
+// axis has to be covered by a batch and plausible strength of the earth's
+// magnetic field and change of the estimate worth reporting, all in uT,
+// and plausible soft-iron scale
+#define SCALIB_MAG_STEP 2.0f
+#define SCALIB_MAG_SPAN 30.0f
+#define SCALIB_MAG_FIELD_MIN 15.0f
+#define SCALIB_MAG_FIELD_MAX 100.0f
+#define SCALIB_MAG_CHANGE 1.0f
+#define SCALIB_MAG_SCALE_MIN 0.5f
+#define SCALIB_MAG_SCALE_MAX 2.0f
+
+#define SCALIB_STATE_MAGIC 0x4c435353
+#define SCALIB_STATE_VERSION 1
+
+struct scalib_state {
+	uint32_t magic;
+	uint32_t version;
+	char gyro_name[64];	// sensors the state belongs to
+	char mag_name[64];
+	float gyro_bias[3];
+	int32_t gyro_valid;
+	float mag_center[3];
+	float mag_scale[3];
+	int32_t mag_valid;
+};
+
+void scalib_gyro_init(struct scalib_gyro *g)
+{
+	memset(g, 0, sizeof(*g));
+}
+
+int scalib_gyro_update(struct scalib_gyro *g, const float *raw, int64_t timestamp)
+{
+	int k, still = 1, changed = 0;
+
+	for (k = 0; k < 3; k++) {
+		const float d = raw[k] - g->mean[k];
+		g->mean[k] += SCALIB_GYRO_ALPHA * d;
+		g->var[k] = (1 - SCALIB_GYRO_ALPHA) * (g->var[k] + SCALIB_GYRO_ALPHA * d * d);
+		if (g->var[k] > SCALIB_GYRO_VAR_MAX || fabsf(g->mean[k]) > SCALIB_GYRO_RATE_MAX)
+			still = 0;
+	}
+
+	if (!still) {
+		g->still_ns = 0;
+		return 0;
+	}
+	if (!g->still_ns)
+		g->still_ns = timestamp;
+	if (timestamp - g->still_ns < SCALIB_GYRO_STILL_NS)
+		return 0;
+
+	for (k = 0; k < 3; k++) {
+		g->bias[k] = g->valid ? g->bias[k] + SCALIB_GYRO_BETA * (g->mean[k] - g->bias[k])
+		    : g->mean[k];
+		if (fabsf(g->bias[k] - g->reported[k]) > SCALIB_GYRO_CHANGE)
+			changed = 1;
+	}
+	if (changed || !g->valid)
+		memcpy(g->reported, g->bias, sizeof(g->reported));
+	changed |= !g->valid;
+	g->valid = 1;
+
+	return changed;
+}
+
+void scalib_gyro_apply(const struct scalib_gyro *g, const float *raw, float *calibrated,
+		       float *bias)
+{
+	for (int k = 0; k < 3; k++) {
+		bias[k] = g->bias[k];
+		calibrated[k] = raw[k] - g->bias[k];
+	}
+}
+
+static void scalib_mag_reset(struct scalib_mag *m)
+{
+	memset(m->ata, 0, sizeof(m->ata));
+	memset(m->atb, 0, sizeof(m->atb));
+	m->samples = 0;
+}
+
+void scalib_mag_init(struct scalib_mag *m)
+{
+	memset(m, 0, sizeof(*m));
+	for (int k = 0; k < 3; k++)
+		m->scale[k] = 1;
+}
+
+// Solves the 6x6 system a * x = b by Gaussian elimination, a and b are
+// modified. Returns -1 if the system is singular.
+static int scalib_solve(double a[6][6], double *b, double *x)
+{
+	int i, j, k, p;
+
+	for (i = 0; i < 6; i++) {
+		p = i;
+		for (j = i + 1; j < 6; j++) {
+			if (fabs(a[j][i]) > fabs(a[p][i]))
+				p = j;
+		}
+		if (fabs(a[p][i]) < 1e-12)
+			return -1;
+		if (p != i) {
+			for (k = 0; k < 6; k++) {
+				double t = a[i][k];
+				a[i][k] = a[p][k];
+				a[p][k] = t;
+			}
+			double t = b[i];
+			b[i] = b[p];
+			b[p] = t;
+		}
+		for (j = i + 1; j < 6; j++) {
+			const double f = a[j][i] / a[i][i];
+			for (k = i; k < 6; k++)
+				a[j][k] -= f * a[i][k];
+			b[j] -= f * b[i];
+		}
+	}
+	for (i = 5; i >= 0; i--) {
+		x[i] = b[i];
+		for (k = i + 1; k < 6; k++)
+			x[i] -= a[i][k] * x[k];
+		x[i] /= a[i][i];
+	}
+	return 0;
+}
+
+// Fits a x^2 + b y^2 + c z^2 + d x + e y + f z = 1 to the collected samples
+static int scalib_mag_fit(struct scalib_mag *m)
+{
+	double p[6], g = 1;
+	float center[3], radius[3], scale[3], r;
+	int k, changed = 0;
+
+	for (k = 0; k < 3; k++) {
+		if (m->max[k] - m->min[k] < SCALIB_MAG_SPAN)
+			return 0;	// not turned around enough
+	}
+	if (scalib_solve(m->ata, m->atb, p))
+		return 0;
+
+	for (k = 0; k < 3; k++) {
+		if (p[k] <= 0)
+			return 0;	// not an ellipsoid
+		center[k] = -p[3 + k] / (2 * p[k]);
+		g += p[3 + k] * p[3 + k] / (4 * p[k]);
+	}
+	for (k = 0; k < 3; k++)
+		radius[k] = sqrt(g / p[k]);
+	r = cbrtf(radius[0] * radius[1] * radius[2]);
+	if (r < SCALIB_MAG_FIELD_MIN || r > SCALIB_MAG_FIELD_MAX)
+		return 0;
+	for (k = 0; k < 3; k++) {
+		scale[k] = r / radius[k];
+		if (scale[k] < SCALIB_MAG_SCALE_MIN || scale[k] > SCALIB_MAG_SCALE_MAX)
+			return 0;
+	}
+
+	for (k = 0; k < 3; k++) {
+		if (fabsf(center[k] - m->center[k]) > SCALIB_MAG_CHANGE ||
+		    fabsf(scale[k] - m->scale[k]) > SCALIB_MAG_CHANGE / r)
+			changed = 1;
+	}
+	changed |= !m->valid;
+
+	memcpy(m->center, center, sizeof(m->center));
+	memcpy(m->scale, scale, sizeof(m->scale));
+	m->valid = 1;
+	return changed;
+}
+
+int scalib_mag_update(struct scalib_mag *m, const float *raw)
+{
+	double row[6];
+	float d = 0;
+	int i, j, k, ret;
+
+	for (k = 0; k < 3; k++)
+		d += (raw[k] - m->last[k]) * (raw[k] - m->last[k]);
+	if (m->samples && d < SCALIB_MAG_STEP * SCALIB_MAG_STEP)
+		return 0;	// only collect samples of different orientations
+
+	for (k = 0; k < 3; k++) {
+		m->last[k] = raw[k];
+		m->min[k] = m->samples && m->min[k] < raw[k] ? m->min[k] : raw[k];
+		m->max[k] = m->samples && m->max[k] > raw[k] ? m->max[k] : raw[k];
+		row[k] = (double)raw[k] * raw[k];
+		row[3 + k] = raw[k];
+	}
+	for (i = 0; i < 6; i++) {
+		for (j = 0; j < 6; j++)
+			m->ata[i][j] += row[i] * row[j];
+		m->atb[i] += row[i];
+	}
+
+	if (++m->samples < SCALIB_MAG_SAMPLES)
+		return 0;
+
+	ret = scalib_mag_fit(m);
+	scalib_mag_reset(m);
+	return ret;
+}
+
+void scalib_mag_apply(const struct scalib_mag *m, const float *raw, float *uncalibrated,
+		      float *bias, float *calibrated)
+{
+	for (int k = 0; k < 3; k++) {
+		uncalibrated[k] = raw[k] * m->scale[k];
+		bias[k] = m->center[k] * m->scale[k];
+		calibrated[k] = uncalibrated[k] - bias[k];
+	}
+}
+
+int scalib_save(const char *path, const struct scalib_gyro *g, const char *gyro_name,
+		const struct scalib_mag *m, const char *mag_name)
+{
+	struct scalib_state state;
+	char tmp[PATH_MAX];
+	int fd, ret;
+
+	memset(&state, 0, sizeof(state));
+	state.magic = SCALIB_STATE_MAGIC;
+	state.version = SCALIB_STATE_VERSION;
+	strncpy(state.gyro_name, gyro_name, sizeof(state.gyro_name) - 1);
+	strncpy(state.mag_name, mag_name, sizeof(state.mag_name) - 1);
+	memcpy(state.gyro_bias, g->bias, sizeof(state.gyro_bias));
+	state.gyro_valid = g->valid;
+	memcpy(state.mag_center, m->center, sizeof(state.mag_center));
+	memcpy(state.mag_scale, m->scale, sizeof(state.mag_scale));
+	state.mag_valid = m->valid;
+
+	// Write a new file and replace the old one, a crash never leaves a
+	// half written state behind
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -1;
+	ret = write(fd, &state, sizeof(state));
+	if (ret != (int)sizeof(state) || fsync(fd)) {
+		close(fd);
+		unlink(tmp);
+		return -1;
+	}
+	close(fd);
+
+	return rename(tmp, path);
+}
+
+int scalib_load(const char *path, struct scalib_gyro *g, const char *gyro_name,
+		struct scalib_mag *m, const char *mag_name)
+{
+	struct scalib_state state;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -1;
+	ret = read(fd, &state, sizeof(state));
+	close(fd);
+
+	if (ret != (int)sizeof(state) || state.magic != SCALIB_STATE_MAGIC ||
+	    state.version != SCALIB_STATE_VERSION) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (state.gyro_valid && !strncmp(state.gyro_name, gyro_name, sizeof(state.gyro_name) - 1)) {
+		memcpy(g->bias, state.gyro_bias, sizeof(g->bias));
+		memcpy(g->reported, state.gyro_bias, sizeof(g->reported));
+		g->valid = 1;
+	}
+	if (state.mag_valid && !strncmp(state.mag_name, mag_name, sizeof(state.mag_name) - 1)) {
+		memcpy(m->center, state.mag_center, sizeof(m->center));
+		memcpy(m->scale, state.mag_scale, sizeof(m->scale));
+		m->valid = 1;
+	}
+	return 0;
+}
@@ -0,0 +1,96 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef ANDROID_SENSORS_CALIB_H
+#define ANDROID_SENSORS_CALIB_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+// Gyroscope bias estimator. While the device lies still the mean rate is
+// the bias. Stillness is detected from the variance of the rates.
+struct scalib_gyro {
+	float mean[3];		// running mean of the raw rates
+	float var[3];		// running variance of the raw rates
+	int64_t still_ns;	// timestamp stillness was first seen, 0 if moving
+	float bias[3];		// estimated bias in rad/s
+	float reported[3];	// bias last reported as changed
+	int valid;		// bias has been estimated
+};
+
+// Number of magnetometer samples collected for one fit
+#define SCALIB_MAG_SAMPLES 500
+
+// Magnetometer hard-iron and (axis aligned) soft-iron estimator. Samples
+// taken while the device is turned are fitted to an ellipsoid, whose
+// center is the hard-iron offset and whose radii give the soft-iron scale.
+struct scalib_mag {
+	double ata[6][6];	// normal equations of the ellipsoid fit
+	double atb[6];
+	float min[3];		// range covered by the collected samples
+	float max[3];
+	float last[3];		// last collected sample
+	int samples;		// number of samples collected
+	float center[3];	// estimated hard-iron offset in uT
+	float scale[3];		// estimated soft-iron scale
+	int valid;		// offset and scale have been estimated
+};
+
+void scalib_gyro_init(struct scalib_gyro *g);
+
+// Feeds raw rates <raw> measured at <timestamp> to the estimator. Returns
+// 1 if the bias estimate changed significantly, 0 otherwise.
+int scalib_gyro_update(struct scalib_gyro *g, const float *raw, int64_t timestamp);
+
+// Subtracts the bias from <raw>, writes the calibrated rates to
+// <calibrated> and the bias to <bias>
+void scalib_gyro_apply(const struct scalib_gyro *g, const float *raw, float *calibrated,
+		       float *bias);
+
+void scalib_mag_init(struct scalib_mag *m);
+
+// Feeds a raw sample <raw> to the estimator. Returns 1 if an estimate
+// differing significantly from the previous one has been accepted, 0
+// otherwise.
+int scalib_mag_update(struct scalib_mag *m, const float *raw);
+
+// Corrects the soft-iron distortion of <raw> into <uncalibrated>, writes
+// the matching hard-iron offset to <bias> and the fully corrected field
+// to <calibrated>
+void scalib_mag_apply(const struct scalib_mag *m, const float *raw, float *uncalibrated,
+		      float *bias, float *calibrated);
+
+// Stores or loads the estimates of <g> and <m> for the sensors named
+// <gyro_name> and <mag_name> in <path>. A state saved for other sensors is
+// not loaded. Return 0 on success, -1 otherwise.
+int scalib_save(const char *path, const struct scalib_gyro *g, const char *gyro_name,
+		const struct scalib_mag *m, const char *mag_name);
+int scalib_load(const char *path, struct scalib_gyro *g, const char *gyro_name,
+		struct scalib_mag *m, const char *mag_name);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_CALIB_H
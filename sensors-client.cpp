@@ -31,9 +31,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <netinet/in.h>
+#include <time.h>
 
 #include <cutils/properties.h>
 
@@ -42,6 +46,49 @@
 #include <utils/Log.h>
 
 #include "sensors-proxy.h"
+#include "sensors-client.h"
+#include "sensors-codec.h"
+#include "sensors-derive.h"
+
+// Set to "q16" to request the fixed-point encoding of the event stream
+#define SENSORS_CLIENT_PROP_ENCODING "persist.trustme.sensors.encoding"
+
+// Set to "1" to subscribe to all sensors passively, for containers which
+// only observe what other containers enable
+#define SENSORS_CLIENT_PROP_PASSIVE "persist.trustme.sensors.passive"
+
+// Name of the container the HAL runs in, lets the server throttle the
+// delivery while the container is in the background
+#define SENSORS_CLIENT_PROP_CONTAINER "ro.trustme.sensors.container"
+
+// Delivery while in the background: "none" (default, as the QoS class of
+// the process says), "pause", "rate:<ms>" or "batch:<ms>", see
+// SENSORS_PROXY_BACKGROUND_*
+#define SENSORS_CLIENT_PROP_BACKGROUND "persist.trustme.sensors.background"
+
+// Latency in ms the server may add by batching events while this process
+// doesn't keep up, 0 to never batch
+#define SENSORS_CLIENT_PROP_LATENCY "persist.trustme.sensors.latency"
+
+// Bounds the retries of a latest value reader racing with the server
+#define SENSORS_CLIENT_LATEST_RETRY_MAX 1000
+
+// Interval for checking that the server of the latest value page is still
+// running, and for retrying to map the page if it isn't available
+#define SENSORS_CLIENT_LATEST_CHECK_NS 1000000000LL
+
+// Backoff between attempts to reconnect to the server
+#define SENSORS_CLIENT_RECONNECT_MS_MIN 100
+#define SENSORS_CLIENT_RECONNECT_MS_MAX 5000
+
+// Interval for logging lost events
+#define SENSORS_CLIENT_STATS_INTERVAL_NS 10000000000LL
+
+// Time to wait for the counters of the server, see sensors_proxy_get_stats()
+#define SENSORS_CLIENT_STATS_TIMEOUT_MS 500
+
+// Time to wait for the urgent lane, servers without one never answer
+#define SENSORS_CLIENT_LANE_TIMEOUT_MS 500
 
 static struct sensor_t sensors_list[SENSORS_MAX];
 static int sensors_count;
@@ -85,14 +132,73 @@ struct sensors_poll_context_t {
 	int pollEvents(sensors_event_t * data, int count);
 	int query(int what, int *value);
 	int batch(int handle, int flags, int64_t period_ns, int64_t timeout);
+	int setFilter(int handle, int mode, float value);
+	int setPassive(int handle, int passive);
+	int setDelayBand(int handle, int64_t min_ns, int64_t max_ns);
+	int setBackground(int policy, int64_t period_ns);
+	void getBudget(struct sensors_proxy_budget *budget);
+	int getStats(struct sensors_proxy_stats *stats);
 
 private:
+	int sendCmd(const struct sensors_proxy_cmd *cmd);
+	void sendContainer();
+	void sendCredit();
+	int reconnect();
+	void disconnect();
+	int recvEvents(int fd, sensors_event_t *events, int *count);
+	void checkSequence(sensors_event_t *events, int n);
+
+	pthread_mutex_t lock;	// protects sock_fd and the subscriptions against reconnects
 	int sock_fd;
+	int lane_fd;		// urgent lane, -1 if the server didn't open one
 	struct sensors_strings_t sensors_strings_list[SENSORS_MAX];
+	int handle_last;	// highest handle number used
+	int *sensor_type;	// array with 'handle_last+1' fields
+	float *q16_scale;	// array with 'handle_last+1' fields
+	char *rx_buf;		// holds a single packet received from the server
+	sensors_event_t pending[SENSORS_PROXY_BATCH_MAX];	// decoded, not yet polled
+	int pending_pos;
+	int pending_count;
+	sensors_event_t urgent[SENSORS_PROXY_BATCH_MAX];	// ... of the urgent lane
+	int urgent_pos;
+	int urgent_count;
+	uint32_t *rx_seq;	// array with 'handle_last+1' fields, last sequence number seen
+	uint64_t rx_records;	// event records received on this connection
+	uint64_t rx_credited;	// ... when credit was granted last
+	int latency_ms;		// see SENSORS_CLIENT_PROP_LATENCY
+	char *sensor_enabled;	// array with 'handle_last+1' fields
+	char *sensor_passive;	// array with 'handle_last+1' fields
+	int64_t *sensor_delay_ns;	// array with 'handle_last+1' fields
+	int64_t *delay_min_ns;	// array with 'handle_last+1' fields, delay band or 0
+	int64_t *delay_max_ns;	// array with 'handle_last+1' fields
+	int64_t *last_timestamp;	// array with 'handle_last+1' fields, used to resume
+	int *filter_mode;	// array with 'handle_last+1' fields
+	float *filter_value;	// array with 'handle_last+1' fields
+	int encoding;
+	char container[SENSORS_PROXY_CONTAINER_CHARS];	// empty outside of containers
+	int bg_policy;		// SENSORS_PROXY_BACKGROUND_*
+	int64_t bg_period_ns;
+	struct sensors_proxy_budget budget;	// last service level reported, protected by lock
+	struct sensors_proxy_stats stats;	// last counters reported, protected by lock
+	int stats_replies;	// number of them received
+	pthread_cond_t stats_cond;	// signaled when one is received
+	int reconnect_ms;
+	uint64_t events_received;
+	uint64_t events_lost;	// sum of all sequence gaps
+	uint64_t events_lost_logged;
+	int64_t stats_logged_ns;
 };
 
 /******************************************************************************/
 
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static int recv_all(int sock_fd, void *buf, size_t len)
 {
 	char *ptr = (char *)buf;
@@ -112,62 +218,184 @@ static int recv_all(int sock_fd, void *buf, size_t len)
 	return 0;
 }
 
-/******************************************************************************/
-
-sensors_poll_context_t::sensors_poll_context_t()
+// Opens a connection to the sensors proxy server
+static int proxy_connect(void)
 {
 	struct sockaddr_un server;
-	int err;
+	int fd, err;
 
-	// Connect to sensors server first
-	sock_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
-	if (sock_fd < 0) {
+	fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (fd < 0) {
 		ALOGE("couldn't not open socket: %s", strerror(errno));
-		return;
+		return -1;
 	}
 
 	ALOGV("%s: connecing to %s", __func__, SENSORS_PROXY_PATH);
 
-	// Connect to the sensors proxy server
 	memset(&server, 0, sizeof(server));
 	server.sun_family = AF_UNIX;
 	snprintf(server.sun_path, UNIX_PATH_MAX, "%s", SENSORS_PROXY_PATH);
-	err = connect(sock_fd, (struct sockaddr *)&server, sizeof(server));
+	err = connect(fd, (struct sockaddr *)&server, sizeof(server));
 	if (err) {
 		ALOGE("couldn't connect to server: %s", strerror(errno));
-		close(sock_fd);
-		sock_fd = -1;
-		return;
+		close(fd);
+		return -1;
 	}
-	ALOGI("UNIX socket %d connected to %s", sock_fd, SENSORS_PROXY_PATH);
+	ALOGI("UNIX socket %d connected to %s", fd, SENSORS_PROXY_PATH);
+
+	return fd;
+}
+
+// Receives the list of sensors the server sends on accept. Returns the
+// number of sensors or -1 on error.
+static int proxy_recv_list(int fd, struct sensors_strings_t *strings, struct sensor_t *list)
+{
+	int count, err;
 
-	// The server sends the list of sensors on accept
 	// First we read the sensors count
-	err = recv_all(sock_fd, &sensors_count, sizeof(sensors_count));
+	err = recv_all(fd, &count, sizeof(count));
 	if (err) {
 		ALOGE("couldn't read sensors count: %s", strerror(errno));
-		close(sock_fd);
-		sock_fd = -1;
-		return;
+		return -1;
+	}
+	if (count < 0 || count > SENSORS_MAX) {
+		ALOGE("invalid sensors count %d", count);
+		return -1;
 	}
-	ALOGI("%s: sensors count: %d", __func__, sensors_count);
-
 	// Next we read the list of name and vendor strings
-	err = recv_all(sock_fd, sensors_strings_list, sizeof(sensors_strings_t) * sensors_count);
+	err = recv_all(fd, strings, sizeof(sensors_strings_t) * count);
 	if (err) {
 		ALOGE("couldn't read sensors strings list: %s", strerror(errno));
-		close(sock_fd);
-		sock_fd = -1;
-		return;
+		return -1;
 	}
 	// Finally we read the list of sensors
-	err = recv_all(sock_fd, sensors_list, sizeof(sensor_t) * sensors_count);
+	err = recv_all(fd, list, sizeof(sensor_t) * count);
 	if (err) {
 		ALOGE("couldn't read sensors list: %s", strerror(errno));
+		return -1;
+	}
+	return count;
+}
+
+// Opens the urgent lane of the connection <fd>, see SENSORS_PROXY_MSG_LANE.
+// Must be called before any sensor is enabled. Returns the fd of the lane
+// or -1 on error, then all events arrive on <fd>.
+static int proxy_open_lane(int fd)
+{
+	struct sensors_proxy_cmd cmd;
+	struct sensors_proxy_msg msg;
+	struct timeval tv;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	int lane, ret;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_OPEN_LANE;
+	ret = send(fd, &cmd, sizeof(cmd), 0);
+	if (ret != sizeof(cmd)) {
+		ALOGE("fd%d: couldn't ask for the urgent lane: %s", fd,
+		      ret < 0 ? strerror(errno) : "not enough data sent");
+		return -1;
+	}
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	tv.tv_sec = SENSORS_CLIENT_LANE_TIMEOUT_MS / 1000;
+	tv.tv_usec = SENSORS_CLIENT_LANE_TIMEOUT_MS % 1000 * 1000;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	ret = recvmsg(fd, &mh, MSG_CMSG_CLOEXEC);
+	memset(&tv, 0, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (ret != sizeof(msg) || msg.msg != SENSORS_PROXY_MSG_LANE || !cmsg ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		ALOGE("fd%d: didn't receive the urgent lane: %s", fd,
+		      ret < 0 ? strerror(errno) :
+		      ret == sizeof(msg) && msg.msg == SENSORS_PROXY_MSG_LANE && !cmsg ?
+		      "the server couldn't open it" : "unexpected reply");
+		return -1;
+	}
+	memcpy(&lane, CMSG_DATA(cmsg), sizeof(lane));
+	ALOGI("fd%d: urgent lane on fd %d", fd, lane);
+
+	return lane;
+}
+
+/******************************************************************************/
+
+sensors_poll_context_t::sensors_poll_context_t()
+{
+	char value[PROPERTY_VALUE_MAX];
+	long long ms;
+
+	pthread_mutex_init(&lock, NULL);
+	pthread_cond_init(&stats_cond, NULL);
+	handle_last = -1;
+	sensor_type = NULL;
+	q16_scale = NULL;
+	rx_seq = NULL;
+	sensor_enabled = NULL;
+	sensor_passive = NULL;
+	sensor_delay_ns = NULL;
+	delay_min_ns = NULL;
+	delay_max_ns = NULL;
+	last_timestamp = NULL;
+	filter_mode = NULL;
+	filter_value = NULL;
+	encoding = SENSORS_PROXY_ENCODING_FLOAT;
+	container[0] = '\0';
+	bg_policy = SENSORS_PROXY_BACKGROUND_NONE;
+	bg_period_ns = 0;
+	memset(&budget, 0, sizeof(budget));
+	budget.decimation = 1;
+	memset(&stats, 0, sizeof(stats));
+	stats_replies = 0;
+	reconnect_ms = SENSORS_CLIENT_RECONNECT_MS_MIN;
+	pending_pos = pending_count = 0;
+	urgent_pos = urgent_count = 0;
+	rx_records = rx_credited = 0;
+	latency_ms = 0;
+	lane_fd = -1;
+	events_received = events_lost = events_lost_logged = 0;
+	stats_logged_ns = 0;
+
+	rx_buf = (char *)malloc(SENSORS_PROXY_PKT_MAX);
+	if (!rx_buf) {
+		ALOGE("couldn't allocate memory for receive buffer");
+		sock_fd = -1;
+		return;
+	}
+
+	// Connect to sensors server first, it sends the list of sensors on accept
+	sock_fd = proxy_connect();
+	if (sock_fd < 0)
+		return;
+
+	sensors_count = proxy_recv_list(sock_fd, sensors_strings_list, sensors_list);
+	if (sensors_count < 0) {
+		sensors_count = 0;
 		close(sock_fd);
 		sock_fd = -1;
 		return;
 	}
+	ALOGI("%s: sensors count: %d", __func__, sensors_count);
+
+	// Wake-up events are delivered on a socket of their own
+	lane_fd = proxy_open_lane(sock_fd);
+
+	property_get(SENSORS_CLIENT_PROP_LATENCY, value, "200");
+	latency_ms = atoi(value) > 0 ? atoi(value) : 0;
+	sendCredit();
+
 	// Now we need to replace the strings pointers
 	for (int i = 0; i < sensors_count; i++) {
 		struct sensor_t *list = &sensors_list[i];
@@ -177,81 +405,592 @@ sensors_poll_context_t::sensors_poll_context_t()
 		      "maxRange %f resolution %f power %fmA minDelay %d\n",
 		      list->name, list->vendor, list->version, list->handle, list->type,
 		      list->maxRange, list->resolution, list->power, list->minDelay);
+		if (list->handle > handle_last)
+			handle_last = list->handle;
 	}
+
+	// Per handle data needed to decode events and to resume after reconnects
+	sensor_type = (int *)calloc(handle_last + 1, sizeof(int));
+	q16_scale = (float *)calloc(handle_last + 1, sizeof(float));
+	rx_seq = (uint32_t *)calloc(handle_last + 1, sizeof(uint32_t));
+	sensor_enabled = (char *)calloc(handle_last + 1, sizeof(char));
+	sensor_passive = (char *)calloc(handle_last + 1, sizeof(char));
+	sensor_delay_ns = (int64_t *) calloc(handle_last + 1, sizeof(int64_t));
+	delay_min_ns = (int64_t *) calloc(handle_last + 1, sizeof(int64_t));
+	delay_max_ns = (int64_t *) calloc(handle_last + 1, sizeof(int64_t));
+	last_timestamp = (int64_t *) calloc(handle_last + 1, sizeof(int64_t));
+	filter_mode = (int *)calloc(handle_last + 1, sizeof(int));
+	filter_value = (float *)calloc(handle_last + 1, sizeof(float));
+	if (!sensor_type || !q16_scale || !rx_seq || !sensor_enabled || !sensor_passive ||
+	    !sensor_delay_ns || !delay_min_ns || !delay_max_ns || !last_timestamp || !filter_mode ||
+	    !filter_value) {
+		ALOGE("couldn't allocate memory for sensor handle arrays");
+		handle_last = -1;
+		close(sock_fd);
+		sock_fd = -1;
+		return;
+	}
+	for (int i = 0; i < sensors_count; i++) {
+		sensor_type[sensors_list[i].handle] = sensors_list[i].type;
+		q16_scale[sensors_list[i].handle] = sensors_codec_q16_scale(&sensors_list[i]);
+	}
+
+	property_get(SENSORS_CLIENT_PROP_PASSIVE, value, "0");
+	if (!strcmp(value, "1")) {
+		memset(sensor_passive, 1, handle_last + 1);
+		ALOGI("%s: subscribing passively", __func__);
+	}
+
+	property_get(SENSORS_CLIENT_PROP_ENCODING, value, "float");
+	if (!strcmp(value, "q16")) {
+		struct sensors_proxy_cmd cmd;
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cmd = SENSORS_PROXY_CMD_SET_ENCODING;
+		cmd.encoding = encoding = SENSORS_PROXY_ENCODING_Q16;
+		sendCmd(&cmd);
+		ALOGI("%s: requested Q16 encoding", __func__);
+	}
+
+	property_get(SENSORS_CLIENT_PROP_BACKGROUND, value, "none");
+	if (!strcmp(value, "pause")) {
+		bg_policy = SENSORS_PROXY_BACKGROUND_PAUSE;
+	} else if (sscanf(value, "rate:%lld", &ms) == 1 && ms > 0) {
+		bg_policy = SENSORS_PROXY_BACKGROUND_RATE;
+		bg_period_ns = ms * 1000000LL;
+	} else if (sscanf(value, "batch:%lld", &ms) == 1 && ms > 0) {
+		bg_policy = SENSORS_PROXY_BACKGROUND_BATCH;
+		bg_period_ns = ms * 1000000LL;
+	}
+
+	property_get(SENSORS_CLIENT_PROP_CONTAINER, value, "");
+	snprintf(container, sizeof(container), "%s", value);
+	sendContainer();
 }
 
 sensors_poll_context_t::~sensors_poll_context_t()
 {
-	ALOGI("%s", __func__);
+	ALOGI("%s: %llu event(s) received, %llu lost", __func__,
+	      (unsigned long long)events_received, (unsigned long long)events_lost);
 	if (sock_fd >= 0)
 		close(sock_fd);
+	if (lane_fd >= 0)
+		close(lane_fd);
+	pthread_cond_destroy(&stats_cond);
+	pthread_mutex_destroy(&lock);
+	free(filter_value);
+	free(filter_mode);
+	free(last_timestamp);
+	free(delay_max_ns);
+	free(delay_min_ns);
+	free(sensor_delay_ns);
+	free(sensor_passive);
+	free(sensor_enabled);
+	free(rx_seq);
+	free(sensor_type);
+	free(q16_scale);
+	free(rx_buf);
+}
+
+int sensors_poll_context_t::sendCmd(const struct sensors_proxy_cmd *cmd)
+{
+	int ret;
+
+	if (sock_fd < 0)
+		return -1;	// the subscription is restored once reconnected
+
+	ret = send(sock_fd, cmd, sizeof(*cmd), 0);
+	ALOGE_IF(ret != sizeof(*cmd), "fd%d: couldn't send command %d: %s",
+		 sock_fd, cmd->cmd, ret < 0 ? strerror(errno) : "not enough data sent");
+	return ret == sizeof(*cmd) ? 0 : -1;
+}
+
+// Tells the server how many events we received so far and how many more
+// it may send, see SENSORS_PROXY_CMD_CREDIT
+void sensors_poll_context_t::sendCredit()
+{
+	struct sensors_proxy_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_CREDIT;
+	cmd.credit.consumed = rx_records;
+	cmd.credit.window = SENSORS_PROXY_CREDIT_WINDOW;
+	cmd.credit.latency_ms = latency_ms;
+	if (!sendCmd(&cmd))
+		rx_credited = rx_records;
+}
+
+// Names the container of this process and its background policy to the
+// server, the policy goes first so it applies right away
+void sensors_poll_context_t::sendContainer()
+{
+	struct sensors_proxy_cmd cmd;
+
+	if (!container[0])
+		return;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_BACKGROUND;
+	cmd.background.policy = bg_policy;
+	cmd.background.period_ns = bg_period_ns;
+	sendCmd(&cmd);
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_CONTAINER;
+	snprintf(cmd.container, sizeof(cmd.container), "%s", container);
+	sendCmd(&cmd);
+
+	ALOGI("%s: container '%s', background policy %d", __func__, container, bg_policy);
 }
 
 int sensors_poll_context_t::activate(int handle, int enabled)
 {
+	struct sensors_proxy_cmd cmd;
+
 	ALOGI("%s: handle=%d enabled=%d", __func__, handle, enabled);
 
-	if (sock_fd >= 0) {
-		struct sensors_proxy_cmd cmd;
+	if (handle < 0 || handle > handle_last)
+		return -EINVAL;
 
-		cmd.cmd = SENSORS_PROXY_CMD_ACTIVATE;
-		cmd.handle = handle;
-		cmd.activate_enabled = enabled;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_ACTIVATE;
+	cmd.handle = handle;
+
+	pthread_mutex_lock(&lock);
+	sensor_enabled[handle] = enabled;
+	if (enabled && sensor_passive[handle])
+		cmd.activate_enabled = SENSORS_PROXY_ACTIVATE_PASSIVE;
+	else
+		cmd.activate_enabled = enabled ? SENSORS_PROXY_ACTIVATE_ON : SENSORS_PROXY_ACTIVATE_OFF;
+	sendCmd(&cmd);
+	pthread_mutex_unlock(&lock);
 
-		int ret = send(sock_fd, &cmd, sizeof(cmd), 0);
-		ALOGE_IF(ret <= 0, "couldn't send activate command: %s",
-			 ret ? strerror(errno) : "not enough data");
-	}
 	return 0;
 }
 
 int sensors_poll_context_t::setDelay(int handle, int64_t ns)
 {
+	struct sensors_proxy_cmd cmd;
+
 	ALOGI("%s: handle=%d ns=%lld", __func__, handle, ns);
 
-	if (sock_fd >= 0) {
-		struct sensors_proxy_cmd cmd;
-		int ret;
+	if (handle < 0 || handle > handle_last)
+		return -EINVAL;
 
-		cmd.cmd = SENSORS_PROXY_CMD_SET_DELAY;
-		cmd.handle = handle;
-		cmd.set_delay_ns = ns;
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_DELAY;
+	cmd.handle = handle;
+	cmd.set_delay_ns = ns;
+
+	pthread_mutex_lock(&lock);
+	sensor_delay_ns[handle] = ns;
+	sendCmd(&cmd);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+int sensors_poll_context_t::setFilter(int handle, int mode, float value)
+{
+	struct sensors_proxy_cmd cmd;
+
+	ALOGI("%s: handle=%d mode=%d value=%f", __func__, handle, mode, value);
+
+	if (handle < 0 || handle > handle_last)
+		return -EINVAL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_FILTER;
+	cmd.handle = handle;
+	cmd.filter.mode = mode;
+	cmd.filter.value = value;
+
+	pthread_mutex_lock(&lock);
+	filter_mode[handle] = mode;
+	filter_value[handle] = value;
+	sendCmd(&cmd);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+int sensors_poll_context_t::setPassive(int handle, int passive)
+{
+	struct sensors_proxy_cmd cmd;
+
+	ALOGI("%s: handle=%d passive=%d", __func__, handle, passive);
+
+	if (handle < 0 || handle > handle_last)
+		return -EINVAL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_ACTIVATE;
+	cmd.handle = handle;
+	cmd.activate_enabled = passive ? SENSORS_PROXY_ACTIVATE_PASSIVE : SENSORS_PROXY_ACTIVATE_ON;
+
+	pthread_mutex_lock(&lock);
+	sensor_passive[handle] = !!passive;
+	if (sensor_enabled[handle])
+		sendCmd(&cmd);	// switch the running subscription
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+int sensors_poll_context_t::setDelayBand(int handle, int64_t min_ns, int64_t max_ns)
+{
+	struct sensors_proxy_cmd cmd;
+
+	ALOGI("%s: handle=%d min=%lld max=%lld", __func__, handle, min_ns, max_ns);
+
+	if (handle < 0 || handle > handle_last || min_ns < 0 || (min_ns && max_ns < min_ns))
+		return -EINVAL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_DELAY_BAND;
+	cmd.handle = handle;
+	cmd.delay_band.min_ns = min_ns;
+	cmd.delay_band.max_ns = min_ns ? max_ns : 0;
+
+	pthread_mutex_lock(&lock);
+	delay_min_ns[handle] = cmd.delay_band.min_ns;
+	delay_max_ns[handle] = cmd.delay_band.max_ns;
+	sendCmd(&cmd);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+int sensors_poll_context_t::setBackground(int policy, int64_t period_ns)
+{
+	struct sensors_proxy_cmd cmd;
+
+	ALOGI("%s: policy=%d period=%lld", __func__, policy, period_ns);
+
+	if (policy < SENSORS_PROXY_BACKGROUND_NONE || policy > SENSORS_PROXY_BACKGROUND_PAUSE ||
+	    ((policy == SENSORS_PROXY_BACKGROUND_RATE || policy == SENSORS_PROXY_BACKGROUND_BATCH) &&
+	     period_ns <= 0))
+		return -EINVAL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_SET_BACKGROUND;
+	cmd.background.policy = policy;
+	cmd.background.period_ns = period_ns;
+
+	pthread_mutex_lock(&lock);
+	bg_policy = policy;
+	bg_period_ns = period_ns;
+	sendCmd(&cmd);
+	pthread_mutex_unlock(&lock);
+
+	return 0;
+}
+
+void sensors_poll_context_t::getBudget(struct sensors_proxy_budget *out)
+{
+	pthread_mutex_lock(&lock);
+	*out = budget;
+	pthread_mutex_unlock(&lock);
+}
+
+// Asks the server for its counters, the answer arrives with the events.
+// Returns 0 if it did within SENSORS_CLIENT_STATS_TIMEOUT_MS, otherwise
+// the counters reported last and -ETIMEDOUT, or -ENOTCONN while
+// reconnecting.
+int sensors_poll_context_t::getStats(struct sensors_proxy_stats *out)
+{
+	struct sensors_proxy_cmd cmd;
+	struct timespec ts;
+	int replies, ret = 0;
 
-		ret = send(sock_fd, &cmd, sizeof(cmd), 0);
-		ALOGE_IF(ret != sizeof(cmd),
-			 "fd%d: couldn't send setDelay command: %s",
-			 sock_fd, ret < 0 ? strerror(errno) : "not enough data sent");
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_GET_STATS;
+
+	pthread_mutex_lock(&lock);
+	replies = stats_replies;
+	if (sendCmd(&cmd)) {
+		ret = -ENOTCONN;
+	} else {
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += SENSORS_CLIENT_STATS_TIMEOUT_MS * 1000000LL;
+		ts.tv_sec += ts.tv_nsec / 1000000000;
+		ts.tv_nsec %= 1000000000;
+		while (stats_replies == replies && !ret)
+			ret = -pthread_cond_timedwait(&stats_cond, &lock, &ts);
 	}
+	*out = stats;
+	pthread_mutex_unlock(&lock);
+
+	// The poll thread updates these, a torn read only skews the numbers
+	out->events_received = events_received;
+	out->events_lost = events_lost;
+	return ret;
+}
+
+// Reconnects to the server after the connection failed and restores the
+// subscriptions. Enabled sensors are resumed with the timestamp of the
+// last event we got, so the server replays what we missed in between.
+// Only called from the poll thread.
+int sensors_poll_context_t::reconnect()
+{
+	struct sensors_strings_t strings[SENSORS_MAX];
+	struct sensor_t list[SENSORS_MAX];
+	struct sensors_proxy_cmd cmd;
+	int fd, lane, resumed = 0;
+
+	usleep(reconnect_ms * 1000);
+	reconnect_ms *= 2;
+	if (reconnect_ms > SENSORS_CLIENT_RECONNECT_MS_MAX)
+		reconnect_ms = SENSORS_CLIENT_RECONNECT_MS_MAX;
+
+	fd = proxy_connect();
+	if (fd < 0)
+		return -1;
+	if (proxy_recv_list(fd, strings, list) != sensors_count) {
+		ALOGE("fd%d: sensor list changed, can't resume", fd);
+		close(fd);
+		return -1;
+	}
+	lane = proxy_open_lane(fd);
+
+	pthread_mutex_lock(&lock);
+
+	sock_fd = fd;
+	lane_fd = lane;
+	rx_records = rx_credited = 0;
+	sendCredit();
+	memset(rx_seq, 0, sizeof(uint32_t) * (handle_last + 1));
+
+	memset(&cmd, 0, sizeof(cmd));
+	if (encoding != SENSORS_PROXY_ENCODING_FLOAT) {
+		cmd.cmd = SENSORS_PROXY_CMD_SET_ENCODING;
+		cmd.encoding = encoding;
+		sendCmd(&cmd);
+	}
+	sendContainer();
+	for (int handle = 0; handle <= handle_last; handle++) {
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.handle = handle;
+		if (filter_mode[handle] != SENSORS_PROXY_FILTER_NONE) {
+			cmd.cmd = SENSORS_PROXY_CMD_SET_FILTER;
+			cmd.filter.mode = filter_mode[handle];
+			cmd.filter.value = filter_value[handle];
+			sendCmd(&cmd);
+		}
+		if (delay_min_ns[handle]) {
+			cmd.cmd = SENSORS_PROXY_CMD_SET_DELAY_BAND;
+			cmd.delay_band.min_ns = delay_min_ns[handle];
+			cmd.delay_band.max_ns = delay_max_ns[handle];
+			sendCmd(&cmd);
+		}
+		if (!sensor_enabled[handle])
+			continue;
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.handle = handle;
+		if (sensor_delay_ns[handle]) {
+			cmd.cmd = SENSORS_PROXY_CMD_SET_DELAY;
+			cmd.set_delay_ns = sensor_delay_ns[handle];
+			sendCmd(&cmd);
+		}
+		if (sensor_passive[handle]) {
+			// Nothing to replay, the events may not even have been there
+			cmd.cmd = SENSORS_PROXY_CMD_ACTIVATE;
+			cmd.activate_enabled = SENSORS_PROXY_ACTIVATE_PASSIVE;
+		} else {
+			cmd.cmd = SENSORS_PROXY_CMD_RESUME;
+			cmd.resume_ns = last_timestamp[handle];
+		}
+		sendCmd(&cmd);
+		resumed++;
+	}
+
+	pthread_mutex_unlock(&lock);
+
+	ALOGI("fd%d: reconnected, resumed %d sensor(s)", sock_fd, resumed);
+	reconnect_ms = SENSORS_CLIENT_RECONNECT_MS_MIN;
 	return 0;
 }
 
+// Accounts for events the server stamped but couldn't deliver and clears
+// the sequence number again before the events are handed out. Also keeps
+// track of the last timestamp per handle for resuming.
+void sensors_poll_context_t::checkSequence(sensors_event_t *events, int n)
+{
+	for (int i = 0; i < n; i++) {
+		const int handle = events[i].sensor;
+		const uint32_t seq = events[i].reserved0;
+
+		events[i].reserved0 = 0;
+		if (handle < 0 || handle > handle_last)
+			continue;
+		if (events[i].type != SENSOR_TYPE_META_DATA)
+			last_timestamp[handle] = events[i].timestamp;
+
+		// Unsigned arithmetic handles the wrap around
+		const uint32_t gap = seq - rx_seq[handle] - 1;
+		if (gap < 0x80000000u)
+			events_lost += gap;
+		rx_seq[handle] = seq;
+	}
+	events_received += n;
+
+	if (events_lost != events_lost_logged &&
+	    now_ns() - stats_logged_ns > SENSORS_CLIENT_STATS_INTERVAL_NS) {
+		ALOGW("fd%d: %llu event(s) received, %llu lost", sock_fd,
+		      (unsigned long long)events_received, (unsigned long long)events_lost);
+		events_lost_logged = events_lost;
+		stats_logged_ns = now_ns();
+	}
+}
+
+// Closes the connection to the server, a reconnect follows
+void sensors_poll_context_t::disconnect()
+{
+	const int fd = sock_fd, lane = lane_fd;
+
+	pthread_mutex_lock(&lock);
+	sock_fd = lane_fd = -1;
+	pthread_mutex_unlock(&lock);
+	close(fd);
+	if (lane >= 0)
+		close(lane);
+}
+
+// Receives the next packet from the server on <fd>, the connection or its
+// urgent lane, and decodes it into <events>, setting <count>. <count> is
+// 0 for packets without events and on errors.
+int sensors_poll_context_t::recvEvents(int fd, sensors_event_t *events, int *count)
+{
+	const struct sensors_proxy_msg *msg = (const struct sensors_proxy_msg *)rx_buf;
+	int ret, len;
+
+	*count = 0;
+	ret = recv(fd, rx_buf, SENSORS_PROXY_PKT_MAX, 0);
+	if (ret <= 0) {
+		ALOGE("fd%d: couldn't receive sensors data: %s",
+		      fd, ret ? strerror(errno) : "peer orderly shutdown");
+		disconnect();
+		return -1;
+	}
+	len = ret - sizeof(*msg);
+	if (len < 0 || msg->count < 0 || msg->count > SENSORS_PROXY_BATCH_MAX) {
+		ALOGE("fd%d: received malformed packet of %d bytes", fd, ret);
+		return -1;
+	}
+
+	// Reading the socket frees room for more events
+	if (msg->msg == SENSORS_PROXY_MSG_EVENTS || msg->msg == SENSORS_PROXY_MSG_EVENTS_Q16) {
+		rx_records += msg->count;
+		if (rx_records - rx_credited >= SENSORS_PROXY_CREDIT_WINDOW / 4)
+			sendCredit();
+	}
+
+	switch (msg->msg) {
+	case SENSORS_PROXY_MSG_EVENTS:
+		if (len != (int)sizeof(sensors_event_t) * msg->count)
+			break;
+		memcpy(events, msg + 1, len);
+		*count = msg->count;
+		checkSequence(events, *count);
+		return 0;
+
+	case SENSORS_PROXY_MSG_EVENTS_Q16:
+		if (len != (int)sizeof(struct sensors_proxy_qevent) * msg->count)
+			break;
+		*count = sensors_codec_q16_decode((const struct sensors_proxy_qevent *)(msg + 1),
+						  msg->count, q16_scale, sensor_type, handle_last,
+						  events);
+		checkSequence(events, *count);
+		return 0;
+
+	case SENSORS_PROXY_MSG_STATS:
+		if (len != (int)sizeof(stats) || msg->count != 1)
+			break;
+		pthread_mutex_lock(&lock);
+		memcpy(&stats, msg + 1, len);
+		stats_replies++;
+		pthread_cond_broadcast(&stats_cond);
+		pthread_mutex_unlock(&lock);
+		return 0;
+
+	case SENSORS_PROXY_MSG_BUDGET:
+		if (len != (int)sizeof(budget) || msg->count != 1)
+			break;
+		pthread_mutex_lock(&lock);
+		memcpy(&budget, msg + 1, len);
+		pthread_mutex_unlock(&lock);
+		ALOGW("fd%d: service level %d: every %d event(s), batched for %lld ns, "
+		      "delay at least %lld ns, %llu event(s) shed", fd, budget.level,
+		      budget.decimation, budget.batch_ns, budget.min_delay_ns,
+		      (unsigned long long)budget.events_shed);
+		return 0;
+
+	default:
+		ALOGW("fd%d: ignoring unknown message %d", fd, msg->msg);
+		return 0;
+	}
+
+	ALOGE("fd%d: size %d doesn't match message %d with %d record(s)",
+	      fd, len, msg->msg, msg->count);
+	return -1;
+}
+
+// Copies up to <count> of the decoded events from <from> to <data>
+static int take_events(const sensors_event_t *from, int *pos, int end,
+		       sensors_event_t *data, int count)
+{
+	int n = end - *pos;
+
+	if (n > count)
+		n = count;
+	memcpy(data, &from[*pos], sizeof(sensors_event_t) * n);
+	*pos += n;
+
+	return n;
+}
+
 int sensors_poll_context_t::pollEvents(sensors_event_t * data, int count)
 {
+	struct pollfd pfd[2];
+	int bulk;
+
 	ALOGV("%s: data %p count %d", __func__, data, count);
 
-	if (sock_fd >= 0) {
-		int size = sizeof(sensors_event_t) * count;
-		char *p = (char *)data;
-		int done = 0;
-
-		// receive multiples of the sensors event size
-		do {
-			int ret = recv(sock_fd, p + done, size - done, 0);
-			if (ret <= 0) {
-				int fd = sock_fd;
-				sock_fd = -1;
-				close(fd);
-				ALOGE("fd%d: couldn't receive sensors data: %s",
-				      fd, ret ? strerror(errno) : "peer orderly shutdown");
-				break;
-			} else {
-				done += ret;
-			}
-		} while ((done % sizeof(sensors_event_t)) != 0);
-
-		return done / sizeof(sensors_event_t);
+	for (;;) {
+		if (urgent_pos < urgent_count)
+			return take_events(urgent, &urgent_pos, urgent_count, data, count);
+		if (sock_fd < 0) {
+			if (handle_last < 0)
+				return 0;	// never connected, nothing to resume
+			reconnect();
+			continue;
+		}
+
+		// Events received already only give way to urgent ones waiting,
+		// poll() skips the lane if there is none
+		bulk = pending_pos < pending_count;
+		pfd[0].fd = lane_fd;
+		pfd[0].events = POLLIN;
+		pfd[0].revents = 0;
+		pfd[1].fd = sock_fd;
+		pfd[1].events = POLLIN;
+		pfd[1].revents = 0;
+		if (poll(pfd, bulk ? 1 : 2, bulk ? 0 : -1) < 0 && errno != EINTR) {
+			ALOGE("fd%d: couldn't wait for sensors data: %s", sock_fd, strerror(errno));
+			disconnect();
+			continue;
+		}
+
+		if (pfd[0].revents) {
+			urgent_pos = 0;
+			recvEvents(lane_fd, urgent, &urgent_count);
+		} else if (bulk) {
+			return take_events(pending, &pending_pos, pending_count, data, count);
+		} else if (pfd[1].revents) {
+			pending_pos = 0;
+			recvEvents(sock_fd, pending, &pending_count);
+		}
 	}
-	return 0;
 }
 
 int sensors_poll_context_t::query(int what, int *value)
@@ -269,10 +1008,16 @@ int sensors_poll_context_t::batch(int handle, int flags, int64_t period_ns, int6
 
 /******************************************************************************/
 
+// The device opened by the sensor service, the exported functions
+// configuring its event stream work on it
+static sensors_poll_context_t *poll_context;
+
 static int poll__close(struct hw_device_t *dev)
 {
 	sensors_poll_context_t *ctx = (sensors_poll_context_t *) dev;
 	if (ctx) {
+		if (poll_context == ctx)
+			poll_context = NULL;
 		delete ctx;
 	}
 	return 0;
@@ -336,7 +1081,482 @@ static int open_sensors(const struct hw_module_t *module, const char *id,
 	dev->device.batch = poll__batch;
 
 	*device = &dev->device.common;
+	poll_context = dev;
 	status = 0;
 
 	return status;
 }
+
+/******************************************************************************/
+
+// The requests of the exported functions use a connection of their own.
+// It never has sensors enabled, so replies can't interleave with events
+// and the event stream of the HAL isn't disturbed.
+static pthread_mutex_t aux_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int aux_fd = -1;
+static unsigned aux_generation;	// incremented with every new connection
+
+// Connects on first use. Must be called with aux_mutex held.
+static int aux_connect(void)
+{
+	struct sensors_strings_t strings[SENSORS_MAX];
+	struct sensor_t list[SENSORS_MAX];
+	int fd;
+
+	if (aux_fd >= 0)
+		return aux_fd;
+
+	fd = proxy_connect();
+	if (fd < 0)
+		return -1;
+	if (proxy_recv_list(fd, strings, list) < 0) {
+		close(fd);
+		return -1;
+	}
+	aux_fd = fd;
+	aux_generation++;
+	return aux_fd;
+}
+
+// Drops a connection which failed, the next request reconnects.
+// Must be called with aux_mutex held.
+static void aux_close(void)
+{
+	if (aux_fd >= 0)
+		close(aux_fd);
+	aux_fd = -1;
+}
+
+static int aux_send_cmd(const struct sensors_proxy_cmd *cmd)
+{
+	int ret = send(aux_fd, cmd, sizeof(*cmd), 0);
+	if (ret != sizeof(*cmd)) {
+		ALOGE("fd%d: couldn't send command %d: %s", aux_fd, cmd->cmd,
+		      ret < 0 ? strerror(errno) : "not enough data sent");
+		aux_close();
+		return -1;
+	}
+	return 0;
+}
+
+// Latest value page of the server, mapped read-only on demand. It is
+// dropped once the server went away and mapped again from the running
+// one. Protected by latest_mutex.
+static pthread_mutex_t latest_mutex = PTHREAD_MUTEX_INITIALIZER;
+static const struct sensors_proxy_latest_hdr *latest_hdr;
+static size_t latest_size;
+static unsigned latest_generation;	// of the connection the page came with
+static int64_t latest_check_ns;	// last check of that connection
+static int64_t latest_map_ns = -SENSORS_CLIENT_LATEST_CHECK_NS;	// last attempt to map
+
+static void latest_map(void)
+{
+	struct sensors_proxy_cmd cmd;
+	struct sensors_proxy_msg msg;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(int))];
+	struct stat st;
+	void *map;
+	int sock, fd = -1, ret;
+
+	pthread_mutex_lock(&aux_mutex);
+
+	sock = aux_connect();
+	if (sock < 0)
+		goto out;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_GET_LATEST;
+	if (aux_send_cmd(&cmd))
+		goto out;
+
+	iov.iov_base = &msg;
+	iov.iov_len = sizeof(msg);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	ret = recvmsg(sock, &mh, MSG_CMSG_CLOEXEC);
+	cmsg = CMSG_FIRSTHDR(&mh);
+	if (ret != sizeof(msg) || msg.msg != SENSORS_PROXY_MSG_LATEST || !cmsg ||
+	    cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		ALOGE("fd%d: didn't receive the latest value page: %s", sock,
+		      ret < 0 ? strerror(errno) : "unexpected reply");
+		aux_close();
+		goto out;
+	}
+	memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+
+	if (fstat(fd, &st) || st.st_size < (off_t) sizeof(*latest_hdr)) {
+		ALOGE("latest value page has invalid size");
+		goto out;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ALOGE("couldn't map latest value page: %s", strerror(errno));
+		goto out;
+	}
+	latest_hdr = (const struct sensors_proxy_latest_hdr *)map;
+	latest_size = st.st_size;
+	latest_generation = aux_generation;
+	if (latest_hdr->magic != SENSORS_PROXY_LATEST_MAGIC ||
+	    latest_hdr->version != SENSORS_PROXY_LATEST_VERSION ||
+	    latest_hdr->slot_size != sizeof(struct sensors_proxy_latest_slot) ||
+	    sizeof(*latest_hdr) + (size_t) latest_hdr->slot_count * latest_hdr->slot_size >
+	    (size_t) st.st_size) {
+		ALOGE("latest value page has an incompatible layout");
+		munmap(map, st.st_size);
+		latest_hdr = NULL;
+		goto out;
+	}
+	ALOGI("mapped latest value page with %u slots", latest_hdr->slot_count);
+
+out:
+	if (fd >= 0)
+		close(fd);
+	pthread_mutex_unlock(&aux_mutex);
+}
+
+static void latest_unmap(void)
+{
+	munmap((void *)latest_hdr, latest_size);
+	latest_hdr = NULL;
+}
+
+// Checks if the connection the page came with is still up, a server which
+// crashed couldn't mark the page as stale
+static int latest_alive(void)
+{
+	char c;
+	int ret, alive;
+
+	pthread_mutex_lock(&aux_mutex);
+	alive = aux_fd >= 0 && aux_generation == latest_generation;
+	if (alive) {
+		ret = recv(aux_fd, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+		if (!ret || (ret < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+			aux_close();
+			alive = 0;
+		}
+	}
+	pthread_mutex_unlock(&aux_mutex);
+	return alive;
+}
+
+static int latest_read(int handle, sensors_event_t *event)
+{
+	const struct sensors_proxy_latest_slot *slot;
+	uint32_t seq;
+	int retry;
+
+	if (!latest_hdr || handle < 0 || handle >= (int)latest_hdr->slot_count)
+		return -ENODEV;
+
+	slot = (const struct sensors_proxy_latest_slot *)(latest_hdr + 1) + handle;
+	for (retry = 0; retry < SENSORS_CLIENT_LATEST_RETRY_MAX; retry++) {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (!seq)
+			return -EAGAIN;
+		if (seq & 1)
+			continue;	// writer active
+		memcpy(event, &slot->event, sizeof(*event));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq)
+			return 0;
+	}
+	return -EBUSY;
+}
+
+int sensors_proxy_read_latest(int handle, sensors_event_t *event)
+{
+	struct timespec ts;
+	int64_t now;
+	int ret;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	now = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	pthread_mutex_lock(&latest_mutex);
+	if (latest_hdr && now - latest_check_ns >= SENSORS_CLIENT_LATEST_CHECK_NS) {
+		latest_check_ns = now;
+		if (!latest_alive()) {
+			ALOGI("server went away, dropping latest value page");
+			latest_unmap();
+		}
+	}
+	// The server clears the magic when it stops
+	if (latest_hdr &&
+	    __atomic_load_n(&latest_hdr->magic, __ATOMIC_RELAXED) != SENSORS_PROXY_LATEST_MAGIC) {
+		ALOGI("server stopped, dropping latest value page");
+		latest_unmap();
+	}
+	if (!latest_hdr && now - latest_map_ns >= SENSORS_CLIENT_LATEST_CHECK_NS) {
+		latest_map_ns = latest_check_ns = now;
+		latest_map();
+	}
+	ret = latest_read(handle, event);
+	pthread_mutex_unlock(&latest_mutex);
+	return ret;
+}
+
+// Sends <cmd> and collects the records of the chunked reply into
+// <records>, chunks are tagged <msg> except for the last one which is
+// tagged <msg_end>. Returns the number of records or a negative errno.
+static int aux_request(const struct sensors_proxy_cmd *cmd, int msg_id, int msg_end,
+		       void *records, size_t size, int count)
+{
+	const struct sensors_proxy_msg *msg;
+	char *buf;
+	int ret, len, done = 0;
+
+	buf = (char *)malloc(SENSORS_PROXY_PKT_MAX);
+	if (!buf)
+		return -ENOMEM;
+	msg = (const struct sensors_proxy_msg *)buf;
+
+	pthread_mutex_lock(&aux_mutex);
+
+	if (aux_connect() < 0) {
+		done = -ENODEV;
+		goto out;
+	}
+
+	if (aux_send_cmd(cmd)) {
+		done = -EIO;
+		goto out;
+	}
+
+	// The reply comes as a sequence of packets, the last one is marked
+	do {
+		ret = recv(aux_fd, buf, SENSORS_PROXY_PKT_MAX, 0);
+		len = ret - sizeof(*msg);
+		if (ret <= 0 || len < 0 || msg->count < 0 || msg->count > count - done ||
+		    len != (int)size * msg->count ||
+		    (msg->msg != msg_id && msg->msg != msg_end)) {
+			ALOGE("fd%d: invalid reply to command %d: %s", aux_fd, cmd->cmd,
+			      ret < 0 ? strerror(errno) : "unexpected packet");
+			aux_close();
+			done = -EIO;
+			goto out;
+		}
+		memcpy((char *)records + done * size, msg + 1, len);
+		done += msg->count;
+	} while (msg->msg != msg_end);
+
+out:
+	pthread_mutex_unlock(&aux_mutex);
+	free(buf);
+	return done;
+}
+
+int sensors_proxy_get_history(int handle, int64_t t0_ns, int64_t t1_ns,
+			      sensors_event_t *events, int count)
+{
+	struct sensors_proxy_cmd cmd;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_GET_HISTORY;
+	cmd.handle = handle;
+	cmd.history.t0_ns = t0_ns;
+	cmd.history.t1_ns = t1_ns;
+	cmd.history.max = count;
+
+	return aux_request(&cmd, SENSORS_PROXY_MSG_HISTORY, SENSORS_PROXY_MSG_HISTORY_END,
+			   events, sizeof(sensors_event_t), count);
+}
+
+int sensors_proxy_get_rollups(int handle, int level, int64_t t0_ns, int64_t t1_ns,
+			      struct sensors_proxy_rollup *rollups, int count)
+{
+	struct sensors_proxy_cmd cmd;
+
+	if (level < 0 || level >= SENSORS_PROXY_ROLLUP_LEVELS)
+		return -EINVAL;
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_GET_ROLLUP;
+	cmd.handle = handle;
+	cmd.history.t0_ns = t0_ns;
+	cmd.history.t1_ns = t1_ns;
+	cmd.history.max = count;
+	cmd.history.level = level;
+
+	return aux_request(&cmd, SENSORS_PROXY_MSG_ROLLUP, SENSORS_PROXY_MSG_ROLLUP_END,
+			   rollups, sizeof(*rollups), count);
+}
+
+int sensors_proxy_set_filter(int handle, int mode, float value)
+{
+	if (!poll_context)
+		return -ENODEV;
+	return poll_context->setFilter(handle, mode, value);
+}
+
+int sensors_proxy_set_passive(int handle, int passive)
+{
+	if (!poll_context)
+		return -ENODEV;
+	return poll_context->setPassive(handle, passive);
+}
+
+int sensors_proxy_set_delay_band(int handle, int64_t min_ns, int64_t max_ns)
+{
+	if (!poll_context)
+		return -ENODEV;
+	return poll_context->setDelayBand(handle, min_ns, max_ns);
+}
+
+int sensors_proxy_set_background(int policy, int64_t period_ns)
+{
+	if (!poll_context)
+		return -ENODEV;
+	return poll_context->setBackground(policy, period_ns);
+}
+
+int sensors_proxy_get_budget(struct sensors_proxy_budget *budget)
+{
+	if (!poll_context)
+		return -ENODEV;
+	poll_context->getBudget(budget);
+	return 0;
+}
+
+int sensors_proxy_get_stats(struct sensors_proxy_stats *stats)
+{
+	if (!poll_context)
+		return -ENODEV;
+	return poll_context->getStats(stats);
+}
+
+// Derived streams have a connection each, it carries nothing but the
+// events of the stream
+struct sensors_proxy_stream {
+	int fd;			// -1 while disconnected
+	int handle;
+	struct sensors_proxy_derive config;
+	sensors_event_t pending[SENSORS_PROXY_BATCH_MAX];	// received, not yet read
+	int pending_pos;
+	int pending_count;
+};
+
+// Connects the stream and subscribes to it. Returns 0, -EINVAL if the
+// sensor doesn't support the configuration or -ENODEV.
+static int stream_connect(struct sensors_proxy_stream *stream)
+{
+	struct sensors_strings_t strings[SENSORS_MAX];
+	struct sensor_t list[SENSORS_MAX];
+	struct sensors_proxy_cmd cmd;
+	int fd, i, count, values = 0, ret;
+
+	fd = proxy_connect();
+	if (fd < 0)
+		return -ENODEV;
+	count = proxy_recv_list(fd, strings, list);
+	if (count < 0) {
+		close(fd);
+		return -ENODEV;
+	}
+	for (i = 0; i < count; i++) {
+		if (list[i].handle == stream->handle)
+			values = sensors_codec_values(list[i].type);
+	}
+	if (sderive_config(&stream->config, values) < 0) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	memset(&cmd, 0, sizeof(cmd));
+	cmd.cmd = SENSORS_PROXY_CMD_DERIVE;
+	cmd.handle = stream->handle;
+	cmd.derive.enabled = 1;
+	cmd.derive.config = stream->config;
+	ret = send(fd, &cmd, sizeof(cmd), 0);
+	if (ret != sizeof(cmd)) {
+		ALOGE("fd%d: couldn't subscribe to derived stream: %s", fd,
+		      ret < 0 ? strerror(errno) : "not enough data sent");
+		close(fd);
+		return -ENODEV;
+	}
+	stream->fd = fd;
+	return 0;
+}
+
+struct sensors_proxy_stream *sensors_proxy_stream_open(int handle,
+							const struct sensors_proxy_derive *config)
+{
+	struct sensors_proxy_stream *stream;
+	int err;
+
+	stream = (struct sensors_proxy_stream *)calloc(1, sizeof(*stream));
+	if (!stream) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	stream->handle = handle;
+	stream->config = *config;
+
+	err = stream_connect(stream);
+	if (err) {
+		free(stream);
+		errno = -err;
+		return NULL;
+	}
+	ALOGI("fd%d: opened derived stream %d of sensor %d", stream->fd, config->kind, handle);
+	return stream;
+}
+
+int sensors_proxy_stream_read(struct sensors_proxy_stream *stream, sensors_event_t *events,
+			      int count)
+{
+	char buf[SENSORS_PROXY_PKT_MAX];
+	const struct sensors_proxy_msg *msg = (const struct sensors_proxy_msg *)buf;
+	int ret, len, n;
+
+	while (stream->pending_pos >= stream->pending_count) {
+		if (stream->fd < 0) {
+			usleep(SENSORS_CLIENT_RECONNECT_MS_MIN * 1000);
+			if (stream_connect(stream))
+				return -EIO;
+		}
+		ret = recv(stream->fd, buf, sizeof(buf), 0);
+		len = ret - sizeof(*msg);
+		if (ret <= 0) {
+			ALOGE("fd%d: derived stream lost: %s", stream->fd,
+			      ret ? strerror(errno) : "peer orderly shutdown");
+			close(stream->fd);
+			stream->fd = -1;
+			continue;
+		}
+		if (len < 0 || msg->msg != SENSORS_PROXY_MSG_EVENTS || msg->count < 0 ||
+		    msg->count > SENSORS_PROXY_BATCH_MAX ||
+		    len != (int)sizeof(sensors_event_t) * msg->count) {
+			ALOGW("fd%d: ignoring unexpected packet of %d bytes", stream->fd, ret);
+			continue;
+		}
+		memcpy(stream->pending, msg + 1, len);
+		stream->pending_pos = 0;
+		stream->pending_count = msg->count;
+	}
+
+	n = stream->pending_count - stream->pending_pos;
+	if (n > count)
+		n = count;
+	memcpy(events, &stream->pending[stream->pending_pos], sizeof(sensors_event_t) * n);
+	stream->pending_pos += n;
+	for (int i = 0; i < n; i++)
+		events[i].reserved0 = 0;
+
+	return n;
+}
+
+void sensors_proxy_stream_close(struct sensors_proxy_stream *stream)
+{
+	// Closing the connection ends the subscription
+	if (stream->fd >= 0)
+		close(stream->fd);
+	free(stream);
+}
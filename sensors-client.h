@@ -0,0 +1,139 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef ANDROID_SENSORS_CLIENT_H
+#define ANDROID_SENSORS_CLIENT_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+
+#include "sensors-proxy.h"
+
+// Functions exported by sensors-client.default.so in addition to the
+// sensors HAL interface, for native consumers inside a container.
+
+__BEGIN_DECLS
+
+// Copies the latest event of sensor <handle> into <event>. The server's
+// latest value page is mapped on first use, afterwards reading doesn't
+// need the server. Once a second the connection to the server is checked,
+// after a restart the page of the new server is mapped. Values are only
+// updated while some client has the sensor enabled, check the event
+// timestamp for staleness.
+// Returns 0 on success, -EAGAIN if the sensor didn't deliver an event yet,
+// -ENODEV if the page isn't available or <handle> is invalid.
+int sensors_proxy_read_latest(int handle, sensors_event_t *event);
+
+// Fetches up to <count> events of sensor <handle> with timestamps within
+// [t0_ns, t1_ns] from the history the server retains for every sensor
+// while it is enabled (a few seconds). The events are returned in
+// chronological order, starting with the oldest one in the window.
+// Returns the number of events copied to <events> or a negative errno.
+int sensors_proxy_get_history(int handle, int64_t t0_ns, int64_t t1_ns,
+			      sensors_event_t *events, int count);
+
+// Fetches up to <count> min/max/mean buckets of sensor <handle> at
+// resolution <level> (SENSORS_PROXY_ROLLUP_*) which start within
+// [t0_ns, t1_ns], oldest first. The last bucket may still be filling.
+// The server keeps minutes to hours of rollups depending on the level,
+// covering the time the sensor was enabled.
+// Returns the number of buckets copied to <rollups> or a negative errno.
+int sensors_proxy_get_rollups(int handle, int level, int64_t t0_ns, int64_t t1_ns,
+			      struct sensors_proxy_rollup *rollups, int count);
+
+// Lets the server filter the events of sensor <handle> delivered to the
+// sensors HAL of this process with filter <mode> (SENSORS_PROXY_FILTER_*)
+// and its threshold or deadband <value>. The filter applies to every
+// consumer of the sensor and persists across reconnects. Returns 0 on
+// success, -ENODEV if the HAL isn't open, -EINVAL if <handle> is invalid.
+int sensors_proxy_set_filter(int handle, int mode, float value);
+
+// Makes the subscription of the sensors HAL of this process to sensor
+// <handle> passive or active again. A passive subscriber only gets events
+// while some other client keeps the sensor enabled and never affects its
+// rate. Applies to a running subscription right away. Setting the property
+// persist.trustme.sensors.passive to 1 makes all subscriptions passive.
+// Returns 0 on success, -ENODEV if the HAL isn't open, -EINVAL if <handle>
+// is invalid.
+int sensors_proxy_set_passive(int handle, int passive);
+
+// Tells the server that the sensors HAL of this process is content with
+// any delay of sensor <handle> within [min_ns, max_ns], besides the one
+// set by setDelay(). The server then keeps the hardware at a rate other
+// clients already need if it lies within the band, instead of retuning
+// it. A <min_ns> of 0 only accepts the delay set again. Persists across
+// reconnects. Returns 0 on success, -ENODEV if the HAL isn't open,
+// -EINVAL if <handle> or the band is invalid.
+int sensors_proxy_set_delay_band(int handle, int64_t min_ns, int64_t max_ns);
+
+// Selects how the server delivers events to the sensors HAL of this process
+// while its container is in the background, <policy> is one of
+// SENSORS_PROXY_BACKGROUND_* and <period_ns> the decimation period or
+// batch latency. The server only accepts policies at least as strict as
+// the one of the QoS class of this process and applies the class' policy
+// otherwise, SENSORS_PROXY_BACKGROUND_NONE thus leaves the choice to the
+// class. Only takes effect if the property ro.trustme.sensors.container
+// names the container, the initial policy is taken from
+// persist.trustme.sensors.background. Returns 0 on success,
+// -ENODEV if the HAL isn't open, -EINVAL if the policy is invalid.
+int sensors_proxy_set_background(int policy, int64_t period_ns);
+
+// Copies the service level the server last reported for the sensors HAL
+// of this process to <budget>. The server reports it whenever it
+// downgrades the delivery to keep an event budget, upgrades it again, or
+// limits a delay asked for. Returns 0 on success, -ENODEV if the HAL isn't
+// open.
+int sensors_proxy_get_budget(struct sensors_proxy_budget *budget);
+
+// Copies the event and command counters of the connection of the sensors
+// HAL of this process to <stats>. The server answers through the event
+// stream, so the answer only arrives while sensor events are polled.
+// Returns 0 on success, -ENODEV if the HAL isn't open, -ETIMEDOUT with the
+// counters reported last if the server didn't answer in time, -ENOTCONN
+// while reconnecting.
+int sensors_proxy_get_stats(struct sensors_proxy_stats *stats);
+
+// Stream of events the server derives from sensor <handle> as described
+// by <config>, see SENSORS_PROXY_DERIVE_*. Subscribers with the same
+// configuration share the computation. Each stream uses a connection of
+// its own, which is restored if the server restarts.
+struct sensors_proxy_stream;
+
+// Returns the stream or NULL with errno set to EINVAL if the sensor
+// doesn't support <config>, or to another errno value if the server can't
+// be reached.
+struct sensors_proxy_stream *sensors_proxy_stream_open(int handle,
+							const struct sensors_proxy_derive *config);
+
+// Waits for derived events and copies up to <count> of them to <events>.
+// Returns the number of events or a negative errno.
+int sensors_proxy_stream_read(struct sensors_proxy_stream *stream, sensors_event_t *events,
+			      int count);
+
+void sensors_proxy_stream_close(struct sensors_proxy_stream *stream);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_CLIENT_H
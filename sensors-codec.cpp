@@ -0,0 +1,152 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "sensors-codec.h"
+
+#define QV SENSORS_PROXY_QVALUES_MAX
+#define Q16_MAX 32767.0f
+#define Q16_MIN -32768.0f
+
+int sensors_codec_values(int type)
+{
+	switch (type) {
+	case SENSOR_TYPE_LIGHT:
+	case SENSOR_TYPE_PRESSURE:
+	case SENSOR_TYPE_TEMPERATURE:
+	case SENSOR_TYPE_PROXIMITY:
+	case SENSOR_TYPE_RELATIVE_HUMIDITY:
+	case SENSOR_TYPE_AMBIENT_TEMPERATURE:
+		return 1;
+	case SENSOR_TYPE_ACCELEROMETER:
+	case SENSOR_TYPE_MAGNETIC_FIELD:
+	case SENSOR_TYPE_ORIENTATION:
+	case SENSOR_TYPE_GYROSCOPE:
+	case SENSOR_TYPE_GRAVITY:
+	case SENSOR_TYPE_LINEAR_ACCELERATION:
+		return 3;
+	case SENSOR_TYPE_GAME_ROTATION_VECTOR:
+		return 4;
+	case SENSOR_TYPE_ROTATION_VECTOR:
+	case SENSOR_TYPE_GEOMAGNETIC_ROTATION_VECTOR:
+		return 5;
+	case SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED:
+	case SENSOR_TYPE_GYROSCOPE_UNCALIBRATED:
+		return 6;
+	default:
+		return 0;	// meta data, counters and triggers stay as they are
+	}
+}
+
+float sensors_codec_q16_scale(const struct sensor_t *s)
+{
+	if (!sensors_codec_values(s->type) || s->resolution <= 0 || s->maxRange <= 0)
+		return 0;
+
+	// Only quantize if the whole range fits into 16 bit at the hardware
+	// resolution, otherwise we would lose precision the sensor provides.
+	if (s->maxRange / s->resolution > Q16_MAX)
+		return 0;
+
+	return s->resolution;
+}
+
+void sensors_codec_q16_encode(const sensors_event_t *events, int n, const float *scale,
+			      struct sensors_proxy_qevent *out)
+{
+	float in[n * QV], inv[n * QV];
+	int16_t q[n * QV];
+	int i, k;
+
+	// Gather values and per-value inverse scale into flat arrays, so the
+	// conversion runs as a single loop over the whole batch which the
+	// compiler vectorizes.
+	for (i = 0; i < n; i++) {
+		const sensors_event_t *ev = &events[i];
+		const int count = sensors_codec_values(ev->type);
+		const float r = 1.0f / scale[ev->sensor];
+
+		for (k = 0; k < QV; k++) {
+			in[i * QV + k] = k < count ? ev->data[k] : 0.0f;
+			inv[i * QV + k] = r;
+		}
+		out[i].timestamp = ev->timestamp;
+		out[i].sensor = ev->sensor;
+		out[i].status = count == 3 ? ev->acceleration.status : 0;
+		memset(out[i].reserved, 0, sizeof(out[i].reserved));
+		out[i].seq = ev->reserved0;
+	}
+
+	for (k = 0; k < n * QV; k++) {
+		float v = in[k] * inv[k];
+		v = v < Q16_MAX ? v : Q16_MAX;
+		v = v > Q16_MIN ? v : Q16_MIN;
+		q[k] = (int16_t)(v + (v < 0 ? -0.5f : 0.5f));	// round to nearest
+	}
+
+	for (i = 0; i < n; i++)
+		memcpy(out[i].data, &q[i * QV], sizeof(out[i].data));
+}
+
+int sensors_codec_q16_decode(const struct sensors_proxy_qevent *qevents, int n,
+			     const float *scale, const int *type, int handle_last,
+			     sensors_event_t *out)
+{
+	int16_t q[n * QV];
+	float mul[n * QV], v[n * QV];
+	int8_t status[n];
+	int i, k, done = 0;
+
+	for (i = 0; i < n; i++) {
+		const int handle = qevents[i].sensor;
+		if (handle < 0 || handle > handle_last || scale[handle] <= 0)
+			continue;
+
+		memcpy(&q[done * QV], qevents[i].data, sizeof(qevents[i].data));
+		for (k = 0; k < QV; k++)
+			mul[done * QV + k] = scale[handle];
+
+		memset(&out[done], 0, sizeof(out[done]));
+		out[done].version = sizeof(sensors_event_t);
+		out[done].sensor = handle;
+		out[done].type = type[handle];
+		out[done].reserved0 = qevents[i].seq;
+		out[done].timestamp = qevents[i].timestamp;
+		status[done] = qevents[i].status;
+		done++;
+	}
+
+	for (k = 0; k < done * QV; k++)
+		v[k] = q[k] * mul[k];
+
+	for (i = 0; i < done; i++) {
+		const int count = sensors_codec_values(out[i].type);
+		memcpy(out[i].data, &v[i * QV], sizeof(float) * count);
+		if (count == 3)
+			out[i].acceleration.status = status[i];
+	}
+
+	return done;
+}
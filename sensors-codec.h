@@ -0,0 +1,62 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef ANDROID_SENSORS_CODEC_H
+#define ANDROID_SENSORS_CODEC_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+
+#include "sensors-proxy.h"
+
+__BEGIN_DECLS
+
+// Number of float values carried by events of sensor <type> which are
+// eligible for the Q16 encoding, 0 if the type can't be quantized.
+int sensors_codec_values(int type);
+
+// Returns the Q16 scale (value of one LSB) for sensor <s> or 0 if the
+// sensor's resolution doesn't fit into 16 bit over its whole range.
+// Server and client both derive the scale from the sensor list, so it
+// never needs to be transmitted.
+float sensors_codec_q16_scale(const struct sensor_t *s);
+
+// Encodes <n> events into <out>, the sequence number is taken from
+// reserved0. <scale> is indexed by handle and must have a non-zero entry
+// for every event passed in.
+void sensors_codec_q16_encode(const sensors_event_t *events, int n, const float *scale,
+			      struct sensors_proxy_qevent *out);
+
+// Expands <n> quantized events into <out>, restoring the sequence number
+// into reserved0. <scale> and <type> are indexed by handle, <handle_last>
+// is the highest valid index. Returns the number of events decoded;
+// events for unknown handles are skipped.
+int sensors_codec_q16_decode(const struct sensors_proxy_qevent *qevents, int n,
+			     const float *scale, const int *type, int handle_last,
+			     sensors_event_t *out);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_CODEC_H
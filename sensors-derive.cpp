@@ -0,0 +1,598 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include <errno.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensors-derive.h"
+
+#define L SDERIVE_LANES
+
+static int sderive_power_of_two(int n)
+{
+	return n > 0 && !(n & (n - 1));
+}
+
+int sderive_config(struct sensors_proxy_derive *config, int values)
+{
+	struct sensors_proxy_derive c;
+
+	if (values <= 0 || config->period_ns < 0)
+		return -EINVAL;
+
+	memset(&c, 0, sizeof(c));
+	c.kind = config->kind;
+	c.period_ns = config->period_ns;
+
+	switch (config->kind) {
+	case SENSORS_PROXY_DERIVE_AGGREGATE:
+		c.aggregate.window_ns = config->aggregate.window_ns;
+		c.aggregate.hop_ns = config->aggregate.hop_ns ? config->aggregate.hop_ns :
+		    config->aggregate.window_ns;
+		if (c.aggregate.window_ns <= 0 || c.aggregate.hop_ns <= 0 ||
+		    c.aggregate.window_ns % c.aggregate.hop_ns ||
+		    c.aggregate.window_ns / c.aggregate.hop_ns > SDERIVE_PANES_MAX)
+			return -EINVAL;
+		if (values > SENSORS_PROXY_AGGREGATE_VALUES_MAX)
+			values = SENSORS_PROXY_AGGREGATE_VALUES_MAX;
+		break;
+	case SENSORS_PROXY_DERIVE_SPECTRUM:
+		c.spectrum.size = config->spectrum.size;
+		if (!c.spectrum.size)
+			break;	// joins the configured spectrum
+		c.spectrum.hop = config->spectrum.hop;
+		c.spectrum.band_count = config->spectrum.band_count;
+		if (!sderive_power_of_two(c.spectrum.size) ||
+		    c.spectrum.size < SENSORS_PROXY_SPECTRUM_SIZE_MIN ||
+		    c.spectrum.size > SENSORS_PROXY_SPECTRUM_SIZE_MAX ||
+		    c.spectrum.hop <= 0 || c.spectrum.hop > c.spectrum.size ||
+		    c.spectrum.band_count <= 0 ||
+		    c.spectrum.band_count > SENSORS_PROXY_SPECTRUM_BANDS_MAX)
+			return -EINVAL;
+		for (int i = 0; i < c.spectrum.band_count; i++) {
+			const float *band = config->spectrum.bands[i];
+			if (!(band[0] >= 0 && band[1] > band[0]))
+				return -EINVAL;
+			c.spectrum.bands[i][0] = band[0];
+			c.spectrum.bands[i][1] = band[1];
+		}
+		break;
+	case SENSORS_PROXY_DERIVE_RESAMPLE:
+		c.resample.grid_ns = config->resample.grid_ns;
+		c.resample.method = config->resample.method;
+		if (c.resample.grid_ns <= 0 || c.resample.method < SENSORS_PROXY_RESAMPLE_LINEAR ||
+		    c.resample.method > SENSORS_PROXY_RESAMPLE_CUBIC)
+			return -EINVAL;
+		break;
+	case SENSORS_PROXY_DERIVE_PREDICT:
+		c.predict.horizon_ns = config->predict.horizon_ns;
+		if (c.predict.horizon_ns < 0 ||
+		    c.predict.horizon_ns > SENSORS_PROXY_PREDICT_HORIZON_MAX_NS)
+			return -EINVAL;
+		if (values != 4 && values != 5)
+			return -EINVAL;	// not a rotation vector
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	*config = c;
+	return values;
+}
+
+int sderive_match(const struct sensors_proxy_derive *config,
+		  const struct sensors_proxy_derive *stream)
+{
+	if (config->kind == SENSORS_PROXY_DERIVE_SPECTRUM && !config->spectrum.size)
+		return stream->kind == config->kind;
+	return !memcmp(config, stream, sizeof(*config));
+}
+
+static int sderive_spectrum_init(struct sderive_spectrum *sp, int size)
+{
+	const int half = size / 2;
+	float *f;
+	int h, j;
+
+	if (!size)
+		return -EINVAL;	// nothing configured to join
+
+	f = (float *)calloc(2 * size + 7 * half, sizeof(float));
+	sp->timestamps = (int64_t *)calloc(size, sizeof(int64_t));
+	if (!f || !sp->timestamps) {
+		free(f);
+		free(sp->timestamps);
+		return -ENOMEM;
+	}
+	sp->samples = f;
+	sp->window = f + size;
+	sp->tw_re = f + 2 * size;
+	sp->tw_im = sp->tw_re + half;
+	sp->rot_re = sp->tw_im + half;
+	sp->rot_im = sp->rot_re + half;
+	sp->re = sp->rot_im + half;
+	sp->im = sp->re + half;
+	sp->power = sp->im + half;
+
+	for (j = 0; j < size; j++) {
+		sp->window[j] = 0.5f - 0.5f * cosf(2 * (float)M_PI * j / size);
+		sp->window_power += sp->window[j] * sp->window[j];
+	}
+	for (j = 0; j < half; j++) {
+		sp->rot_re[j] = cosf(2 * (float)M_PI * j / size);
+		sp->rot_im[j] = -sinf(2 * (float)M_PI * j / size);
+	}
+	// Twiddles of the complex transform of size 'half' per stage, laid
+	// out contiguously so the butterfly loops read them sequentially
+	for (h = 1; h < half; h *= 2) {
+		for (j = 0; j < h; j++) {
+			sp->tw_re[h + j] = sp->rot_re[j * (half / h)];
+			sp->tw_im[h + j] = sp->rot_im[j * (half / h)];
+		}
+	}
+	return 0;
+}
+
+int sderive_init(struct sderive *d, int handle, int aux_handle,
+		 const struct sensors_proxy_derive *config, int values)
+{
+	struct sderive_aggregate *a = &d->aggregate;
+
+	memset(d, 0, sizeof(*d));
+	d->config = *config;
+	d->handle = handle;
+	d->aux_handle = aux_handle;
+	d->values = values;
+
+	switch (config->kind) {
+	case SENSORS_PROXY_DERIVE_AGGREGATE:
+		a->pane_count = config->aggregate.window_ns / config->aggregate.hop_ns;
+		a->panes = (struct sderive_pane *)calloc(a->pane_count, sizeof(*a->panes));
+		if (!a->panes)
+			return -ENOMEM;
+		a->cur_id = -1;
+		break;
+	case SENSORS_PROXY_DERIVE_SPECTRUM:
+		return sderive_spectrum_init(&d->spectrum, config->spectrum.size);
+	case SENSORS_PROXY_DERIVE_RESAMPLE:
+		break;
+	case SENSORS_PROXY_DERIVE_PREDICT:
+		if (aux_handle < 0)
+			return -EINVAL;	// no gyroscope to predict with
+		break;
+	default:
+		return -EINVAL;
+	}
+	return 0;
+}
+
+void sderive_free(struct sderive *d)
+{
+	switch (d->config.kind) {
+	case SENSORS_PROXY_DERIVE_AGGREGATE:
+		free(d->aggregate.panes);
+		d->aggregate.panes = NULL;
+		break;
+	case SENSORS_PROXY_DERIVE_SPECTRUM:
+		free(d->spectrum.samples);
+		free(d->spectrum.timestamps);
+		d->spectrum.samples = NULL;
+		d->spectrum.timestamps = NULL;
+		break;
+	}
+	free(d->out);
+	d->out = NULL;
+	d->out_size = 0;
+}
+
+static sensors_event_t *sderive_out(struct sderive *d, int type, int64_t timestamp)
+{
+	sensors_event_t *o;
+
+	if (d->out_count >= d->out_limit) {
+		d->out_dropped++;
+		return NULL;
+	}
+
+	o = &d->out[d->out_count++];
+	memset(o, 0, sizeof(*o));
+	o->version = sizeof(sensors_event_t);
+	o->sensor = d->handle;
+	o->type = type;
+	o->timestamp = timestamp;
+	return o;
+}
+
+// Emits the window ending with pane 'cur_id'. Panes which didn't receive
+// events or belong to an earlier window are skipped.
+static void sderive_aggregate_emit(struct sderive *d)
+{
+	struct sderive_aggregate *a = &d->aggregate;
+	const int v = d->values;
+	float sum[L], sumsq[L], mean[L], var[L];
+	sensors_event_t *o;
+	int i, k, count = 0;
+
+	if (a->cur_id - a->first_id + 1 < a->pane_count)
+		return;
+
+	for (k = 0; k < L; k++)
+		sum[k] = sumsq[k] = 0;
+	for (i = 0; i < a->pane_count; i++) {
+		const struct sderive_pane *p = &a->panes[i];
+
+		if (p->id <= a->cur_id - a->pane_count || p->id > a->cur_id || !p->count)
+			continue;
+		for (k = 0; k < L; k++) {
+			sum[k] += p->sum[k];
+			sumsq[k] += p->sumsq[k];
+		}
+		count += p->count;
+	}
+	if (!count)
+		return;
+
+	// Moments of the shifted values, the shift only moves the mean
+	for (k = 0; k < L; k++) {
+		const float m = sum[k] / count;
+		var[k] = sumsq[k] / count - m * m;
+		var[k] = var[k] > 0 ? var[k] : 0;
+		mean[k] = m + a->shift[k];
+	}
+
+	o = sderive_out(d, SENSORS_PROXY_TYPE_AGGREGATE,
+			(a->cur_id + 1) * d->config.aggregate.hop_ns);
+	if (!o)
+		return;
+	for (k = 0; k < v; k++) {
+		o->data[k] = mean[k];
+		o->data[v + k] = var[k];
+		o->data[2 * v + k] = sqrtf(var[k] + mean[k] * mean[k]);
+	}
+	o->data[15] = count;
+}
+
+static void sderive_aggregate_add(struct sderive *d, const sensors_event_t *ev)
+{
+	struct sderive_aggregate *a = &d->aggregate;
+	const int64_t id = ev->timestamp / d->config.aggregate.hop_ns;
+	struct sderive_pane *p;
+	float x[L];
+	int k;
+
+	for (k = 0; k < L; k++)
+		x[k] = k < d->values ? ev->data[k] : 0.0f;
+
+	if (a->cur_id < 0) {
+		memcpy(a->shift, x, sizeof(a->shift));
+		a->first_id = a->cur_id = id;
+		memset(&a->panes[id % a->pane_count], 0, sizeof(*p));
+		a->panes[id % a->pane_count].id = id;
+	} else if (id > a->cur_id) {
+		// The pane is complete, the window ending with it as well
+		sderive_aggregate_emit(d);
+		a->cur_id = id;
+		memset(&a->panes[id % a->pane_count], 0, sizeof(*p));
+		a->panes[id % a->pane_count].id = id;
+	} else if (id < a->cur_id) {
+		return;		// late event of a window already emitted
+	}
+
+	p = &a->panes[id % a->pane_count];
+	for (k = 0; k < L; k++) {
+		const float dx = x[k] - a->shift[k];
+		p->sum[k] += dx;
+		p->sumsq[k] += dx * dx;
+	}
+	p->count++;
+}
+
+// In-place complex transform of size n of re + i * im, radix 2 with
+// decimation in time
+static void sderive_fft(const struct sderive_spectrum *sp, float *re, float *im, int n)
+{
+	int i, j, k, h;
+
+	for (i = 1, j = 0; i < n; i++) {
+		int bit = n >> 1;
+		for (; j & bit; bit >>= 1)
+			j ^= bit;
+		j |= bit;
+		if (i < j) {
+			float t = re[i];
+			re[i] = re[j];
+			re[j] = t;
+			t = im[i];
+			im[i] = im[j];
+			im[j] = t;
+		}
+	}
+
+	for (h = 1; h < n; h *= 2) {
+		const float *wr = &sp->tw_re[h], *wi = &sp->tw_im[h];
+		for (i = 0; i < n; i += 2 * h) {
+			float *ar = &re[i], *ai = &im[i], *br = &re[i + h], *bi = &im[i + h];
+			for (k = 0; k < h; k++) {
+				const float tr = br[k] * wr[k] - bi[k] * wi[k];
+				const float ti = br[k] * wi[k] + bi[k] * wr[k];
+				br[k] = ar[k] - tr;
+				bi[k] = ai[k] - ti;
+				ar[k] += tr;
+				ai[k] += ti;
+			}
+		}
+	}
+}
+
+// Transforms the last 'size' samples and emits their band energies
+static void sderive_spectrum_emit(struct sderive *d)
+{
+	struct sderive_spectrum *sp = &d->spectrum;
+	const int size = d->config.spectrum.size, half = size / 2;
+	const int64_t t0 = sp->timestamps[sp->pos], t1 = sp->timestamps[(sp->pos + size - 1) % size];
+	float x[size], mean = 0, rate, scale, peak = 0;
+	sensors_event_t *o;
+	int i, k, peak_bin = 0;
+
+	if (t1 <= t0)
+		return;
+	rate = (size - 1) * 1e9f / (t1 - t0);
+
+	// Oldest sample first, without the mean and weighted by the window
+	for (i = 0; i < size; i++)
+		x[i] = sp->samples[(sp->pos + i) % size];
+	for (i = 0; i < size; i++)
+		mean += x[i];
+	mean /= size;
+	for (i = 0; i < size; i++)
+		x[i] = (x[i] - mean) * sp->window[i];
+
+	// The real transform of size n is a complex one of size n/2 over the
+	// even and odd samples, split up afterwards
+	for (i = 0; i < half; i++) {
+		sp->re[i] = x[2 * i];
+		sp->im[i] = x[2 * i + 1];
+	}
+	sderive_fft(sp, sp->re, sp->im, half);
+
+	// Mean square per one-sided bin, by Parseval
+	scale = 2.0f / (size * sp->window_power);
+	sp->power[0] = 0;
+	for (k = 1; k < half; k++) {
+		const float zr = sp->re[k], zi = sp->im[k];
+		const float cr = sp->re[half - k], ci = -sp->im[half - k];
+		const float er = 0.5f * (zr + cr), ei = 0.5f * (zi + ci);
+		const float dr = 0.5f * (zi - ci), di = -0.5f * (zr - cr);	// (z - c) / 2i
+		const float xr = er + sp->rot_re[k] * dr - sp->rot_im[k] * di;
+		const float xi = ei + sp->rot_re[k] * di + sp->rot_im[k] * dr;
+		sp->power[k] = (xr * xr + xi * xi) * scale;
+	}
+	for (k = 1; k < half; k++) {
+		if (sp->power[k] > peak) {
+			peak = sp->power[k];
+			peak_bin = k;
+		}
+	}
+
+	o = sderive_out(d, SENSORS_PROXY_TYPE_SPECTRUM, t1);
+	if (!o)
+		return;
+	for (i = 0; i < d->config.spectrum.band_count; i++) {
+		const float *band = d->config.spectrum.bands[i];
+		for (k = 1; k < half; k++) {
+			const float f = k * rate / size;
+			if (f >= band[0] && f < band[1])
+				o->data[i] += sp->power[k];
+		}
+	}
+	o->data[14] = rate;
+	o->data[15] = peak_bin * rate / size;
+}
+
+static void sderive_spectrum_add(struct sderive *d, const sensors_event_t *ev)
+{
+	struct sderive_spectrum *sp = &d->spectrum;
+	const int size = d->config.spectrum.size;
+	float v = 0;
+
+	for (int k = 0; k < d->values; k++)
+		v += ev->data[k] * ev->data[k];
+
+	sp->samples[sp->pos] = d->values == 1 ? ev->data[0] : sqrtf(v);
+	sp->timestamps[sp->pos] = ev->timestamp;
+	sp->pos = (sp->pos + 1) % size;
+	if (sp->filled < size)
+		sp->filled++;
+
+	if (++sp->since >= d->config.spectrum.hop && sp->filled == size) {
+		sp->since = 0;
+		sderive_spectrum_emit(d);
+	}
+}
+
+// Emits the grid points within [t[a], t[a+1]) of the retained source
+// events. The values are a polynomial in the position u within the
+// segment: a line, or a cubic Hermite spline with tangents taken from the
+// neighbouring events, which copes with unevenly spaced events.
+static void sderive_resample_emit(struct sderive *d, int a, int type)
+{
+	struct sderive_resample *r = &d->resample;
+	const int64_t grid = d->config.resample.grid_ns;
+	const int64_t *t = r->timestamps;
+	const float (*p)[L] = r->values;
+	const float h = t[a + 1] - t[a];
+	float c0[L], c1[L], c2[L], c3[L], v[L];
+	sensors_event_t *o;
+	int k;
+
+	if (r->next_ns < t[a])
+		r->next_ns = (t[a] + grid - 1) / grid * grid;	// first point or after a gap
+
+	if (d->config.resample.method == SENSORS_PROXY_RESAMPLE_CUBIC) {
+		const float s1 = h / (t[a + 1] - t[a - 1]), s2 = h / (t[a + 2] - t[a]);
+		for (k = 0; k < L; k++) {
+			const float m1 = (p[a + 1][k] - p[a - 1][k]) * s1;
+			const float m2 = (p[a + 2][k] - p[a][k]) * s2;
+			c0[k] = p[a][k];
+			c1[k] = m1;
+			c2[k] = 3 * (p[a + 1][k] - p[a][k]) - 2 * m1 - m2;
+			c3[k] = 2 * (p[a][k] - p[a + 1][k]) + m1 + m2;
+		}
+	} else {
+		for (k = 0; k < L; k++) {
+			c0[k] = p[a][k];
+			c1[k] = p[a + 1][k] - p[a][k];
+			c2[k] = c3[k] = 0;
+		}
+	}
+
+	for (; r->next_ns < t[a + 1]; r->next_ns += grid) {
+		const float u = (r->next_ns - t[a]) / h;
+
+		for (k = 0; k < L; k++)
+			v[k] = c0[k] + u * (c1[k] + u * (c2[k] + u * c3[k]));
+
+		o = sderive_out(d, type, r->next_ns);
+		if (!o) {
+			// Way faster than the source, skip the rest of the segment
+			d->out_dropped += (t[a + 1] - 1 - r->next_ns) / grid;
+			r->next_ns = (t[a + 1] + grid - 1) / grid * grid;
+			return;
+		}
+		memcpy(o->data, v, sizeof(float) * d->values);
+		if (d->values == 3)
+			o->acceleration.status = r->status;
+	}
+}
+
+static void sderive_resample_add(struct sderive *d, const sensors_event_t *ev)
+{
+	struct sderive_resample *r = &d->resample;
+	int k;
+
+	if (r->count && ev->timestamp <= r->timestamps[r->count - 1])
+		return;		// no segment to interpolate on
+	if (r->count == 4) {
+		memmove(&r->timestamps[0], &r->timestamps[1], sizeof(r->timestamps[0]) * 3);
+		memmove(&r->values[0], &r->values[1], sizeof(r->values[0]) * 3);
+		r->count--;
+	}
+	r->timestamps[r->count] = ev->timestamp;
+	for (k = 0; k < L; k++)
+		r->values[r->count][k] = k < d->values ? ev->data[k] : 0.0f;
+	r->status = ev->acceleration.status;
+	r->count++;
+
+	if (d->config.resample.method == SENSORS_PROXY_RESAMPLE_CUBIC) {
+		if (r->count == 4)
+			sderive_resample_emit(d, 1, ev->type);
+	} else if (r->count >= 2) {
+		sderive_resample_emit(d, r->count - 2, ev->type);
+	}
+}
+
+// Turns the attitude of the rotation vector event <ev> by the last angular
+// rate over the horizon. The rate is measured in the device frame, so the
+// increment is applied on the right: q' = q * dq.
+static void sderive_predict_add(struct sderive *d, const sensors_event_t *ev)
+{
+	struct sderive_predict *pr = &d->predict;
+	const float horizon = d->config.predict.horizon_ns * 1e-9f;
+	const float *q = ev->data;	// x, y, z, w
+	float dq[4], angle, rate, s;
+	sensors_event_t *o;
+
+	if (ev->sensor == d->aux_handle) {
+		memcpy(pr->rate, ev->data, sizeof(pr->rate));
+		pr->have_rate = 1;
+		return;
+	}
+	if (!pr->have_rate)
+		return;
+
+	rate = sqrtf(pr->rate[0] * pr->rate[0] + pr->rate[1] * pr->rate[1] +
+		     pr->rate[2] * pr->rate[2]);
+	angle = rate * horizon;
+	s = rate > 0 ? sinf(angle / 2) / rate : 0;
+	dq[0] = pr->rate[0] * s;
+	dq[1] = pr->rate[1] * s;
+	dq[2] = pr->rate[2] * s;
+	dq[3] = cosf(angle / 2);
+
+	o = sderive_out(d, ev->type, ev->timestamp + d->config.predict.horizon_ns);
+	if (!o)
+		return;
+	o->data[0] = q[3] * dq[0] + q[0] * dq[3] + q[1] * dq[2] - q[2] * dq[1];
+	o->data[1] = q[3] * dq[1] - q[0] * dq[2] + q[1] * dq[3] + q[2] * dq[0];
+	o->data[2] = q[3] * dq[2] + q[0] * dq[1] - q[1] * dq[0] + q[2] * dq[3];
+	o->data[3] = q[3] * dq[3] - q[0] * dq[0] - q[1] * dq[1] - q[2] * dq[2];
+	if (o->data[3] < 0) {
+		for (int k = 0; k < 4; k++)
+			o->data[k] = -o->data[k];
+	}
+	if (d->values == 5)
+		o->data[4] = ev->data[4];
+	o->data[15] = horizon;
+}
+
+void sderive_run(struct sderive *d, const sensors_event_t *events, int n)
+{
+	d->out_count = 0;
+
+	if (d->out_size < n * SDERIVE_OUT_MAX) {
+		sensors_event_t *out = (sensors_event_t *)realloc(d->out, sizeof(sensors_event_t) *
+								  n * SDERIVE_OUT_MAX);
+		if (out) {
+			d->out = out;
+			d->out_size = n * SDERIVE_OUT_MAX;
+		}
+	}
+
+	for (int i = 0; i < n; i++) {
+		const sensors_event_t *ev = &events[i];
+
+		if ((ev->sensor != d->handle && ev->sensor != d->aux_handle) ||
+		    ev->type == SENSOR_TYPE_META_DATA)
+			continue;
+		d->out_limit = d->out_count + SDERIVE_OUT_MAX;
+		if (d->out_limit > d->out_size)
+			d->out_limit = d->out_size;
+		switch (d->config.kind) {
+		case SENSORS_PROXY_DERIVE_AGGREGATE:
+			sderive_aggregate_add(d, ev);
+			break;
+		case SENSORS_PROXY_DERIVE_SPECTRUM:
+			sderive_spectrum_add(d, ev);
+			break;
+		case SENSORS_PROXY_DERIVE_RESAMPLE:
+			sderive_resample_add(d, ev);
+			break;
+		case SENSORS_PROXY_DERIVE_PREDICT:
+			sderive_predict_add(d, ev);
+			break;
+		}
+	}
+}
@@ -0,0 +1,134 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef ANDROID_SENSORS_DERIVE_H
+#define ANDROID_SENSORS_DERIVE_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+
+#include "sensors-proxy.h"
+
+__BEGIN_DECLS
+
+// Lanes of the derive kernels, covering SENSORS_PROXY_QVALUES_MAX values
+#define SDERIVE_LANES 8
+
+// Events a derived stream may produce per source event at most. Only
+// resampling on a grid much finer than the source reaches it, the grid
+// points beyond are skipped and counted.
+#define SDERIVE_OUT_MAX 8
+
+// Panes a sliding aggregate window is split into at most
+#define SDERIVE_PANES_MAX 64
+
+// Sums of the events within one hop of an aggregate window
+struct sderive_pane {
+	int64_t id;		// start time divided by the hop
+	int count;
+	float sum[SDERIVE_LANES];	// of the values minus the shift
+	float sumsq[SDERIVE_LANES];
+};
+
+struct sderive_aggregate {
+	struct sderive_pane *panes;	// ring of 'pane_count' panes
+	int pane_count;		// panes per window
+	int64_t first_id;	// first pane seen, earlier windows are incomplete
+	int64_t cur_id;		// pane receiving events, -1 before the first event
+	float shift[SDERIVE_LANES];	// first values seen, keeps the float sums well conditioned
+};
+
+struct sderive_spectrum {
+	float *samples;		// ring of 'size' signal values
+	int64_t *timestamps;	// ring of their timestamps
+	int pos;		// next ring position written
+	int filled;		// number of valid samples
+	int since;		// samples added since the last transform
+	float *window;		// Hann window
+	float window_power;	// sum of the squared window
+	float *tw_re, *tw_im;	// butterfly twiddles, stage with h butterflies at offset h
+	float *rot_re, *rot_im;	// e^(-2 pi i k / size) splitting the real transform
+	float *re, *im;		// work buffers of size / 2 entries
+	float *power;		// power per bin
+};
+
+struct sderive_resample {
+	int64_t timestamps[4];	// last source events, oldest first
+	float values[4][SDERIVE_LANES];
+	int status;		// of the last source event
+	int count;		// number of valid source events
+	int64_t next_ns;	// next grid point to emit, 0 before the first one
+};
+
+struct sderive_predict {
+	float rate[3];		// last angular rate in rad/s
+	int have_rate;
+};
+
+// Derived stream of a single handle, shared by 'users' subscribers
+struct sderive {
+	struct sensors_proxy_derive config;	// normalized, see sderive_config()
+	int handle;		// source handle
+	int aux_handle;		// handle of further input events, -1 if none
+	int values;		// number of source values the stream uses
+	int users;		// 0 if the slot is unused
+	union {
+		struct sderive_aggregate aggregate;
+		struct sderive_spectrum spectrum;
+		struct sderive_resample resample;
+		struct sderive_predict predict;
+	};
+	sensors_event_t *out;	// events produced by the last sderive_run()
+	int out_count;
+	int out_size;		// SDERIVE_OUT_MAX per event of the largest run so far
+	int out_limit;		// out_count at which the current source event is cut off
+	uint64_t out_dropped;	// events skipped beyond SDERIVE_OUT_MAX
+};
+
+// Validates <config> for a sensor with <values> values and clears the
+// fields its kind doesn't use, so equal streams compare equal with
+// memcmp(). Returns the number of values the stream uses or -EINVAL.
+int sderive_config(struct sensors_proxy_derive *config, int values);
+
+// Tells if a subscriber asking for the normalized <config> gets the
+// stream configured as <stream>
+int sderive_match(const struct sensors_proxy_derive *config,
+		  const struct sensors_proxy_derive *stream);
+
+// Sets up <d> for the normalized <config>, returns 0 or a negative errno.
+// Predictions need the gyroscope as <aux_handle>, other streams -1.
+int sderive_init(struct sderive *d, int handle, int aux_handle,
+		 const struct sensors_proxy_derive *config, int values);
+void sderive_free(struct sderive *d);
+
+// Feeds the events of the source and aux handle among <events> into <d>, the
+// events produced are left in d->out, at most SDERIVE_OUT_MAX per event of
+// <events>. Events are expected in ascending timestamp order.
+void sderive_run(struct sderive *d, const sensors_event_t *events, int n);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_DERIVE_H
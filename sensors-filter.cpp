@@ -0,0 +1,112 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include <string.h>
+
+#include "sensors-proxy.h"
+#include "sensors-filter.h"
+
+#define L SFILTER_LANES
+
+int sfilter_set(struct sfilter *f, int mode, float value, int values)
+{
+	if (mode < SENSORS_PROXY_FILTER_NONE || mode > SENSORS_PROXY_FILTER_CHANGE)
+		return -1;
+	if (mode != SENSORS_PROXY_FILTER_NONE && (values <= 0 || values > L || value < 0))
+		return -1;
+
+	memset(f, 0, sizeof(*f));
+	f->mode = mode;
+	if (mode == SENSORS_PROXY_FILTER_THRESHOLD)
+		f->value = value * value;	// compared with the squared magnitude
+	else if (mode == SENSORS_PROXY_FILTER_DEADBAND)
+		f->value = value;
+	f->values = values;
+	return 0;
+}
+
+void sfilter_reset(struct sfilter *f)
+{
+	f->have_last = 0;
+}
+
+int sfilter_run(struct sfilter *filters, int handle_last, sensors_event_t *events, int n)
+{
+	float v[n * L], sq[n * L];
+	int i, k, done = 0;
+
+	// Gather the values into lanes, unused lanes are zero, so the
+	// squares and differences below run as plain loops over all lanes
+	// which the compiler vectorizes.
+	for (i = 0; i < n; i++) {
+		const int handle = events[i].sensor;
+		const int values = handle >= 0 && handle <= handle_last ? filters[handle].values : 0;
+
+		for (k = 0; k < L; k++)
+			v[i * L + k] = k < values ? events[i].data[k] : 0.0f;
+	}
+	for (k = 0; k < n * L; k++)
+		sq[k] = v[k] * v[k];
+
+	for (i = 0; i < n; i++) {
+		const int handle = events[i].sensor;
+		const float *ev = &v[i * L];
+		struct sfilter *f;
+		float d, diff = 0, mag = 0;
+		int pass = 1;
+
+		if (events[i].type == SENSOR_TYPE_META_DATA || handle < 0 || handle > handle_last)
+			goto keep;
+
+		f = &filters[handle];
+		switch (f->mode) {
+		case SENSORS_PROXY_FILTER_THRESHOLD:
+			for (k = 0; k < L; k++)
+				mag += sq[i * L + k];
+			pass = mag >= f->value;
+			break;
+		case SENSORS_PROXY_FILTER_DEADBAND:
+		case SENSORS_PROXY_FILTER_CHANGE:
+			if (!f->have_last)
+				break;
+			for (k = 0; k < L; k++) {
+				d = ev[k] > f->last[k] ? ev[k] - f->last[k] : f->last[k] - ev[k];
+				diff = d > diff ? d : diff;
+			}
+			pass = diff > f->value;
+			break;
+		default:
+			goto keep;
+		}
+		if (!pass)
+			continue;
+		memcpy(f->last, ev, sizeof(f->last));
+		f->have_last = 1;
+keep:
+		if (done != i)
+			events[done] = events[i];
+		done++;
+	}
+	return done;
+}
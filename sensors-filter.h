@@ -0,0 +1,61 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef ANDROID_SENSORS_FILTER_H
+#define ANDROID_SENSORS_FILTER_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+
+__BEGIN_DECLS
+
+// Lanes of the filter kernels, covering SENSORS_PROXY_QVALUES_MAX values
+#define SFILTER_LANES 8
+
+// Event filter of a single handle of a client
+struct sfilter {
+	int mode;		// SENSORS_PROXY_FILTER_*
+	float value;		// threshold or deadband
+	int values;		// number of values compared
+	int have_last;		// an event has been passed since the filter was reset
+	float last[SFILTER_LANES];	// values of the last event passed
+};
+
+// Sets up <f>, events have <values> values. Returns -1 if the filter
+// can't be applied to such events.
+int sfilter_set(struct sfilter *f, int mode, float value, int values);
+
+// Lets the next event pass, used when a sensor is enabled again
+void sfilter_reset(struct sfilter *f);
+
+// Removes the events rejected by the filter of their handle from <events>,
+// <filters> is indexed by handle and <handle_last> the highest valid index.
+// The order of the remaining events is kept. Returns their number.
+int sfilter_run(struct sfilter *filters, int handle_last, sensors_event_t *events, int n);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_FILTER_H
@@ -0,0 +1,260 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include <math.h>
+#include <string.h>
+
+#include "sensors-fusion.h"
+
+// Proportional gain of the drift correction, higher while converging from
+// the seeded attitude, and integral gain estimating the gyroscope drift
+#define SFUSION_KP 1.0f
+#define SFUSION_KP_START 10.0f
+#define SFUSION_KI 0.02f
+#define SFUSION_START_NS 1000000000LL
+
+// Rate at which the reported heading accuracy follows the correction, 1/s
+#define SFUSION_HEADING_RATE 2.0f
+
+// Gyroscope gaps beyond that are not integrated
+#define SFUSION_DT_MAX 0.1f
+
+#define SFUSION_GRAVITY 9.80665f
+
+static float vec_norm(const float *v)
+{
+	return sqrtf(v[0] * v[0] + v[1] * v[1] + v[2] * v[2]);
+}
+
+static int vec_normalize(float *v)
+{
+	const float n = vec_norm(v);
+
+	if (n <= 0)
+		return -1;
+	v[0] /= n;
+	v[1] /= n;
+	v[2] /= n;
+	return 0;
+}
+
+static void vec_cross(const float *a, const float *b, float *out)
+{
+	out[0] = a[1] * b[2] - a[2] * b[1];
+	out[1] = a[2] * b[0] - a[0] * b[2];
+	out[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+// Rows of the rotation matrix of the attitude, that is the world axes
+// east, north and up in device coordinates
+static void sfusion_axes(const struct sfusion *f, float *east, float *north, float *up)
+{
+	const float w = f->q[0], x = f->q[1], y = f->q[2], z = f->q[3];
+
+	east[0] = 1 - 2 * (y * y + z * z);
+	east[1] = 2 * (x * y - w * z);
+	east[2] = 2 * (x * z + w * y);
+	north[0] = 2 * (x * y + w * z);
+	north[1] = 1 - 2 * (x * x + z * z);
+	north[2] = 2 * (y * z - w * x);
+	up[0] = 2 * (x * z - w * y);
+	up[1] = 2 * (y * z + w * x);
+	up[2] = 1 - 2 * (x * x + y * y);
+}
+
+// Seeds the attitude from the accelerometer and the magnetometer, without
+// magnetometer the device's Y axis is taken as north
+static void sfusion_seed(struct sfusion *f)
+{
+	float up[3], east[3], north[3], ref[3] = { 0, 1, 0 };
+	float r[3][3], tr, s;
+
+	memcpy(up, f->accel, sizeof(up));
+	vec_normalize(up);
+	if (f->use_mag && f->have_mag)
+		memcpy(ref, f->mag, sizeof(ref));
+	vec_cross(ref, up, east);
+	if (vec_normalize(east)) {
+		// Y axis points up, take -Z as north instead
+		ref[1] = 0;
+		ref[2] = -1;
+		vec_cross(ref, up, east);
+		vec_normalize(east);
+	}
+	vec_cross(up, east, north);
+
+	memcpy(r[0], east, sizeof(r[0]));
+	memcpy(r[1], north, sizeof(r[1]));
+	memcpy(r[2], up, sizeof(r[2]));
+
+	tr = r[0][0] + r[1][1] + r[2][2];
+	if (tr > 0) {
+		s = 2 * sqrtf(tr + 1);
+		f->q[0] = s / 4;
+		f->q[1] = (r[2][1] - r[1][2]) / s;
+		f->q[2] = (r[0][2] - r[2][0]) / s;
+		f->q[3] = (r[1][0] - r[0][1]) / s;
+	} else if (r[0][0] > r[1][1] && r[0][0] > r[2][2]) {
+		s = 2 * sqrtf(1 + r[0][0] - r[1][1] - r[2][2]);
+		f->q[0] = (r[2][1] - r[1][2]) / s;
+		f->q[1] = s / 4;
+		f->q[2] = (r[0][1] + r[1][0]) / s;
+		f->q[3] = (r[0][2] + r[2][0]) / s;
+	} else if (r[1][1] > r[2][2]) {
+		s = 2 * sqrtf(1 + r[1][1] - r[0][0] - r[2][2]);
+		f->q[0] = (r[0][2] - r[2][0]) / s;
+		f->q[1] = (r[0][1] + r[1][0]) / s;
+		f->q[2] = s / 4;
+		f->q[3] = (r[1][2] + r[2][1]) / s;
+	} else {
+		s = 2 * sqrtf(1 + r[2][2] - r[0][0] - r[1][1]);
+		f->q[0] = (r[1][0] - r[0][1]) / s;
+		f->q[1] = (r[0][2] + r[2][0]) / s;
+		f->q[2] = (r[1][2] + r[2][1]) / s;
+		f->q[3] = s / 4;
+	}
+}
+
+void sfusion_reset(struct sfusion *f, int use_mag)
+{
+	memset(f, 0, sizeof(*f));
+	f->q[0] = 1;
+	f->use_mag = use_mag;
+	f->heading_error = M_PI;
+}
+
+void sfusion_accel(struct sfusion *f, const float *accel)
+{
+	memcpy(f->accel, accel, sizeof(f->accel));
+	f->have_accel = vec_norm(accel) > 0;
+}
+
+void sfusion_mag(struct sfusion *f, const float *mag)
+{
+	memcpy(f->mag, mag, sizeof(f->mag));
+	f->have_mag = vec_norm(mag) > 0;
+}
+
+int sfusion_gyro(struct sfusion *f, const float *gyro, int64_t timestamp)
+{
+	float east[3], north[3], up[3], a[3], e[3] = { 0, 0, 0 }, g[3], c[3];
+	float q[4], dt, kp, n;
+	int k;
+
+	if (!f->initialized) {
+		if (!f->have_accel)
+			return -1;
+		sfusion_seed(f);
+		f->initialized = 1;
+		f->gyro_ns = f->started_ns = timestamp;
+		return 0;
+	}
+
+	dt = (timestamp - f->gyro_ns) * 1e-9f;
+	f->gyro_ns = timestamp;
+	if (dt <= 0 || dt > SFUSION_DT_MAX)
+		return 0;
+
+	sfusion_axes(f, east, north, up);
+
+	// Error between measured and estimated direction of gravity
+	memcpy(a, f->accel, sizeof(a));
+	if (!vec_normalize(a))
+		vec_cross(a, up, e);
+
+	// Error between measured and estimated direction of magnetic north,
+	// the reference is the measured field turned into the world frame
+	// with its horizontal part along north
+	if (f->use_mag && f->have_mag) {
+		float m[3], h[3], b[3], w[3];
+
+		memcpy(m, f->mag, sizeof(m));
+		vec_normalize(m);
+		h[0] = east[0] * m[0] + east[1] * m[1] + east[2] * m[2];
+		h[1] = north[0] * m[0] + north[1] * m[1] + north[2] * m[2];
+		h[2] = up[0] * m[0] + up[1] * m[1] + up[2] * m[2];
+		b[1] = sqrtf(h[0] * h[0] + h[1] * h[1]);
+		b[2] = h[2];
+		for (k = 0; k < 3; k++)
+			w[k] = b[1] * north[k] + b[2] * up[k];
+		vec_cross(m, w, c);
+		for (k = 0; k < 3; k++)
+			e[k] += c[k];
+
+		// The part of <c> along the vertical is the heading error
+		n = fabsf(c[0] * up[0] + c[1] * up[1] + c[2] * up[2]);
+		f->heading_error += (asinf(n < 1 ? n : 1) - f->heading_error) *
+		    SFUSION_HEADING_RATE * dt;
+	}
+
+	kp = timestamp - f->started_ns < SFUSION_START_NS ? SFUSION_KP_START : SFUSION_KP;
+	for (k = 0; k < 3; k++) {
+		f->bias[k] += SFUSION_KI * e[k] * dt;
+		g[k] = gyro[k] + kp * e[k] + f->bias[k];
+	}
+
+	memcpy(q, f->q, sizeof(q));
+	f->q[0] += 0.5f * dt * (-q[1] * g[0] - q[2] * g[1] - q[3] * g[2]);
+	f->q[1] += 0.5f * dt * (q[0] * g[0] + q[2] * g[2] - q[3] * g[1]);
+	f->q[2] += 0.5f * dt * (q[0] * g[1] - q[1] * g[2] + q[3] * g[0]);
+	f->q[3] += 0.5f * dt * (q[0] * g[2] + q[1] * g[1] - q[2] * g[0]);
+
+	n = sqrtf(f->q[0] * f->q[0] + f->q[1] * f->q[1] + f->q[2] * f->q[2] + f->q[3] * f->q[3]);
+	for (k = 0; k < 4; k++)
+		f->q[k] /= n;
+
+	return 0;
+}
+
+void sfusion_gravity(const struct sfusion *f, float *gravity)
+{
+	float east[3], north[3], up[3];
+	int k;
+
+	sfusion_axes(f, east, north, up);
+	for (k = 0; k < 3; k++)
+		gravity[k] = SFUSION_GRAVITY * up[k];
+}
+
+void sfusion_linear_accel(const struct sfusion *f, float *linear)
+{
+	float gravity[3];
+	int k;
+
+	sfusion_gravity(f, gravity);
+	for (k = 0; k < 3; k++)
+		linear[k] = f->accel[k] - gravity[k];
+}
+
+void sfusion_rotation_vector(const struct sfusion *f, float *rv)
+{
+	// Keep w positive, the rotation vector has no sign ambiguity
+	const float s = f->q[0] < 0 ? -1 : 1;
+
+	rv[0] = s * f->q[1];
+	rv[1] = s * f->q[2];
+	rv[2] = s * f->q[3];
+	rv[3] = s * f->q[0];
+	rv[4] = f->use_mag && f->have_mag ? f->heading_error : -1;
+}
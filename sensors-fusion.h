@@ -0,0 +1,75 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef ANDROID_SENSORS_FUSION_H
+#define ANDROID_SENSORS_FUSION_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+__BEGIN_DECLS
+
+// Attitude estimator shared by the server's fusion sensors. It integrates
+// the gyroscope and corrects the drift with the direction of gravity from
+// the accelerometer and, if enabled, of the magnetic north (complementary
+// filter after Mahony). The attitude maps device coordinates to the
+// Android world frame (X east, Y north, Z up). Not thread-safe.
+struct sfusion {
+	float q[4];		// attitude quaternion w, x, y, z
+	float bias[3];		// integrated gyroscope drift correction in rad/s
+	float accel[3];		// last accelerometer values in m/s^2
+	float mag[3];		// last magnetometer values in uT
+	int have_accel;
+	int have_mag;
+	float heading_error;	// smoothed heading correction in rad
+	int use_mag;		// correct the heading with the magnetometer
+	int initialized;	// attitude seeded from accelerometer (and magnetometer)
+	int64_t gyro_ns;	// timestamp of the last gyroscope event
+	int64_t started_ns;	// timestamp of the first integrated gyroscope event
+};
+
+void sfusion_reset(struct sfusion *f, int use_mag);
+
+void sfusion_accel(struct sfusion *f, const float *accel);
+void sfusion_mag(struct sfusion *f, const float *mag);
+
+// Advances the attitude by the gyroscope rates <gyro> in rad/s measured at
+// <timestamp>. Returns 0 if an estimate is available, -1 if the filter
+// still waits for its first accelerometer event.
+int sfusion_gyro(struct sfusion *f, const float *gyro, int64_t timestamp);
+
+// Gravity vector in device coordinates in m/s^2, as the accelerometer
+// would measure it at rest
+void sfusion_gravity(const struct sfusion *f, float *gravity);
+
+// Last accelerometer values without gravity
+void sfusion_linear_accel(const struct sfusion *f, float *linear);
+
+// Rotation vector as defined for SENSOR_TYPE_ROTATION_VECTOR: x, y, z, w
+// of the attitude quaternion and the estimated heading accuracy in rad
+void sfusion_rotation_vector(const struct sfusion *f, float *rv);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_FUSION_H
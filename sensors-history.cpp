@@ -0,0 +1,262 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#include <errno.h>
+#include <float.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sensors-history.h"
+
+#define SHISTORY_ALIGN 64
+
+// Bounds of the ring size, on-change sensors get the minimum
+#define SHISTORY_CAPACITY_MIN 16
+#define SHISTORY_CAPACITY_MAX 4096
+
+uint32_t shistory_capacity(const struct sensor_t *s, int64_t window_ns)
+{
+	uint64_t count = SHISTORY_CAPACITY_MIN;
+	uint32_t capacity = SHISTORY_CAPACITY_MIN;
+
+	// minDelay is the shortest period in microseconds, 0 for on-change sensors
+	if (s->minDelay > 0)
+		count = window_ns / ((int64_t)s->minDelay * 1000);
+
+	while (capacity < count && capacity < SHISTORY_CAPACITY_MAX)
+		capacity <<= 1;
+
+	return capacity;
+}
+
+int shistory_init(struct shistory *h, uint32_t capacity)
+{
+	void *events;
+	int err;
+
+	memset(h, 0, sizeof(*h));
+	if (!capacity)
+		return 0;
+
+	err = posix_memalign(&events, SHISTORY_ALIGN, sizeof(sensors_event_t) * capacity);
+	if (err)
+		return -err;
+
+	h->events = (sensors_event_t *)events;
+	h->capacity = capacity;
+	return 0;
+}
+
+void shistory_free(struct shistory *h)
+{
+	free(h->events);
+	memset(h, 0, sizeof(*h));
+}
+
+void shistory_add(struct shistory *h, const sensors_event_t *event)
+{
+	if (!h->capacity)
+		return;
+
+	h->events[h->written & (h->capacity - 1)] = *event;
+	h->written++;
+}
+
+// Returns the absolute position of the first retained event with a
+// timestamp >= <t_ns>, 'written' if there is none.
+static uint64_t shistory_find(const struct shistory *h, int64_t t_ns)
+{
+	uint64_t lo = h->written > h->capacity ? h->written - h->capacity : 0;
+	uint64_t hi = h->written;
+
+	while (lo < hi) {
+		const uint64_t mid = lo + (hi - lo) / 2;
+		if (h->events[mid & (h->capacity - 1)].timestamp < t_ns)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+int shistory_get(const struct shistory *h, int64_t t0_ns, int64_t t1_ns,
+		 sensors_event_t *out, int max)
+{
+	uint64_t pos;
+	int n = 0;
+
+	if (!h->capacity)
+		return 0;
+
+	for (pos = shistory_find(h, t0_ns); pos < h->written && n < max; pos++) {
+		const sensors_event_t *ev = &h->events[pos & (h->capacity - 1)];
+		if (ev->timestamp > t1_ns)
+			break;
+		out[n++] = *ev;
+	}
+	return n;
+}
+
+static const int64_t srollup_period_ns[SENSORS_PROXY_ROLLUP_LEVELS] = {
+	1000000000LL, 10000000000LL, 60000000000LL,
+};
+
+static const uint32_t srollup_capacity[SENSORS_PROXY_ROLLUP_LEVELS] = {
+	300, 180, 240,		// 5 minutes, 30 minutes, 4 hours
+};
+
+int srollup_init(struct srollup *r, int values)
+{
+	int l;
+
+	memset(r, 0, sizeof(*r));
+	if (!values)
+		return 0;
+
+	for (l = 0; l < SENSORS_PROXY_ROLLUP_LEVELS; l++) {
+		struct srollup_level *lv = &r->level[l];
+		void *buckets;
+		int err;
+
+		err = posix_memalign(&buckets, SHISTORY_ALIGN,
+				     sizeof(struct srollup_bucket) * srollup_capacity[l]);
+		if (err) {
+			srollup_free(r);
+			return -err;
+		}
+		lv->buckets = (struct srollup_bucket *)buckets;
+		lv->capacity = srollup_capacity[l];
+	}
+	r->values = values;
+	return 0;
+}
+
+void srollup_free(struct srollup *r)
+{
+	int l;
+
+	for (l = 0; l < SENSORS_PROXY_ROLLUP_LEVELS; l++)
+		free(r->level[l].buckets);
+	memset(r, 0, sizeof(*r));
+}
+
+// Merges min/max/sum of <count> samples into bucket <b>. Runs over all
+// lanes, unused lanes just carry zeros, so the loop vectorizes.
+static void srollup_bucket_merge(struct srollup_bucket *b, const float *min, const float *max,
+				 const float *sum, uint32_t count)
+{
+	int k;
+
+	for (k = 0; k < SROLLUP_LANES; k++) {
+		b->min[k] = min[k] < b->min[k] ? min[k] : b->min[k];
+		b->max[k] = max[k] > b->max[k] ? max[k] : b->max[k];
+		b->sum[k] += sum[k];
+	}
+	b->count += count;
+}
+
+static void srollup_feed(struct srollup *r, int l, int64_t t, const float *min,
+			 const float *max, const float *sum, uint32_t count)
+{
+	struct srollup_level *lv = &r->level[l];
+	const int64_t period = srollup_period_ns[l];
+	int k;
+
+	// Close the current bucket once the samples move past it
+	if (lv->cur.count && (t >= lv->cur.t_start + period || t < lv->cur.t_start)) {
+		const struct srollup_bucket *b = &lv->cur;
+
+		lv->buckets[lv->written % lv->capacity] = *b;
+		lv->written++;
+		if (l + 1 < SENSORS_PROXY_ROLLUP_LEVELS)
+			srollup_feed(r, l + 1, b->t_start, b->min, b->max, b->sum, b->count);
+		lv->cur.count = 0;
+	}
+
+	if (!lv->cur.count) {
+		lv->cur.t_start = t - t % period;
+		for (k = 0; k < SROLLUP_LANES; k++) {
+			lv->cur.min[k] = FLT_MAX;
+			lv->cur.max[k] = -FLT_MAX;
+			lv->cur.sum[k] = 0;
+		}
+	}
+	srollup_bucket_merge(&lv->cur, min, max, sum, count);
+}
+
+void srollup_add(struct srollup *r, const sensors_event_t *event)
+{
+	float v[SROLLUP_LANES];
+	int k;
+
+	if (!r->values || event->timestamp < 0)
+		return;
+
+	for (k = 0; k < SROLLUP_LANES; k++)
+		v[k] = k < r->values ? event->data[k] : 0.0f;
+
+	srollup_feed(r, 0, event->timestamp, v, v, v, 1);
+}
+
+static void srollup_bucket_export(const struct srollup *r, int level,
+				  const struct srollup_bucket *b, struct sensors_proxy_rollup *out)
+{
+	int k;
+
+	memset(out, 0, sizeof(*out));
+	out->t_start = b->t_start;
+	out->period_ns = srollup_period_ns[level];
+	out->count = b->count;
+	out->values = r->values;
+	for (k = 0; k < r->values; k++) {
+		out->min[k] = b->min[k];
+		out->max[k] = b->max[k];
+		out->mean[k] = b->sum[k] / b->count;
+	}
+}
+
+int srollup_get(const struct srollup *r, int level, int64_t t0_ns, int64_t t1_ns,
+		struct sensors_proxy_rollup *out, int max)
+{
+	const struct srollup_level *lv;
+	uint64_t pos;
+	int n = 0;
+
+	if (!r->values || level < 0 || level >= SENSORS_PROXY_ROLLUP_LEVELS)
+		return 0;
+
+	lv = &r->level[level];
+	pos = lv->written > lv->capacity ? lv->written - lv->capacity : 0;
+	for (; pos < lv->written && n < max; pos++) {
+		const struct srollup_bucket *b = &lv->buckets[pos % lv->capacity];
+		if (b->t_start < t0_ns)
+			continue;
+		if (b->t_start > t1_ns)
+			return n;
+		srollup_bucket_export(r, level, b, &out[n++]);
+	}
+	if (lv->cur.count && n < max && lv->cur.t_start >= t0_ns && lv->cur.t_start <= t1_ns)
+		srollup_bucket_export(r, level, &lv->cur, &out[n++]);
+
+	return n;
+}
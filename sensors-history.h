@@ -0,0 +1,104 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+#ifndef ANDROID_SENSORS_HISTORY_H
+#define ANDROID_SENSORS_HISTORY_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+
+#include <hardware/sensors.h>
+
+#include "sensors-proxy.h"
+
+__BEGIN_DECLS
+
+// Fixed-capacity ring of the most recent events of a single handle.
+// Events are expected in ascending timestamp order. Not thread-safe, the
+// server protects its history rings with smod->mutex.
+struct shistory {
+	sensors_event_t *events;	// 'capacity' entries, cache line aligned
+	uint32_t capacity;	// power of two, 0 if no history is kept
+	uint64_t written;	// total number of events added
+};
+
+// Number of events needed to retain <window_ns> of sensor <s> at its
+// highest rate, rounded up to a power of two.
+uint32_t shistory_capacity(const struct sensor_t *s, int64_t window_ns);
+
+int shistory_init(struct shistory *h, uint32_t capacity);
+void shistory_free(struct shistory *h);
+
+void shistory_add(struct shistory *h, const sensors_event_t *event);
+
+// Copies up to <max> retained events with t0_ns <= timestamp <= t1_ns in
+// chronological order into <out>, returns the number of events copied.
+int shistory_get(const struct shistory *h, int64_t t0_ns, int64_t t1_ns,
+		 sensors_event_t *out, int max);
+
+// Lanes of a rollup bucket, a multiple of the SIMD width which covers
+// SENSORS_PROXY_QVALUES_MAX
+#define SROLLUP_LANES 8
+
+// Upper bound of buckets retained per level
+#define SROLLUP_BUCKETS_MAX 300
+
+struct srollup_bucket {
+	int64_t t_start;
+	uint32_t count;
+	uint32_t reserved;
+	float min[SROLLUP_LANES];
+	float max[SROLLUP_LANES];
+	float sum[SROLLUP_LANES];
+};
+
+struct srollup_level {
+	struct srollup_bucket *buckets;	// ring of closed buckets
+	uint32_t capacity;
+	uint64_t written;
+	struct srollup_bucket cur;	// bucket being filled
+};
+
+// Min/max/mean rollups of a single handle at SENSORS_PROXY_ROLLUP_LEVELS
+// resolutions. Events update the finest level, each closed bucket is
+// merged into the next coarser one, so the cost per event is independent
+// of the number of levels. Not thread-safe, like struct shistory.
+struct srollup {
+	int values;		// number of values rolled up, 0 if disabled
+	struct srollup_level level[SENSORS_PROXY_ROLLUP_LEVELS];
+};
+
+int srollup_init(struct srollup *r, int values);
+void srollup_free(struct srollup *r);
+
+void srollup_add(struct srollup *r, const sensors_event_t *event);
+
+// Copies up to <max> buckets of <level> starting within [t0_ns, t1_ns] in
+// chronological order into <out>, including the bucket being filled.
+// Returns the number of buckets copied.
+int srollup_get(const struct srollup *r, int level, int64_t t0_ns, int64_t t1_ns,
+		struct sensors_proxy_rollup *out, int max);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_HISTORY_H
@@ -37,13 +37,221 @@ __BEGIN_DECLS
 #define SENSORS_PROXY_PATH "/data/trustme-com/sensors/sensors-proxy.sock"
 #define SENSORS_MAX 32
 
+// Control socket of the container manager, not visible inside the containers
+#define SENSORS_PROXY_CTRL_PATH "/dev/socket/sensors-proxy-ctrl"
+#define SENSORS_PROXY_CONTAINER_CHARS 32
+
 enum sensors_proxy_cmd_e {
 	SENSORS_PROXY_CMD_ACTIVATE = 0,
 	SENSORS_PROXY_CMD_SET_DELAY,
 	SENSORS_PROXY_CMD_BATCH,
 	SENSORS_PROXY_CMD_FLUSH,
+	SENSORS_PROXY_CMD_SET_ENCODING,
+	SENSORS_PROXY_CMD_GET_LATEST,	// answered by SENSORS_PROXY_MSG_LATEST
+	SENSORS_PROXY_CMD_GET_HISTORY,	// answered by SENSORS_PROXY_MSG_HISTORY(_END)
+	SENSORS_PROXY_CMD_RESUME,	// activate after reconnect, replaying missed events
+	SENSORS_PROXY_CMD_GET_ROLLUP,	// answered by SENSORS_PROXY_MSG_ROLLUP(_END)
+	SENSORS_PROXY_CMD_SET_FILTER,
+	SENSORS_PROXY_CMD_DERIVE,	// subscribe to a derived stream of the handle
+	SENSORS_PROXY_CMD_SET_DELAY_BAND,	// delays accepted besides the one set
+	SENSORS_PROXY_CMD_SET_CONTAINER,	// name of the client's container
+	SENSORS_PROXY_CMD_SET_BACKGROUND,	// policy while the container is in the background
+	SENSORS_PROXY_CMD_OPEN_LANE,	// answered by SENSORS_PROXY_MSG_LANE
+	SENSORS_PROXY_CMD_CREDIT,	// events the client consumed and can take
+	SENSORS_PROXY_CMD_GET_STATS,	// answered by SENSORS_PROXY_MSG_STATS
+};
+
+// Flow control: a client sending SENSORS_PROXY_CMD_CREDIT gets at most
+// 'window' events beyond the 'consumed' events it received so far, counting
+// the records of all event packets on both lanes. Events of continuous
+// sensors beyond the credit are dropped, leaving a sequence gap, the others
+// are held back until the client grants more credit. Wake-up events and
+// the events replayed on resume don't wait for credit but count against
+// it. The client reports again after a quarter of the window. While the
+// client doesn't keep up, the server batches its events for up to
+// 'latency_ms', so it gets fewer and larger packets.
+#define SENSORS_PROXY_CREDIT_WINDOW (4 * SENSORS_PROXY_BATCH_MAX)
+
+// Values of activate_enabled of SENSORS_PROXY_CMD_ACTIVATE. A passive
+// subscriber gets the events of a sensor while other clients keep it
+// enabled, but never enables the sensor or affects its rate itself.
+enum sensors_proxy_activate_e {
+	SENSORS_PROXY_ACTIVATE_OFF = 0,
+	SENSORS_PROXY_ACTIVATE_ON,
+	SENSORS_PROXY_ACTIVATE_PASSIVE,
+};
+
+// Filters of the events of a handle, selected by SENSORS_PROXY_CMD_SET_FILTER.
+// Only available for sensors with values, see sensors_codec_values().
+// Differences are taken against the last event delivered to the client.
+enum sensors_proxy_filter_e {
+	SENSORS_PROXY_FILTER_NONE = 0,	// deliver every event (default)
+	SENSORS_PROXY_FILTER_THRESHOLD,	// magnitude of the values at least 'value'
+	SENSORS_PROXY_FILTER_DEADBAND,	// a value differs by more than 'value'
+	SENSORS_PROXY_FILTER_CHANGE,	// a value differs at all
+};
+
+// Derived streams the server computes from the events of a handle, once
+// for all subscribers with the same configuration. Their events carry the
+// source handle and one of the private event types below.
+enum sensors_proxy_derive_e {
+	SENSORS_PROXY_DERIVE_AGGREGATE = 0,	// SENSORS_PROXY_TYPE_AGGREGATE per window
+	SENSORS_PROXY_DERIVE_SPECTRUM,	// SENSORS_PROXY_TYPE_SPECTRUM per hop
+	SENSORS_PROXY_DERIVE_RESAMPLE,	// events of the sensor's type on a time grid
+	SENSORS_PROXY_DERIVE_PREDICT,	// rotation vector events ahead of time
+};
+
+// Resampled events are interpolated from the source events at timestamps
+// which are exact multiples of 'grid_ns', so streams of different sensors
+// with the same grid line up. Cubic interpolation is one source event
+// behind linear interpolation. Sensors with values only.
+enum sensors_proxy_resample_e {
+	SENSORS_PROXY_RESAMPLE_LINEAR = 0,
+	SENSORS_PROXY_RESAMPLE_CUBIC,
+};
+
+#define SENSORS_PROXY_TYPE_PRIVATE_BASE 0x10000
+#define SENSORS_PROXY_TYPE_AGGREGATE (SENSORS_PROXY_TYPE_PRIVATE_BASE + 0)
+#define SENSORS_PROXY_TYPE_SPECTRUM (SENSORS_PROXY_TYPE_PRIVATE_BASE + 1)
+
+// Aggregate events hold mean, variance and RMS of the first v values of
+// the source events in a window, v being the number of values of the
+// sensor limited to SENSORS_PROXY_AGGREGATE_VALUES_MAX: data[0..v) mean,
+// data[v..2v) variance, data[2v..3v) RMS and data[15] the number of
+// events. The timestamp is the end of the window.
+#define SENSORS_PROXY_AGGREGATE_VALUES_MAX 5
+
+// Spectrum events hold the band energies of the last 'size' events of
+// the source, taken every 'hop' events: data[i] is the mean square of the
+// signal within band i, data[14] the sample rate and data[15] the
+// frequency of the strongest bin in Hz. The signal is the magnitude of the
+// values (the value itself for single value sensors) with the mean
+// removed, weighted by a Hann window. The timestamp is the one of the last
+// event. A subscriber with size 0 joins the spectrum of the handle the
+// first subscriber configured.
+#define SENSORS_PROXY_SPECTRUM_SIZE_MIN 16
+#define SENSORS_PROXY_SPECTRUM_SIZE_MAX 1024
+#define SENSORS_PROXY_SPECTRUM_BANDS_MAX 8
+
+struct sensors_proxy_derive {
+	int32_t kind;		// SENSORS_PROXY_DERIVE_*
+	int32_t reserved;
+	int64_t period_ns;	// delay requested for the source sensor, 0 for any
+	union {
+		struct {
+			int64_t window_ns;
+			int64_t hop_ns;	// a divisor of window_ns, window_ns or 0 for tumbling windows
+		} aggregate;
+		struct {
+			int32_t size;	// events per transform, a power of two
+			int32_t hop;	// events between transforms, at most size
+			int32_t band_count;
+			int32_t reserved;
+			float bands[SENSORS_PROXY_SPECTRUM_BANDS_MAX][2];	// [low, high) in Hz
+		} spectrum;
+		struct {
+			int64_t grid_ns;
+			int32_t method;	// SENSORS_PROXY_RESAMPLE_*
+			int32_t reserved;
+		} resample;
+		struct {
+			int64_t horizon_ns;	// up to SENSORS_PROXY_PREDICT_HORIZON_MAX_NS
+		} predict;
+	};
+};
+
+// Predicted events are the (game) rotation vector events of the source
+// with the attitude extrapolated 'horizon_ns' ahead, turning it at the
+// rate the gyroscope measured last. Their timestamp is the time predicted
+// for, data[15] holds the horizon in seconds.
+#define SENSORS_PROXY_PREDICT_HORIZON_MAX_NS 200000000LL
+
+// Delivery to clients whose container isn't in the foreground. The QoS
+// class of the client sets the policy, SENSORS_PROXY_CMD_SET_BACKGROUND
+// may only select a stricter one: pause, or the class' policy with a
+// longer period. Requests for anything else fall back to the class. Paused
+// subscriptions don't keep their sensors running, when the container comes
+// back to the foreground the client gets the last value of every sensor
+// still running. Derived streams are paused or batched as well, but not
+// decimated.
+enum sensors_proxy_background_e {
+	SENSORS_PROXY_BACKGROUND_NONE = 0,	// deliver every event
+	SENSORS_PROXY_BACKGROUND_RATE,	// at most one event per sensor and 'period_ns'
+	SENSORS_PROXY_BACKGROUND_BATCH,	// hold events back for up to 'period_ns'
+	SENSORS_PROXY_BACKGROUND_PAUSE,	// deliver nothing (default of the QoS classes)
+};
+
+// Commands of the container manager on SENSORS_PROXY_CTRL_PATH. Only one
+// container is in the foreground at a time, clients of the other ones
+// are throttled according to their background policy. Clients which
+// didn't name their container are throttled as well, nobody is before
+// the first command arrived.
+enum sensors_proxy_ctrl_e {
+	SENSORS_PROXY_CTRL_FOREGROUND = 0,	// 'container' is in the foreground now
+	SENSORS_PROXY_CTRL_BACKGROUND,	// no container is, e.g. while the screen is off
+	SENSORS_PROXY_CTRL_PREPARE,	// 'container' is about to come to the foreground
+};
+
+// After SENSORS_PROXY_CTRL_PREPARE the sensors of the incoming container
+// are enabled at the rates it asked for, while its clients are still
+// served like in the background. This way the hardware is configured once
+// the switch happens. Without a switch the preparation is undone after
+// SENSORS_PROXY_CTRL_PREPARE_TIMEOUT_MS, an empty name undoes it at once.
+#define SENSORS_PROXY_CTRL_PREPARE_TIMEOUT_MS 2000
+
+struct sensors_proxy_ctrl {
+	int32_t cmd;		// SENSORS_PROXY_CTRL_*
+	int32_t reserved;
+	char container[SENSORS_PROXY_CONTAINER_CHARS];
 };
 
+// Encodings of the event stream, selected by SENSORS_PROXY_CMD_SET_ENCODING.
+// Connections subscribed to derived streams always get plain events.
+enum sensors_proxy_encoding_e {
+	SENSORS_PROXY_ENCODING_FLOAT = 0,	// plain sensors_event_t (default)
+	SENSORS_PROXY_ENCODING_Q16,	// int16 fixed-point for sensors supporting it
+};
+
+// Messages sent by the server once the sensor list has been transferred
+// and the client sent a command of the full size. Each packet starts with
+// a struct sensors_proxy_msg followed by 'count' records of the type given
+// by 'msg'.
+enum sensors_proxy_msg_e {
+	SENSORS_PROXY_MSG_EVENTS = 0,	// sensors_event_t records
+	SENSORS_PROXY_MSG_EVENTS_Q16,	// sensors_proxy_qevent records
+	SENSORS_PROXY_MSG_LATEST,	// no records, carries the latest value page fd
+	SENSORS_PROXY_MSG_HISTORY,	// sensors_event_t records, more packets follow
+	SENSORS_PROXY_MSG_HISTORY_END,	// sensors_event_t records, last packet
+	SENSORS_PROXY_MSG_ROLLUP,	// sensors_proxy_rollup records, more packets follow
+	SENSORS_PROXY_MSG_ROLLUP_END,	// sensors_proxy_rollup records, last packet
+	SENSORS_PROXY_MSG_BUDGET,	// one sensors_proxy_budget record
+	SENSORS_PROXY_MSG_LANE,	// no records, carries the urgent lane fd unless it failed
+	SENSORS_PROXY_MSG_STATS,	// one sensors_proxy_stats record
+};
+
+// Events of wake-up sensors (proximity and significant motion) are sent
+// on a socket of their own once the client opened this urgent lane, so
+// they never queue up behind the events of other sensors. They also
+// bypass the batching and decimation of a client. The lane only carries
+// event packets; the events of a handle always take the same lane, so
+// their sequence numbers stay in order.
+
+// Resolutions of the min/max/mean rollups the server keeps per sensor
+enum sensors_proxy_rollup_e {
+	SENSORS_PROXY_ROLLUP_1S = 0,	// 1 s buckets, last 5 minutes
+	SENSORS_PROXY_ROLLUP_10S,	// 10 s buckets, last 30 minutes
+	SENSORS_PROXY_ROLLUP_60S,	// 60 s buckets, last 4 hours
+	SENSORS_PROXY_ROLLUP_LEVELS,
+};
+
+// Every event sent to a client carries a sequence number counting the
+// events the server meant to deliver to this client for that handle,
+// starting at 1. It is stored in sensors_event_t.reserved0 (or the 'seq'
+// field of Q16 events), a gap means events have been dropped.
+
+// Maximum number of records in a single packet
+#define SENSORS_PROXY_BATCH_MAX 64
+
 #define SENSORS_CHARS_MAX 64
 
 struct sensors_strings_t {
@@ -51,15 +259,135 @@ struct sensors_strings_t {
 	char vendor[SENSORS_CHARS_MAX];
 };
 
+// Size of the commands of the first protocol version: ACTIVATE, SET_DELAY,
+// BATCH and FLUSH with the fields up to 'set_delay_ns'. Clients sending
+// them get bare sensors_event_t packets of one event each. The first
+// command of the full size switches the connection to the framed messages
+// of sensors_proxy_msg_e, so clients have to send one, e.g.
+// SENSORS_PROXY_CMD_OPEN_LANE, before enabling any sensor.
+#define SENSORS_PROXY_CMD_LEGACY_SIZE 16
+
 struct sensors_proxy_cmd {
 	int32_t cmd;
 	int32_t handle;
 	union {
 		int32_t activate_enabled;
 		int64_t set_delay_ns;
+		int32_t encoding;
+		int64_t resume_ns;	// last event timestamp seen before the reconnect
+		struct {
+			int64_t t0_ns;
+			int64_t t1_ns;
+			int32_t max;	// maximum number of records to return
+			int32_t level;	// SENSORS_PROXY_ROLLUP_* for GET_ROLLUP
+		} history;
+		struct {
+			int32_t mode;	// SENSORS_PROXY_FILTER_*
+			float value;
+		} filter;
+		struct {
+			int32_t enabled;
+			int32_t reserved;
+			struct sensors_proxy_derive config;
+		} derive;
+		struct {
+			int64_t min_ns;	// 0 to accept the delay set only
+			int64_t max_ns;
+		} delay_band;
+		char container[SENSORS_PROXY_CONTAINER_CHARS];
+		struct {
+			int32_t policy;	// SENSORS_PROXY_BACKGROUND_*
+			int32_t reserved;
+			int64_t period_ns;
+		} background;
+		struct {
+			uint64_t consumed;	// event records received since connecting
+			int32_t window;
+			int32_t latency_ms;	// batching accepted when falling behind
+		} credit;
 	};
 };
 
+struct sensors_proxy_msg {
+	int32_t msg;
+	int32_t count;
+};
+
+// Quantized sensor event, values are data[i] * scale where the scale is
+// derived from the sensor's resolution and maxRange (see sensors-codec.h).
+// The event type is implied by the handle.
+#define SENSORS_PROXY_QVALUES_MAX 6
+
+struct sensors_proxy_qevent {
+	int64_t timestamp;
+	int32_t sensor;
+	int8_t status;		// sensors_vec_t status for 3-axis sensors
+	uint8_t reserved[3];
+	int16_t data[SENSORS_PROXY_QVALUES_MAX];
+	uint32_t seq;
+};
+
+// Summary of a sensor's values over one rollup bucket
+struct sensors_proxy_rollup {
+	int64_t t_start;	// event timestamp the bucket starts at
+	int64_t period_ns;
+	int32_t count;		// number of events in the bucket
+	int32_t values;		// number of valid entries in min, max and mean
+	float min[SENSORS_PROXY_QVALUES_MAX];
+	float max[SENSORS_PROXY_QVALUES_MAX];
+	float mean[SENSORS_PROXY_QVALUES_MAX];
+};
+
+// Service level of a client, sent by the server whenever the client is
+// downgraded to keep its event budget or the global one, upgraded again,
+// or asked for a delay below 'min_delay_ns'. At level 1 events are
+// batched, from level 2 on continuous sensors are decimated as well. On-
+// change sensors and derived streams are never decimated.
+struct sensors_proxy_budget {
+	int32_t level;		// 0 if the client gets every event
+	int32_t decimation;	// continuous sensors deliver every n-th event
+	int64_t batch_ns;	// events are held back up to this long
+	int64_t min_delay_ns;	// fastest delay the client may ask for, 0 for any
+	uint64_t events_shed;	// events dropped to keep the budget
+};
+
+// Event and command counters of a connection. The server fills in its
+// side, the client adds the events it received and the gaps it saw in the
+// sequence numbers.
+struct sensors_proxy_stats {
+	uint64_t events_sent;	// by the server
+	uint64_t events_dropped;	// the socket of the client was full
+	uint64_t events_received;	// by the client
+	uint64_t events_lost;	// sum of the sequence gaps
+	uint64_t commands_received;	// by the server
+	uint64_t commands_merged;	// held back and replaced by a later one
+};
+
+// Shared memory page holding the latest event of every handle, passed to
+// clients as read-only file descriptor. The server writes each slot under
+// a sequence lock: 'seq' is odd while the slot is being updated and 0 as
+// long as the handle never delivered an event. Readers copy the event and
+// retry if 'seq' was odd or changed meanwhile, they never block the writer.
+// The server clears 'magic' when it stops, the page is stale afterwards.
+#define SENSORS_PROXY_LATEST_MAGIC 0x54534c53	// "SLST"
+#define SENSORS_PROXY_LATEST_VERSION 1
+
+struct sensors_proxy_latest_hdr {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t slot_count;	// highest handle + 1
+	uint32_t slot_size;
+} __attribute__ ((aligned(64)));
+
+struct sensors_proxy_latest_slot {
+	uint32_t seq;
+	uint32_t reserved;
+	sensors_event_t event;
+} __attribute__ ((aligned(64)));
+
+#define SENSORS_PROXY_PKT_MAX \
+	(sizeof(struct sensors_proxy_msg) + SENSORS_PROXY_BATCH_MAX * sizeof(sensors_event_t))
+
 __END_DECLS
 
 #endif // ANDROID_SENSORS_PROXY_H
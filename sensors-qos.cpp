@@ -0,0 +1,164 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "sensors-qos.h"
+
+#define SQOS_LINE_MAX 256
+
+static int sqos_class_find(const struct sqos *q, const char *name)
+{
+	for (int i = 0; i < q->class_count; i++) {
+		if (!strcmp(q->classes[i].name, name))
+			return i;
+	}
+	return -1;
+}
+
+void sqos_init(struct sqos *q)
+{
+	memset(q, 0, sizeof(*q));
+	strcpy(q->classes[0].name, "default");
+	q->classes[0].priority = 10;
+	q->classes[0].bg_policy = SENSORS_PROXY_BACKGROUND_PAUSE;
+	q->class_count = 1;
+}
+
+// Parses a single line into <q>. Returns 0 on success, -1 otherwise.
+static int sqos_parse(struct sqos *q, const char *line)
+{
+	char kind[16], name[SENSORS_PROXY_CONTAINER_CHARS], container[SENSORS_PROXY_CONTAINER_CHARS];
+	char policy[16];
+	long long delay_ms, period_ms, uid_first, uid_last;
+	int priority, depth, events, bytes, n, i;
+
+	n = sscanf(line, "%15s", kind);
+	if (n <= 0 || kind[0] == '#')
+		return 0;	// empty line or comment
+
+	if (!strcmp(kind, "class")) {
+		events = bytes = 0;
+		n = sscanf(line, "%*s %31s %lld %d %d %d %d", name, &delay_ms, &priority, &depth,
+			   &events, &bytes);
+		if ((n != 4 && n != 6) || delay_ms < 0 || depth < 0 || events < 0 || bytes < 0)
+			return -1;
+		i = sqos_class_find(q, name);
+		if (i < 0) {
+			if (q->class_count == SQOS_CLASSES_MAX)
+				return -1;
+			i = q->class_count++;
+			q->classes[i].bg_policy = SENSORS_PROXY_BACKGROUND_PAUSE;
+			q->classes[i].bg_period_ns = 0;
+		}
+		strcpy(q->classes[i].name, name);
+		q->classes[i].min_delay_ns = delay_ms * 1000000LL;
+		q->classes[i].priority = priority;
+		q->classes[i].queue_depth = depth;
+		q->classes[i].events_per_s = events;
+		q->classes[i].bytes_per_s = bytes;
+		return 0;
+	}
+
+	if (!strcmp(kind, "budget")) {
+		if (sscanf(line, "%*s %d %d", &events, &bytes) != 2 || events < 0 || bytes < 0)
+			return -1;
+		q->events_per_s = events;
+		q->bytes_per_s = bytes;
+		return 0;
+	}
+
+	if (!strcmp(kind, "background")) {
+		period_ms = 0;
+		n = sscanf(line, "%*s %31s %15s %lld", name, policy, &period_ms);
+		i = n >= 2 ? sqos_class_find(q, name) : -1;
+		if (i < 0 || period_ms < 0)
+			return -1;
+		if (!strcmp(policy, "none"))
+			q->classes[i].bg_policy = SENSORS_PROXY_BACKGROUND_NONE;
+		else if (!strcmp(policy, "rate") && period_ms > 0)
+			q->classes[i].bg_policy = SENSORS_PROXY_BACKGROUND_RATE;
+		else if (!strcmp(policy, "batch") && period_ms > 0)
+			q->classes[i].bg_policy = SENSORS_PROXY_BACKGROUND_BATCH;
+		else if (!strcmp(policy, "pause"))
+			q->classes[i].bg_policy = SENSORS_PROXY_BACKGROUND_PAUSE;
+		else
+			return -1;
+		q->classes[i].bg_period_ns = period_ms * 1000000LL;
+		return 0;
+	}
+
+	if (!strcmp(kind, "peer")) {
+		container[0] = '\0';
+		n = sscanf(line, "%*s %lld %lld %31s %31s", &uid_first, &uid_last, name, container);
+		if (n < 3 || uid_first < 0 || uid_last < uid_first ||
+		    q->peer_count == SQOS_PEERS_MAX)
+			return -1;
+		i = sqos_class_find(q, name);
+		if (i < 0)
+			return -1;
+		q->peers[q->peer_count].uid_first = uid_first;
+		q->peers[q->peer_count].uid_last = uid_last;
+		q->peers[q->peer_count].class_index = i;
+		strcpy(q->peers[q->peer_count].container, container);
+		q->peer_count++;
+		return 0;
+	}
+
+	return -1;
+}
+
+int sqos_load(struct sqos *q, const char *path)
+{
+	char line[SQOS_LINE_MAX];
+	int line_no = 0;
+	FILE *f;
+
+	f = fopen(path, "re");
+	if (!f)
+		return -1;
+
+	sqos_init(q);
+	while (fgets(line, sizeof(line), f)) {
+		line_no++;
+		if (sqos_parse(q, line)) {
+			sqos_init(q);
+			fclose(f);
+			return line_no;
+		}
+	}
+	fclose(f);
+	return 0;
+}
+
+const struct sqos_peer *sqos_find(const struct sqos *q, uid_t uid)
+{
+	for (int i = 0; i < q->peer_count; i++) {
+		if (uid >= q->peers[i].uid_first && uid <= q->peers[i].uid_last)
+			return &q->peers[i];
+	}
+	return NULL;
+}
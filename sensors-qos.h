@@ -0,0 +1,91 @@
+/*
+ * This file is part of trust|me
+ * Copyright(c) 2013 - 2017 Fraunhofer AISEC
+ * Fraunhofer-Gesellschaft zur Förderung der angewandten Forschung e.V.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2 (GPL 2), as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE. See the GPL 2 license for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program; if not, see <http://www.gnu.org/licenses/>
+ *
+ * The full GNU General Public License is included in this distribution in
+ * the file called "COPYING".
+ *
+ * Contact Information:
+ * Fraunhofer AISEC <trustme@aisec.fraunhofer.de>
+ */
+
+
+#ifndef ANDROID_SENSORS_QOS_H
+#define ANDROID_SENSORS_QOS_H
+
+#include <stdint.h>
+#include <sys/cdefs.h>
+#include <sys/types.h>
+
+#include "sensors-proxy.h"
+
+__BEGIN_DECLS
+
+#define SQOS_CLASSES_MAX 8
+#define SQOS_PEERS_MAX 16
+
+// Limits of the clients of a QoS class. Class 0 is "default", it applies
+// to peers not listed in the configuration.
+struct sqos_class {
+	char name[SENSORS_PROXY_CONTAINER_CHARS];
+	int64_t min_delay_ns;	// fastest rate the clients may ask for, 0 for any
+	int priority;		// clients with lower values are served first
+	int queue_depth;	// events the socket may hold, 0 for the system default
+	int events_per_s;	// event budget of each client, 0 for none
+	int bytes_per_s;
+	int bg_policy;		// SENSORS_PROXY_BACKGROUND_* in the background, clients may be stricter
+	int64_t bg_period_ns;
+};
+
+// Peers with a uid within [uid_first, uid_last], i.e. the processes of a
+// container with its own uid range
+struct sqos_peer {
+	uid_t uid_first;
+	uid_t uid_last;
+	int class_index;
+	char container[SENSORS_PROXY_CONTAINER_CHARS];	// empty to let the client tell
+};
+
+struct sqos {
+	struct sqos_class classes[SQOS_CLASSES_MAX];
+	int class_count;
+	struct sqos_peer peers[SQOS_PEERS_MAX];
+	int peer_count;
+	int events_per_s;	// budget of all clients together, 0 for none
+	int bytes_per_s;
+};
+
+// Sets up the default class only
+void sqos_init(struct sqos *q);
+
+// Loads the configuration in <path>, made of lines
+//   class <name> <min delay ms> <priority> <queue depth> [<events/s> <bytes/s>]
+//   peer <first uid> <last uid> <class name> [<container>]
+//   budget <events/s> <bytes/s>
+//   background <class name> none|rate|batch|pause [<period ms>]
+// and comments starting with '#'. Budgets of 0 don't limit anything.
+// Classes are paused in the background unless told otherwise, rate and
+// batch need a period. Classes must be defined before the lines using
+// them, "default" may be redefined. Returns 0 on success, -1 with errno
+// set if the file can't be read, or the number of the first line which
+// can't be parsed. <q> is left at the defaults on errors.
+int sqos_load(struct sqos *q, const char *path);
+
+// Returns the entry of the peer with <uid> or NULL if it isn't listed
+const struct sqos_peer *sqos_find(const struct sqos *q, uid_t uid);
+
+__END_DECLS
+
+#endif // ANDROID_SENSORS_QOS_H
@@ -22,63 +22,335 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <fcntl.h>
 #include <sys/cdefs.h>
 #include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/uio.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <linux/sockios.h>
 #include <netinet/in.h>
+#include <time.h>
 #include <unistd.h>
 
 #define LOG_TAG "SensorsServer"
+#include <cutils/ashmem.h>
 #include <cutils/log.h>
 
 #include "sensors-proxy.h"
+#include "sensors-codec.h"
+#include "sensors-history.h"
+#include "sensors-fusion.h"
+#include "sensors-calib.h"
+#include "sensors-filter.h"
+#include "sensors-derive.h"
+#include "sensors-qos.h"
 
 #define SMODULE_CLIENT_MAX 8
 #define EPOLL_DEFAULT_SIZE 32
-#define EPOLL_EVENTS_MAX   (SMODULE_CLIENT_MAX + 1)
+#define EPOLL_EVENTS_MAX   (SMODULE_CLIENT_MAX + 3)
+
+// Maximum age of a cached event of a continuous sensor which is still
+// sent to a new subscriber. Also bounded by twice the sensor's period.
+#define SMODULE_LAST_EVENT_MAX_AGE_NS 1000000000LL
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC       0x0001U
+#define MFD_ALLOW_SEALING 0x0002U
+#endif
+#ifndef F_ADD_SEALS
+#define F_ADD_SEALS   1033
+#define F_SEAL_SEAL   0x0001
+#define F_SEAL_SHRINK 0x0002
+#define F_SEAL_GROW   0x0004
+#endif
+#ifndef F_SEAL_FUTURE_WRITE
+#define F_SEAL_FUTURE_WRITE 0x0010
+#endif
+
+// Time span of events retained per handle for history queries
+#define SMODULE_HISTORY_NS 5000000000LL
+
+// Interval for logging the per client delivery statistics
+#define SMODULE_STATS_INTERVAL_NS 10000000000LL
+
+// Virtual sensors computed by the server, appended to the hardware list
+#define SMODULE_VIRTUAL_MAX 5
+#define SMODULE_VIRTUAL_DEPS_MAX 3
+#define SMODULE_VIRTUAL_VENDOR "trust|me"
+
+// Calibration state of gyroscope and magnetometer, saved at most once per
+// interval while the estimates change
+#define SMODULE_CALIB_PATH "/data/trustme-com/sensors/sensors-calib.dat"
+#define SMODULE_CALIB_SAVE_INTERVAL_NS 60000000000LL
+
+// Derived streams computed at the same time, shared between clients
+#define SMODULE_DERIVED_MAX 8
+
+// QoS classes of the clients by the uid of their process, see sqos_load()
+#define SMODULE_QOS_PATH "/system/etc/sensors-qos.conf"
+
+// Events held back per client while it is batched, a full batch is sent
+// early
+#define SMODULE_BATCH_MAX 256
+
+// Events replayed to a reconnected client per poll round at most, the
+// replay continues in the following rounds
+#define SMODULE_BACKFILL_ROUND_MAX (4 * SENSORS_PROXY_BATCH_MAX)
+
+// Event budgets: buckets hold the tokens of this many seconds. Clients
+// over budget are downgraded one level per step, and upgraded one level
+// per recovery time while they stay out of debt. Downgraded
+// clients are batched for SMODULE_BUDGET_BATCH_NS.
+#define SMODULE_BUDGET_BURST_S 0.5
+#define SMODULE_BUDGET_STEP_NS 500000000LL
+#define SMODULE_BUDGET_RECOVER_NS 2000000000LL
+#define SMODULE_BUDGET_BATCH_NS 100000000LL
+#define SMODULE_BUDGET_LEVEL_MAX 5
+
+// Latency budgets of the events sent to a client: events of wake-up
+// sensors are due within SMODULE_LATENCY_URGENT_NS, the others within the
+// delay the client asked for (SMODULE_LATENCY_DEFAULT_NS for sensors
+// reporting on change) plus the time they are batched
+#define SMODULE_LATENCY_URGENT_NS 10000000LL
+#define SMODULE_LATENCY_DEFAULT_NS 200000000LL
+
+// Adaptive batching of credited clients which don't keep up. Clients
+// report what they consumed after a quarter of the credit window, so up to
+// that much always looks outstanding. Their drain rate is judged once a
+// whole window was sent since the last verdict, at least a period and at
+// most a recovery time later. A client is behind if it's out of credit but
+// for a report, or if more than half the window is outstanding and it
+// drained more than a report less than it got. Then its events are batched
+// twice as long, starting at SMODULE_ADAPT_BATCH_MIN_NS, up to the latency
+// it accepts. Once it drained what it got, with at most half the window
+// outstanding, for a recovery time, the batching shrinks by
+// SMODULE_ADAPT_BATCH_MIN_NS.
+#define SMODULE_ADAPT_PERIOD_NS 250000000LL
+#define SMODULE_ADAPT_RECOVER_NS 2000000000LL
+#define SMODULE_ADAPT_BATCH_MIN_NS 20000000LL
+
+// Commands changing the sensors of a client are limited to this many per
+// second, with the burst of a budget. Beyond that they are held back for
+// a window and merged per handle, the last one sent winning, before any
+// of them reaches the HAL.
+#define SMODULE_COMMAND_RATE 20
+#define SMODULE_COMMAND_WINDOW_NS 100000000LL
 
 struct smodule;
 
+// Sensor computed by the server from the hardware sensors it depends on.
+// The dependencies are enabled as long as the virtual sensor is.
+struct smodule_virtual {
+	int handle;
+	int type;
+	int deps[SMODULE_VIRTUAL_DEPS_MAX];	// handles the sensor is computed from, the first one sets the rate
+	int dep_count;
+};
+
+// Token bucket of a budget. Events are charged once they have been sent,
+// so the tokens may become negative.
+struct smodule_bucket {
+	double rate;		// tokens per second, 0 for no limit
+	double burst;		// capacity
+	double tokens;
+};
+
+// Event budget in events and bytes per second
+struct smodule_budget {
+	struct smodule_bucket events;
+	struct smodule_bucket bytes;
+	int64_t refill_ns;
+};
+
+// States of a budget, from worst to best
+enum smodule_budget_state_e {
+	SMODULE_BUDGET_EXHAUSTED = 0,	// more than a burst in debt
+	SMODULE_BUDGET_DEBT,
+	SMODULE_BUDGET_OK,
+	SMODULE_BUDGET_FULL,	// a whole burst available
+};
+
+// Lanes of the events sent to a client, see SENSORS_PROXY_MSG_LANE
+enum smodule_lane_e {
+	SMODULE_LANE_BULK = 0,
+	SMODULE_LANE_URGENT,
+	SMODULE_LANES,
+};
+
+// Delivery latency of the events sent on a lane, from their timestamp
+// until they were handed to the socket
+struct smodule_latency {
+	uint64_t count;
+	int64_t total_ns;
+	int64_t max_ns;
+};
+
+// Kinds of commands held back for a handle
+enum smodule_command_e {
+	SMODULE_COMMAND_ACTIVATE = 1 << 0,
+	SMODULE_COMMAND_DELAY = 1 << 1,
+	SMODULE_COMMAND_DELAY_BAND = 1 << 2,
+};
+
+// Last commands a client sent for a handle while it was rate limited
+struct smodule_command {
+	int kinds;		// SMODULE_COMMAND_* flags
+	int enabled;
+	int64_t delay_ns;
+	int64_t delay_min_ns;
+	int64_t delay_max_ns;
+};
+
 // Sensors module
 struct smodule_client {
 	struct smodule *smod;
 	int sock_fd;
+	int lane_fd;		// server end of the urgent lane, -1 if not opened
+	int framed;		// got framed messages, see SENSORS_PROXY_CMD_LEGACY_SIZE
+	pid_t pid;		// peer credentials taken on connect
+	uid_t uid;
+	const struct sqos_class *qos;	// limits of the client
+	int container_fixed;	// container set by the QoS configuration
 	int sensors_enabled;	// number of sensors enabled by this client
-	char *sensor_enabled;	// array with 'handle_last+1' fields
+	char *sensor_enabled;	// array with 'handle_last+1' fields, SENSORS_PROXY_ACTIVATE_*
 	int64_t *sensor_delay_ns;	// array with 'handle_last+1' fields
+	int64_t *sensor_delay_min_ns;	// array with 'handle_last+1' fields, delay band or 0
+	int64_t *sensor_delay_max_ns;	// array with 'handle_last+1' fields
+	int encoding;		// SENSORS_PROXY_ENCODING_* of the event stream
+	uint32_t *sensor_seq;	// array with 'handle_last+1' fields, last sequence number sent
+	struct sfilter *filter;	// array with 'handle_last+1' fields
+	int filters_active;	// number of handles with a filter set
+	char derived[SMODULE_DERIVED_MAX];	// subscribed to smod->derived[i]
+	int64_t derived_delay_ns[SMODULE_DERIVED_MAX];	// source delay requested for it
+	int derived_count;	// number of derived streams subscribed
+	char container[SENSORS_PROXY_CONTAINER_CHARS];	// empty if not named
+	int background;		// the container isn't in the foreground
+	int prepared;		// ... but it's about to come, see SENSORS_PROXY_CTRL_PREPARE
+	int bg_policy;		// SENSORS_PROXY_BACKGROUND_*
+	int64_t bg_period_ns;
+	int64_t *bg_last_ns;	// array with 'handle_last+1' fields, last event sent in background
+	int64_t *backfill_ns;	// array with 'handle_last+1' fields, last event replayed, 0 if done
+	int backfills;		// number of handles still replaying
+	int sndbuf;		// send buffer size of sock_fd
+	sensors_event_t *batch;	// SMODULE_BATCH_MAX events held back
+	int batch_count;
+	int64_t batch_ns;	// time the first of them was held back
+	struct smodule_budget budget;	// of the QoS class, protected by mutex
+	int budget_level;	// downgrade level, see sensors_proxy_budget
+	int64_t budget_level_ns;	// time the level last changed
+	int64_t budget_ok_ns;	// time since the budget stayed out of debt, 0 if it didn't
+	uint32_t *budget_skip;	// array with 'handle_last+1' fields, decimation counters
+	uint64_t events_shed;	// number of events dropped to keep the budget
+	struct smodule_budget commands;	// rate limit of the commands, only events used
+	struct smodule_command *command;	// array with 'handle_last+1' fields
+	int commands_held;	// number of handles with commands held back
+	int64_t commands_held_ns;	// time the first of them was held back
+	uint64_t commands_received;
+	uint64_t commands_merged;	// number of commands overwritten by a later one
+	uint64_t events_sent;	// number of events sent
+	uint64_t events_dropped;	// number of events the socket didn't accept
+	uint64_t events_dropped_logged;
+	struct smodule_latency latency[SMODULE_LANES];
+	int64_t deadline_ns;	// of the first event due in this poll round
+	int credited;		// flow controlled, see SENSORS_PROXY_CMD_CREDIT
+	int credit_window;
+	uint64_t events_consumed;	// as last reported by the client
+	int64_t latency_ns;	// batching the client accepts when falling behind
+	int64_t adapt_batch_ns;	// batching while it does, 0 if it keeps up
+	int64_t adapt_ns;	// time the batching was last evaluated
+	int64_t adapt_caught_up_ns;	// time since the client keeps up, 0 if it doesn't
+	uint64_t adapt_sent;	// events_sent then
+	uint64_t adapt_consumed;	// events_consumed then
+	uint64_t deadlines_missed;	// number of events sent after their deadline
+	char *reply;		// records of the reply being sent, NULL if none
+	size_t reply_size;	// of a record
+	int reply_count;
+	int reply_pos;		// records sent so far
+	int reply_msg;		// tag of the chunks ...
+	int reply_msg_end;	// ... and of the last one
+	int reply_waiting;	// for the socket to become writable
 };
 
 // Sensors module client
 struct smodule {
 	struct sensors_poll_device_t *device;
 	struct sensors_module_t *module;
-	const struct sensor_t *sensor_list;
+	struct sensor_t *sensor_list;	// hardware sensors followed by the virtual ones
 	int sensor_count;
+	int hw_sensor_count;	// number of hardware sensors
 	int handle_last;	// highest handle number used
+	struct smodule_virtual virtual_sensors[SMODULE_VIRTUAL_MAX];
+	int virtual_count;
+	int accel_handle;	// hardware sensors feeding the fusion, -1 if missing
+	int gyro_handle;
+	int mag_handle;
+	struct sfusion fusion;	// attitude of the fusion sensors, protected by mutex
+	int calib_gyro;		// the server calibrates the gyroscope, the HAL doesn't
+	int calib_mag;		// ... and the magnetometer
+	struct scalib_gyro gyro_calib;	// calibration estimates, protected by mutex
+	struct scalib_mag mag_calib;
+	int calib_changed;	// estimates changed since they were saved
+	int64_t calib_saved_ns;
 	int *sensors_enabled;	// array with 'handle_last+1' fields
 	int64_t *sensor_delay_ns;	// array with 'handle_last+1' fields
+	float *q16_scale;	// array with 'handle_last+1' fields, 0 if not quantizable
+	sensors_event_t *last_event;	// array with 'handle_last+1' fields
+	int64_t *last_event_ns;	// array with 'handle_last+1' fields, receive time, 0 if none
+	struct sensors_proxy_latest_hdr *latest;	// shared latest value page
+	size_t latest_size;
+	int latest_fd;		// sealed fd of the latest value page handed to clients
+	struct shistory *history;	// array with 'handle_last+1' fields
+	struct srollup *rollup;		// array with 'handle_last+1' fields
+	struct sderive derived[SMODULE_DERIVED_MAX];	// protected by mutex
+	sensors_event_t *dispatch;	// events of a client in a poll round, see smodule_new()
+	struct sqos qos;
+	struct smodule_budget budget;	// of all clients together, protected by mutex
 	int epoll_fd;
 	int sock_fd;
+	int wake_fd;		// eventfd waking the event loop up when batches start
+	int ctrl_fd;		// control socket of the container manager
+	int ctrl_conn_fd;	// its connection, -1 if none
+	int foreground_set;	// the container manager told which container is in the foreground
+	char foreground[SENSORS_PROXY_CONTAINER_CHARS];	// empty if none is
+	char prepared[SENSORS_PROXY_CONTAINER_CHARS];	// container coming next, empty if none
+	int64_t prepared_ns;	// time the switch was announced
 	pthread_t poll_thread;
 	int stop_thread;	// used to stop the sensor polling thread
+	int64_t stats_logged_ns;	// last time the client statistics were logged
 	pthread_mutex_t mutex;	// protects the list of clients
-	struct smodule_client *clients[SMODULE_CLIENT_MAX];
+	struct smodule_client *clients[SMODULE_CLIENT_MAX];	// by QoS priority
 	int client_count;
 };
 
 static int smodule_remove_client(struct smodule *smod, struct smodule_client *client);
+static int64_t smodule_client_batch_ns(const struct smodule_client *client);
+static int smodule_client_credit(const struct smodule_client *client);
 
 //
 // Some helper functions
 //
 
+static int64_t smodule_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 static int recv_all(int sock_fd, void *buf, size_t len)
 {
 	char *ptr = (char *)buf;
@@ -114,6 +386,21 @@ static int epoll_add_fd(const int epoll_fd, const int fd, void *data)
 	return err;
 }
 
+static int epoll_mod_fd(const int epoll_fd, const int fd, uint32_t events, void *data)
+{
+	struct epoll_event event;
+	int err;
+
+	memset(&event, 0, sizeof(event));
+	event.events = events;
+	event.data.ptr = data;
+
+	err = epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &event);
+	ALOGE_IF(err, "couldn't modify fd %d in epoll fd %d: %s", fd, epoll_fd, strerror(errno));
+
+	return err;
+}
+
 static int epoll_del_fd(const int epoll_fd, const int fd)
 {
 	struct epoll_event event;
@@ -126,6 +413,15 @@ static int epoll_del_fd(const int epoll_fd, const int fd)
 	return err;
 }
 
+static const struct sensor_t *smodule_sensor_get(const struct smodule *smod, int handle)
+{
+	for (int i = 0; i < smod->sensor_count; i++) {
+		if (smod->sensor_list[i].handle == handle)
+			return &smod->sensor_list[i];
+	}
+	return NULL;
+}
+
 // Sensors module client functions
 //
 
@@ -163,236 +459,1902 @@ static int smodule_client_send_list(const struct smodule_client *client)
 	return 0;
 }
 
-static void smodule_client_update_delay(struct smodule_client *client, int handle)
+// Sends a packet of <count> records of message <msg> on <fd>
+static int smodule_send_msg(int fd, int msg, const void *records, size_t size, int count,
+			    int flags)
 {
-	struct smodule *smod = client->smod;
-	// We maintain two arrays to track the sensor delay settings:
-	// smod->sensor_delay_ns[handle] : holds the current delay
-	//   value set (hardware wise) for sensor <handle>
-	// client->sensor_enabled[handle]: holds the delay value of
-	//   sensor <handle> set by the client
-	int64_t delay_min = LLONG_MAX;
-	int i, err;
+	struct sensors_proxy_msg hdr;
+	struct iovec iov[2];
+	struct msghdr mh;
+	int ret;
 
-	ALOG_ASSERT(handle >= 0 && handle <= smod->handle_last,
-		    "sensor %s is invalid", handle);
+	hdr.msg = msg;
+	hdr.count = count;
+	iov[0].iov_base = &hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = (void *)records;
+	iov[1].iov_len = size;
 
-	pthread_mutex_lock(&smod->mutex);
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = iov;
+	mh.msg_iovlen = 2;
 
-	// Find the lowest delay value specified by the client(s)
-	for (i = 0; i < smod->client_count; i++) {
-		struct smodule_client *c = smod->clients[i];
-		int64_t delay = c->sensor_delay_ns[handle];
-		if (c->sensor_enabled[handle] && delay > 0 && delay < delay_min)
-			delay_min = delay;
+	ret = sendmsg(fd, &mh, flags);
+	if (ret < 0) {
+		ALOGE_IF(errno != EAGAIN, "fd%d: couldn't send %d record(s) of message %d: %s",
+			 fd, count, msg, strerror(errno));
+		return -1;
 	}
+	return 0;
+}
 
-	pthread_mutex_unlock(&smod->mutex);
+static int smodule_client_send_fd(const struct smodule_client *client, int msg, int fd)
+{
+	struct sensors_proxy_msg hdr;
+	struct iovec iov;
+	struct msghdr mh;
+	struct cmsghdr *cmsg;
+	char cbuf[CMSG_SPACE(sizeof(fd))];
+	int ret;
 
-	if (delay_min == LLONG_MAX)
-		return;
+	hdr.msg = msg;
+	hdr.count = 0;
+	iov.iov_base = &hdr;
+	iov.iov_len = sizeof(hdr);
 
-	// Fixme: delay==0 must be handled in a special way
-	if (smod->sensor_delay_ns[handle] == 0 || delay_min != smod->sensor_delay_ns[handle]) {
-		ALOGI("fd%d: setting delay of sensor %d to %lld ns", client->sock_fd, handle,
-		      delay_min);
-		smod->sensor_delay_ns[handle] = delay_min;
-		err = smod->device->setDelay(smod->device, handle, delay_min);
-		ALOGE_IF(err, "fd%d: setDelay() for handle %d failed: %s",
-			 client->sock_fd, handle, strerror(-err));
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = cbuf;
+	mh.msg_controllen = sizeof(cbuf);
+
+	cmsg = CMSG_FIRSTHDR(&mh);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(fd));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+	ret = sendmsg(client->sock_fd, &mh, 0);
+	if (ret < 0) {
+		ALOGE("fd%d: couldn't send fd with message %d: %s",
+		      client->sock_fd, msg, strerror(errno));
+		return -1;
 	}
+	return 0;
 }
 
-static void smodule_client_update_activate(struct smodule_client *client, int handle,
-					   int activate_enabled)
+static int smodule_client_send_packet(struct smodule_client *client, int lane, int msg,
+				      const void *records, size_t size, int count)
 {
-	struct smodule *smod = client->smod;
-	// We maintain various arrays to track the sensor usage:
-	// smod->sensors_enabled[handle] : holds the number of
-	//   clients having sensor <handle> enabled.
-	// client->sensor_enabled[handle]: tells if the sensor
-	//   <handle> is enabled or disabled.
-	char *enabled = &client->sensor_enabled[handle];
-	int *enabled_count = &smod->sensors_enabled[handle];
-	int enabled_count_old;
-	int do_activate = 0;
-	int err;
+	const int fd = lane == SMODULE_LANE_URGENT && client->lane_fd >= 0 ?
+	    client->lane_fd : client->sock_fd;
 
-	ALOG_ASSERT(handle >= 0 && handle <= smod->handle_last,
-		    "sensor %s is invalid", handle);
+	// Never block the poll thread on a client which doesn't keep up, the
+	// packet is dropped instead and the client sees a sequence gap.
+	if (smodule_send_msg(fd, msg, records, size, count, MSG_DONTWAIT)) {
+		client->events_dropped += count;
+		return -1;
+	}
+	client->events_sent += count;
+	return 0;
+}
 
-	pthread_mutex_lock(&smod->mutex);
+static void smodule_bucket_init(struct smodule_bucket *b, int rate)
+{
+	b->rate = rate;
+	b->burst = rate * SMODULE_BUDGET_BURST_S;
+	b->tokens = b->burst;
+}
 
-	enabled_count_old = *enabled_count;
-	if (activate_enabled) {
-		if (*enabled) {
-			pthread_mutex_unlock(&smod->mutex);
-			return;	// nop
-		}
-		client->sensors_enabled++;
-		*enabled = 1;
-		if (!*enabled_count)
-			do_activate = 1;	// enable sensor
-		(*enabled_count)++;
-	} else {
-		if (!*enabled) {
-			pthread_mutex_unlock(&smod->mutex);
-			return;	// nop
-		}
-		client->sensors_enabled--;
-		*enabled = 0;
-		(*enabled_count)--;
-		if (!*enabled_count)
-			do_activate = 1;	// disable sensor
+static int smodule_bucket_state(const struct smodule_bucket *b)
+{
+	if (!b->rate || b->tokens >= b->burst)
+		return SMODULE_BUDGET_FULL;
+	if (b->tokens >= 0)
+		return SMODULE_BUDGET_OK;
+	return b->tokens >= -b->burst ? SMODULE_BUDGET_DEBT : SMODULE_BUDGET_EXHAUSTED;
+}
+
+static void smodule_budget_init(struct smodule_budget *b, int events_per_s, int bytes_per_s)
+{
+	smodule_bucket_init(&b->events, events_per_s);
+	smodule_bucket_init(&b->bytes, bytes_per_s);
+	b->refill_ns = smodule_now_ns();
+}
+
+static void smodule_budget_refill(struct smodule_budget *b, int64_t now)
+{
+	const double s = (now - b->refill_ns) / 1e9;
+
+	b->events.tokens += b->events.rate * s;
+	if (b->events.tokens > b->events.burst)
+		b->events.tokens = b->events.burst;
+	b->bytes.tokens += b->bytes.rate * s;
+	if (b->bytes.tokens > b->bytes.burst)
+		b->bytes.tokens = b->bytes.burst;
+	b->refill_ns = now;
+}
+
+static void smodule_budget_charge(struct smodule_budget *b, int events, size_t bytes)
+{
+	b->events.tokens -= events;
+	b->bytes.tokens -= bytes;
+}
+
+// Returns the worse of the states of the event and byte bucket
+static int smodule_budget_state(const struct smodule_budget *b)
+{
+	const int events = smodule_bucket_state(&b->events);
+	const int bytes = smodule_bucket_state(&b->bytes);
+
+	return events < bytes ? events : bytes;
+}
+
+// Returns the lane of the event, wake-up sensors take the urgent one
+static int smodule_event_lane(const sensors_event_t *event)
+{
+	switch (event->type) {
+	case SENSOR_TYPE_PROXIMITY:
+	case SENSOR_TYPE_SIGNIFICANT_MOTION:
+		return SMODULE_LANE_URGENT;
+	default:
+		return SMODULE_LANE_BULK;
 	}
+}
 
-	pthread_mutex_unlock(&smod->mutex);
+// Returns the latency budget of <event> sent to the client on <lane>
+static int64_t smodule_client_latency_ns(const struct smodule_client *client, int lane,
+					 const sensors_event_t *event)
+{
+	const int64_t delay = client->sensor_delay_ns[event->sensor];
 
-	ALOGI("fd%d: %sable sensor %d, do_activate %d",
-	      client->sock_fd, activate_enabled ? "en" : "dis", handle, do_activate);
+	if (lane == SMODULE_LANE_URGENT)
+		return SMODULE_LATENCY_URGENT_NS;
+	return (delay > 0 ? delay : SMODULE_LATENCY_DEFAULT_NS) + smodule_client_batch_ns(client);
+}
 
-	if (do_activate) {
-		err = smod->device->activate(smod->device, handle, activate_enabled);
-		ALOGE_IF(err, "fd%d: activate() for handle %d failed: %s",
-			 client->sock_fd, handle, strerror(-err));
+// Sends <n> events on <lane> in the encoding selected by the client,
+// stamping each with the next sequence number of its handle. All event
+// packets are sent with smod->mutex held to keep them in order.
+static int smodule_client_send_events(struct smodule_client *client, int lane,
+				      sensors_event_t *events, int n)
+{
+	struct smodule *smod = client->smod;
+	struct smodule_latency *latency = &client->latency[lane];
+	struct timespec ts;
+	int64_t now, age;
+	size_t bytes = 0;
+	int off, i, err = 0;
+
+	// Event timestamps are in the time base of elapsedRealtimeNanos()
+	clock_gettime(CLOCK_BOOTTIME, &ts);
+	now = (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+
+	for (i = 0; i < n; i++) {
+		events[i].reserved0 = ++client->sensor_seq[events[i].sensor];
+		if (events[i].type == SENSOR_TYPE_META_DATA)
+			continue;
+		age = now - events[i].timestamp;
+		if (age < 0)
+			age = 0;
+		latency->count++;
+		latency->total_ns += age;
+		if (age > latency->max_ns)
+			latency->max_ns = age;
+		if (age > smodule_client_latency_ns(client, lane, &events[i]))
+			client->deadlines_missed++;
+	}
 
-		// Re-set the delay when the sensor is activated.
-		if (activate_enabled && smod->sensor_delay_ns[handle]) {
-			err = smod->device->setDelay(smod->device, handle,
-						     smod->sensor_delay_ns[handle]);
-			ALOGE_IF(err, "fd%d: setDelay() for handle %d failed: %s",
-				 client->sock_fd, handle, strerror(-err));
+	// Clients of the first protocol version take bare events, one per packet
+	for (i = 0; i < n && !client->framed; i++) {
+		if (send(client->sock_fd, &events[i], sizeof(events[i]), MSG_DONTWAIT) < 0) {
+			client->events_dropped++;
+			err = -1;
+		} else {
+			client->events_sent++;
 		}
+		bytes += sizeof(events[i]);
 	}
-#if 1
-	{
-		int i;
-		for (i = 0; i <= smod->handle_last; i++) {
-			if (smod->sensors_enabled[i]) {
-				ALOGI("Sensor %d is enabled by %d client(s) with delay %lld ns",
-				      i, smod->sensors_enabled[i], smod->sensor_delay_ns[i]);
-			}
+
+	for (off = 0; off < n && client->framed; off += SENSORS_PROXY_BATCH_MAX) {
+		const sensors_event_t *chunk = &events[off];
+		const int count = n - off < SENSORS_PROXY_BATCH_MAX ? n - off : SENSORS_PROXY_BATCH_MAX;
+
+		// Derived events are never quantized, resampled and predicted
+		// ones have the type of a real sensor though. So connections
+		// with derived streams get plain events only.
+		if (client->encoding != SENSORS_PROXY_ENCODING_Q16 || client->derived_count) {
+			err |= smodule_client_send_packet(client, lane, SENSORS_PROXY_MSG_EVENTS,
+							  chunk, sizeof(sensors_event_t) * count,
+							  count);
+			bytes += sizeof(struct sensors_proxy_msg) + sizeof(sensors_event_t) * count;
+			continue;
+		}
+		// Split the chunk into quantizable events and events which have to
+		// be sent as they are. Events of a given handle always end up in
+		// the same packet type, so their order is retained.
+		sensors_event_t qin[count], plain[count];
+		struct sensors_proxy_qevent qout[count];
+		int nq = 0, np = 0;
+
+		for (i = 0; i < count; i++) {
+			if (smod->q16_scale[chunk[i].sensor] > 0 &&
+			    chunk[i].type < SENSORS_PROXY_TYPE_PRIVATE_BASE)
+				qin[nq++] = chunk[i];
+			else
+				plain[np++] = chunk[i];
+		}
+		if (np) {
+			err |= smodule_client_send_packet(client, lane, SENSORS_PROXY_MSG_EVENTS,
+							  plain, sizeof(sensors_event_t) * np, np);
+			bytes += sizeof(struct sensors_proxy_msg) + sizeof(sensors_event_t) * np;
+		}
+		if (nq) {
+			sensors_codec_q16_encode(qin, nq, smod->q16_scale, qout);
+			err |= smodule_client_send_packet(client, lane,
+							  SENSORS_PROXY_MSG_EVENTS_Q16, qout,
+							  sizeof(qout[0]) * nq, nq);
+			bytes += sizeof(struct sensors_proxy_msg) + sizeof(qout[0]) * nq;
 		}
 	}
-#endif
+
+	smodule_budget_charge(&client->budget, n, bytes);
+	smodule_budget_charge(&smod->budget, n, bytes);
+	return err;
 }
 
-static struct smodule_client *smodule_client_new(struct smodule *smod)
+// Tells if the cached last event of <handle> still describes the current
+// state of the sensor. Must be called with smod->mutex held.
+static int smodule_last_event_fresh(const struct smodule *smod, int handle)
 {
-	struct smodule_client *client;
-	struct sockaddr_in remote;
-	socklen_t remote_addrlen = sizeof(remote);
-	int fd, err;
-
-	fd = accept(smod->sock_fd, (struct sockaddr *)&remote, &remote_addrlen);
-	if (fd < 0) {
-		ALOGE("fd%d: couldn't accept client connection: %s",
-		      smod->sock_fd, strerror(errno));
-		goto err;
+	const int64_t age = smodule_now_ns() - smod->last_event_ns[handle];
+
+	if (!smod->last_event_ns[handle])
+		return 0;
+
+	switch (smod->last_event[handle].type) {
+	case SENSOR_TYPE_SIGNIFICANT_MOTION:
+	case SENSOR_TYPE_STEP_DETECTOR:
+		return 0;	// triggers, replaying them would report a new trigger
+	case SENSOR_TYPE_LIGHT:
+	case SENSOR_TYPE_PROXIMITY:
+	case SENSOR_TYPE_RELATIVE_HUMIDITY:
+	case SENSOR_TYPE_AMBIENT_TEMPERATURE:
+	case SENSOR_TYPE_STEP_COUNTER:
+		return 1;	// on-change, valid as long as the sensor is running
+	default:
+		return age <= SMODULE_LAST_EVENT_MAX_AGE_NS &&
+		       age <= 2 * smod->sensor_delay_ns[handle];
 	}
+}
 
-	client = (struct smodule_client *)calloc(1, sizeof(*client));
-	if (!client) {
-		ALOGE("couldn't allocate memory for client connection");
-		goto err_accept;
-	}
+// Publishes <event> in the shared latest value page. Only called from the
+// poll thread, readers retry instead of ever blocking us.
+static void smodule_latest_write(struct smodule *smod, const sensors_event_t *event)
+{
+	struct sensors_proxy_latest_slot *slot =
+	    (struct sensors_proxy_latest_slot *)(smod->latest + 1) + event->sensor;
+	const uint32_t seq = slot->seq;
+
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->event, event, sizeof(slot->event));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+}
 
-	client->sensor_enabled = (char *)calloc(smod->handle_last + 1, sizeof(char));
-	if (!client->sensor_enabled) {
-		ALOGE("couldn't allocate memory for sensor enabled array");
-		goto err_calloc_client;
+// Sends the chunks of the pending reply until the socket is full, the
+// rest follows once epoll reports it writable again. The epoll thread
+// never waits for a client, so one which doesn't read can't hold up the
+// commands of the others.
+static void smodule_client_flush_reply(struct smodule_client *client)
+{
+	const int per_msg = (SENSORS_PROXY_PKT_MAX - sizeof(struct sensors_proxy_msg)) /
+	    client->reply_size;
+
+	do {
+		const int count = client->reply_count - client->reply_pos < per_msg ?
+		    client->reply_count - client->reply_pos : per_msg;
+		const int last = client->reply_pos + count == client->reply_count;
+
+		if (smodule_send_msg(client->sock_fd,
+				     last ? client->reply_msg_end : client->reply_msg,
+				     client->reply + client->reply_pos * client->reply_size,
+				     client->reply_size * count, count, MSG_DONTWAIT)) {
+			if (errno == EAGAIN) {
+				if (!client->reply_waiting)
+					epoll_mod_fd(client->smod->epoll_fd, client->sock_fd,
+						     EPOLLIN | EPOLLOUT, client);
+				client->reply_waiting = 1;
+				return;
+			}
+			ALOGE("fd%d: giving up on reply message %d", client->sock_fd,
+			      client->reply_msg);
+			break;
+		}
+		client->reply_pos += count;
+	} while (client->reply_pos < client->reply_count);
+
+	if (client->reply_waiting)
+		epoll_mod_fd(client->smod->epoll_fd, client->sock_fd, EPOLLIN, client);
+	client->reply_waiting = 0;
+	free(client->reply);
+	client->reply = NULL;
+}
+
+// Queues <n> records of <size> bytes in <records> as chunked reply, all
+// chunks but the last one are tagged <msg>, the last one <msg_end>. An
+// empty reply still sends <msg_end>, so the client doesn't wait for more.
+// Takes over <records>. Clients wait for the reply before they send the
+// next request, another one arriving in between is dropped.
+static void smodule_client_send_records(struct smodule_client *client, int msg, int msg_end,
+					void *records, size_t size, int n)
+{
+	if (client->reply) {
+		ALOGW("fd%d: dropping request, reply message %d still pending",
+		      client->sock_fd, client->reply_msg);
+		free(records);
+		return;
 	}
+	client->reply = (char *)records;
+	client->reply_size = size;
+	client->reply_count = n;
+	client->reply_pos = 0;
+	client->reply_msg = msg;
+	client->reply_msg_end = msg_end;
+	smodule_client_flush_reply(client);
+}
 
-	client->sensor_delay_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
-	if (!client->sensor_delay_ns) {
-		ALOGE("couldn't allocate memory for sensor delay array");
-		goto err_calloc_sensor_enabled;
+// Sends the retained events of a handle within [t0, t1] in one bulk transfer
+static void smodule_client_send_history(struct smodule_client *client,
+					const struct sensors_proxy_cmd *cmd)
+{
+	struct smodule *smod = client->smod;
+	const struct shistory *h = &smod->history[cmd->handle];
+	sensors_event_t *events;
+	int n;
+
+	n = cmd->history.max < (int)h->capacity ? cmd->history.max : (int)h->capacity;
+	if (n < 0)
+		n = 0;
+
+	events = (sensors_event_t *)malloc(sizeof(sensors_event_t) * (n ? n : 1));
+	if (!events) {
+		ALOGE("couldn't allocate memory for history reply");
+		return;
 	}
 
-	client->smod = smod;
-	client->sock_fd = fd;
-	epoll_add_fd(smod->epoll_fd, fd, client);
+	// Copy the events out, so the poll thread isn't held up by the sending
+	pthread_mutex_lock(&smod->mutex);
+	n = shistory_get(h, cmd->history.t0_ns, cmd->history.t1_ns, events, n);
+	pthread_mutex_unlock(&smod->mutex);
 
-	err = smodule_client_send_list(client);
+	ALOGI("fd%d: sending %d history event(s) of sensor %d", client->sock_fd, n, cmd->handle);
 
-	ALOGI("new client connected on fd %d\n", fd);
+	smodule_client_send_records(client, SENSORS_PROXY_MSG_HISTORY, SENSORS_PROXY_MSG_HISTORY_END,
+				    events, sizeof(sensors_event_t), n);
+}
 
-	return client;
+// Sends the rollup buckets of a handle starting within [t0, t1]
+static void smodule_client_send_rollups(struct smodule_client *client,
+					const struct sensors_proxy_cmd *cmd)
+{
+	struct smodule *smod = client->smod;
+	const struct srollup *r = &smod->rollup[cmd->handle];
+	struct sensors_proxy_rollup *rollups;
+	int n;
 
-err_calloc_sensor_enabled:
-	free(client->sensor_enabled);
-err_calloc_client:
-	free(client);
-err_accept:
-	close(fd);
-err:
-	return NULL;
+	n = cmd->history.max;
+	if (n < 0 || cmd->history.level < 0 || cmd->history.level >= SENSORS_PROXY_ROLLUP_LEVELS)
+		n = 0;
+	if (n > SROLLUP_BUCKETS_MAX)
+		n = SROLLUP_BUCKETS_MAX;
+
+	rollups = (struct sensors_proxy_rollup *)malloc(sizeof(*rollups) * (n ? n : 1));
+	if (!rollups) {
+		ALOGE("couldn't allocate memory for rollup reply");
+		return;
+	}
+
+	pthread_mutex_lock(&smod->mutex);
+	n = srollup_get(r, cmd->history.level, cmd->history.t0_ns, cmd->history.t1_ns, rollups, n);
+	pthread_mutex_unlock(&smod->mutex);
+
+	ALOGI("fd%d: sending %d level %d rollup(s) of sensor %d", client->sock_fd, n,
+	      cmd->history.level, cmd->handle);
+
+	smodule_client_send_records(client, SENSORS_PROXY_MSG_ROLLUP, SENSORS_PROXY_MSG_ROLLUP_END,
+				    rollups, sizeof(*rollups), n);
 }
 
-static int smodule_client_free(struct smodule_client *client)
+static void smodule_client_update_filter(struct smodule_client *client, int handle, int mode,
+					 float value)
 {
 	struct smodule *smod = client->smod;
-	int i;
+	const struct sensor_t *s = smodule_sensor_get(smod, handle);
+	int i, err;
 
-	ALOGI("fd%d: removing this sensor client\n", client->sock_fd);
+	pthread_mutex_lock(&smod->mutex);
 
-	// First disable sensors if necessary
+	err = sfilter_set(&client->filter[handle], mode, value,
+			  s ? sensors_codec_values(s->type) : 0);
+	ALOGW_IF(err, "fd%d: filter %d can't be applied to sensor %d", client->sock_fd, mode,
+		 handle);
+
+	client->filters_active = 0;
 	for (i = 0; i <= smod->handle_last; i++) {
-		if (client->sensor_enabled[i])
-			smodule_client_update_activate(client, i, 0);
+		if (client->filter[i].mode != SENSORS_PROXY_FILTER_NONE)
+			client->filters_active++;
 	}
 
-	epoll_del_fd(smod->epoll_fd, client->sock_fd);
-	smodule_remove_client(smod, client);
-	if (client->sensor_delay_ns)
-		free(client->sensor_delay_ns);
-	if (client->sensor_enabled)
-		free(client->sensor_enabled);
-	free(client);
+	pthread_mutex_unlock(&smod->mutex);
+}
 
-	return 0;
+static void smodule_client_log_stats(const struct smodule_client *client)
+{
+	ALOGI("fd%d: %llu event(s) sent, %llu dropped, %llu shed, %llu late, "
+	      "%llu command(s) received, %llu merged", client->sock_fd,
+	      (unsigned long long)client->events_sent, (unsigned long long)client->events_dropped,
+	      (unsigned long long)client->events_shed, (unsigned long long)client->deadlines_missed,
+	      (unsigned long long)client->commands_received,
+	      (unsigned long long)client->commands_merged);
+	if (client->credited)
+		ALOGI("fd%d: %lld event(s) not consumed yet", client->sock_fd,
+		      (long long)(client->events_sent - client->events_consumed));
+	for (int i = 0; i < SMODULE_LANES; i++) {
+		const struct smodule_latency *l = &client->latency[i];
+		if (!l->count)
+			continue;
+		ALOGI("fd%d: %s lane: latency %lld us on average, %lld us at most", client->sock_fd,
+		      i == SMODULE_LANE_URGENT ? "urgent" : "bulk",
+		      (long long)(l->total_ns / l->count / 1000), (long long)(l->max_ns / 1000));
+	}
 }
 
-static void smodule_client_handle_event(struct smodule_client *client, struct epoll_event *event)
+static const struct smodule_virtual *smodule_virtual_get(const struct smodule *smod, int handle)
 {
-	ALOGV("fd%d: events=%x", client->sock_fd, event->events);
+	for (int i = 0; i < smod->virtual_count; i++) {
+		if (smod->virtual_sensors[i].handle == handle)
+			return &smod->virtual_sensors[i];
+	}
+	return NULL;
+}
 
-	if (event->events & EPOLLIN) {
-		struct sensors_proxy_cmd cmd;
-		int err = recv_all(client->sock_fd, &cmd, sizeof(cmd));
-		if (err) {
-			if (errno == ECONNRESET) {
-				// Peer resetted the connection, remove client and clean up
-				smodule_client_free(client);
-			} else {
-				ALOGE("fd%d: recv client data failed unexpectedly",
-				      client->sock_fd);
+// Tells if virtual sensors of <type> are computed by the fusion
+static int smodule_virtual_fused(int type)
+{
+	switch (type) {
+	case SENSOR_TYPE_GRAVITY:
+	case SENSOR_TYPE_LINEAR_ACCELERATION:
+	case SENSOR_TYPE_ROTATION_VECTOR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+static int smodule_virtual_depends(const struct smodule_virtual *v, int handle)
+{
+	for (int i = 0; i < v->dep_count; i++) {
+		if (v->deps[i] == handle)
+			return 1;
+	}
+	return 0;
+}
+
+// Tells if the client's container is in the background and its events are
+// held back completely, so its subscriptions don't need the sensors
+static int smodule_client_paused(const struct smodule_client *client)
+{
+	return client->background && !client->prepared &&
+	    client->bg_policy == SENSORS_PROXY_BACKGROUND_PAUSE;
+}
+
+// Tells if the client's subscription to <handle> keeps the sensor running
+static int smodule_client_uses(const struct smodule_client *client, int handle)
+{
+	return client->sensor_enabled[handle] == SENSORS_PROXY_ACTIVATE_ON &&
+	    !smodule_client_paused(client);
+}
+
+// Limits a <delay> the client asked for to its QoS class
+static int64_t smodule_client_delay(const struct smodule_client *client, int64_t delay)
+{
+	return delay > 0 && delay < client->qos->min_delay_ns ? client->qos->min_delay_ns : delay;
+}
+
+// Delays the users of a sensor accept: any delay within [lo, hi] suits
+// all of them, <pref> is the lowest delay any of them asked for
+struct smodule_delay_band {
+	int64_t lo;
+	int64_t hi;
+	int64_t pref;
+};
+
+// Adds a user asking for <delay>, which also accepts [min_ns, max_ns] if
+// <min_ns> isn't 0
+static void smodule_delay_band_add(struct smodule_delay_band *b, int64_t delay, int64_t min_ns,
+				   int64_t max_ns)
+{
+	if (!min_ns) {
+		if (delay <= 0)
+			return;
+		min_ns = max_ns = delay;
+	} else if (delay <= 0 || delay < min_ns || delay > max_ns) {
+		delay = max_ns;
+	}
+	if (min_ns > b->lo)
+		b->lo = min_ns;
+	if (max_ns < b->hi)
+		b->hi = max_ns;
+	if (delay < b->pref)
+		b->pref = delay;
+}
+
+static void smodule_client_update_delay(struct smodule_client *client, int handle)
+{
+	struct smodule *smod = client->smod;
+	const struct smodule_virtual *v = smodule_virtual_get(smod, handle);
+	// We maintain two arrays to track the sensor delay settings:
+	// smod->sensor_delay_ns[handle] : holds the current delay
+	//   value set (hardware wise) for sensor <handle>
+	// client->sensor_enabled[handle]: holds the delay value of
+	//   sensor <handle> set by the client
+	struct smodule_delay_band band = { 0, LLONG_MAX, LLONG_MAX };
+	const int64_t delay_cur = smod->sensor_delay_ns[handle];
+	int64_t delay_min;
+	int i, err;
+
+	ALOG_ASSERT(handle >= 0 && handle <= smod->handle_last,
+		    "sensor %s is invalid", handle);
+
+	pthread_mutex_lock(&smod->mutex);
+
+	// Collect the delays accepted by the client(s). Clients in the
+	// background decimating the events are fine with any faster rate.
+	for (i = 0; i < smod->client_count; i++) {
+		struct smodule_client *c = smod->clients[i];
+		const int64_t delay = smodule_client_delay(c, c->sensor_delay_ns[handle]);
+		if (!smodule_client_uses(c, handle))
+			continue;
+		if (c->background && !c->prepared && c->bg_policy == SENSORS_PROXY_BACKGROUND_RATE) {
+			const int64_t d = delay > c->bg_period_ns ? delay : c->bg_period_ns;
+			smodule_delay_band_add(&band, d, 1, d);
+			continue;
+		}
+		smodule_delay_band_add(&band, delay,
+				       smodule_client_delay(c, c->sensor_delay_min_ns[handle]),
+				       smodule_client_delay(c, c->sensor_delay_max_ns[handle]));
+	}
+
+	// Hardware sensors also run at the rate of the enabled virtual
+	// sensors computed from them
+	for (i = 0; i < smod->virtual_count; i++) {
+		const struct smodule_virtual *u = &smod->virtual_sensors[i];
+		if (smod->sensors_enabled[u->handle] && smodule_virtual_depends(u, handle))
+			smodule_delay_band_add(&band, smod->sensor_delay_ns[u->handle], 0, 0);
+	}
+
+	// ... and at the rate subscribers requested for derived streams of them
+	for (i = 0; i < smod->client_count; i++) {
+		struct smodule_client *c = smod->clients[i];
+		for (int j = 0; j < SMODULE_DERIVED_MAX; j++) {
+			const struct sderive *d = &smod->derived[j];
+			if (c->derived[j] && (d->handle == handle || d->aux_handle == handle))
+				smodule_delay_band_add(&band,
+						       smodule_client_delay(c, c->derived_delay_ns[j]),
+						       0, 0);
+		}
+	}
+
+	pthread_mutex_unlock(&smod->mutex);
+
+	if (band.pref == LLONG_MAX)
+		return;
+
+	// Keep the current rate as long as it suits everybody, retuning the
+	// HAL costs power and causes glitches. Otherwise go for the slowest
+	// rate suiting everybody, or the lowest delay asked for if there is
+	// none.
+	if (band.lo > band.hi)
+		delay_min = band.pref;
+	else if (delay_cur >= band.lo && delay_cur <= band.hi)
+		delay_min = delay_cur;
+	else
+		delay_min = band.hi;
+
+	if (v) {
+		// Virtual sensors pass their rate on to their dependencies
+		smod->sensor_delay_ns[handle] = delay_min;
+		for (i = 0; i < v->dep_count; i++)
+			smodule_client_update_delay(client, v->deps[i]);
+		return;
+	}
+
+	// Fixme: delay==0 must be handled in a special way
+	if (smod->sensor_delay_ns[handle] == 0 || delay_min != smod->sensor_delay_ns[handle]) {
+		ALOGI("fd%d: setting delay of sensor %d to %lld ns", client->sock_fd, handle,
+		      delay_min);
+		smod->sensor_delay_ns[handle] = delay_min;
+		err = smod->device->setDelay(smod->device, handle, delay_min);
+		ALOGE_IF(err, "fd%d: setDelay() for handle %d failed: %s",
+			 client->sock_fd, handle, strerror(-err));
+	}
+}
+
+static void smodule_sensor_activate(struct smodule_client *client, int handle, int enabled);
+
+// Counts a user of sensor <handle> inside the server, like a client
+// enabling it would, and switches the sensor on for the first user or off
+// after the last one
+static void smodule_sensor_use(struct smodule_client *client, int handle, int enabled)
+{
+	struct smodule *smod = client->smod;
+	int *enabled_count = &smod->sensors_enabled[handle];
+	int do_activate;
+
+	pthread_mutex_lock(&smod->mutex);
+
+	if (enabled) {
+		do_activate = !*enabled_count;
+		(*enabled_count)++;
+	} else {
+		(*enabled_count)--;
+		do_activate = !*enabled_count;
+		if (!*enabled_count)
+			smod->last_event_ns[handle] = 0;
+	}
+
+	pthread_mutex_unlock(&smod->mutex);
+
+	if (do_activate)
+		smodule_sensor_activate(client, handle, enabled);
+	smodule_client_update_delay(client, handle);
+}
+
+// Enables or disables the dependencies of virtual sensor <v> on behalf of
+// it, like a client would
+static void smodule_virtual_activate(struct smodule_client *client,
+				     const struct smodule_virtual *v, int enabled)
+{
+	struct smodule *smod = client->smod;
+	int i, users = 0;
+
+	pthread_mutex_lock(&smod->mutex);
+
+	// Start over with the attitude once the first fusion sensor is enabled
+	for (i = 0; i < smod->virtual_count; i++) {
+		const struct smodule_virtual *u = &smod->virtual_sensors[i];
+		if (smodule_virtual_fused(u->type))
+			users += smod->sensors_enabled[u->handle];
+	}
+	if (enabled && smodule_virtual_fused(v->type) && users == 1)
+		sfusion_reset(&smod->fusion, 0);
+
+	pthread_mutex_unlock(&smod->mutex);
+
+	for (i = 0; i < v->dep_count; i++)
+		smodule_sensor_use(client, v->deps[i], enabled);
+}
+
+// Switches sensor <handle> on or off after its first subscriber came or
+// its last one left
+static void smodule_sensor_activate(struct smodule_client *client, int handle, int enabled)
+{
+	struct smodule *smod = client->smod;
+	const struct smodule_virtual *v = smodule_virtual_get(smod, handle);
+	int err;
+
+	if (v) {
+		smodule_virtual_activate(client, v, enabled);
+		return;
+	}
+
+	err = smod->device->activate(smod->device, handle, enabled);
+	ALOGE_IF(err, "fd%d: activate() for handle %d failed: %s",
+		 client->sock_fd, handle, strerror(-err));
+
+	// Re-set the delay when the sensor is activated.
+	if (enabled && smod->sensor_delay_ns[handle]) {
+		err = smod->device->setDelay(smod->device, handle, smod->sensor_delay_ns[handle]);
+		ALOGE_IF(err, "fd%d: setDelay() for handle %d failed: %s",
+			 client->sock_fd, handle, strerror(-err));
+	}
+}
+
+// Number of events which fit into the socket of the client without
+// blocking, skbs take about twice the memory of their payload
+static int smodule_client_room(const struct smodule_client *client)
+{
+	int queued;
+
+	if (ioctl(client->sock_fd, SIOCOUTQ, &queued) || queued >= client->sndbuf)
+		return 0;
+	return (client->sndbuf - queued) / 2 / sizeof(sensors_event_t);
+}
+
+// Replays the retained events the client missed while it was disconnected,
+// see smodule_client_start_backfill(). Only as many go out per call as the
+// socket and the credit of the client take, so the replay is complete and
+// doesn't hold up the others. Live events of the handles are skipped
+// meanwhile, they are part of the history. Must be called with smod->mutex
+// held.
+static void smodule_client_backfill(struct smodule_client *client)
+{
+	struct smodule *smod = client->smod;
+	sensors_event_t events[SMODULE_BACKFILL_ROUND_MAX];
+	int handle, room, n;
+
+	room = smodule_client_room(client);
+	if (room > smodule_client_credit(client))
+		room = smodule_client_credit(client);
+	if (room > SMODULE_BACKFILL_ROUND_MAX)
+		room = SMODULE_BACKFILL_ROUND_MAX;
+
+	for (handle = 0; handle <= smod->handle_last && client->backfills && room > 0; handle++) {
+		if (!client->backfill_ns[handle])
+			continue;
+		n = shistory_get(&smod->history[handle], client->backfill_ns[handle] + 1,
+				 LLONG_MAX, events, room);
+		if (n) {
+			// All events of a handle take the same lane
+			smodule_client_send_events(client, smodule_event_lane(&events[0]), events,
+						   n);
+			client->backfill_ns[handle] = events[n - 1].timestamp;
+		}
+		if (n < room) {
+			ALOGI("fd%d: backfill of sensor %d done", client->sock_fd, handle);
+			client->backfill_ns[handle] = 0;
+			client->backfills--;
+		}
+		room -= n;
+	}
+}
+
+// Starts replaying the retained events of <handle> the client missed,
+// <resume_ns> is the timestamp of the last event it got. Must be called
+// with smod->mutex held.
+static void smodule_client_start_backfill(struct smodule_client *client, int handle,
+					  int64_t resume_ns)
+{
+	if (!client->smod->history[handle].capacity || resume_ns <= 0)
+		return;
+
+	ALOGI("fd%d: backfilling sensor %d since %lld", client->sock_fd, handle, resume_ns);
+	if (!client->backfill_ns[handle])
+		client->backfills++;
+	client->backfill_ns[handle] = resume_ns;
+	smodule_client_backfill(client);
+}
+
+// Enables or disables <handle> for the client, <activate_enabled> is one
+// of SENSORS_PROXY_ACTIVATE_*. A <resume_ns> other than 0 marks a client
+// which reconnected, it gets the events it missed first.
+static void smodule_client_update_activate(struct smodule_client *client, int handle,
+					   int activate_enabled, int64_t resume_ns)
+{
+	struct smodule *smod = client->smod;
+	// We maintain various arrays to track the sensor usage:
+	// smod->sensors_enabled[handle] : holds the number of
+	//   clients and virtual sensors having sensor <handle> enabled,
+	//   passive and paused subscribers don't count.
+	// client->sensor_enabled[handle]: tells if the sensor
+	//   <handle> is enabled, passively enabled or disabled.
+	char *enabled = &client->sensor_enabled[handle];
+	int *enabled_count = &smod->sensors_enabled[handle];
+	const int state = activate_enabled == SENSORS_PROXY_ACTIVATE_PASSIVE ?
+	    SENSORS_PROXY_ACTIVATE_PASSIVE : !!activate_enabled;
+	int enabled_count_old, old, paused;
+	int do_activate = 0;
+
+	ALOG_ASSERT(handle >= 0 && handle <= smod->handle_last,
+		    "sensor %s is invalid", handle);
+
+	pthread_mutex_lock(&smod->mutex);
+
+	old = *enabled;
+	if (state == old) {
+		pthread_mutex_unlock(&smod->mutex);
+		return;	// nop
+	}
+	*enabled = state;
+	paused = smodule_client_paused(client);
+
+	// Only active subscribers keep the sensor running, paused ones are
+	// counted once their container comes back to the foreground
+	enabled_count_old = *enabled_count;
+	if (!paused && state == SENSORS_PROXY_ACTIVATE_ON) {
+		if (!*enabled_count)
+			do_activate = 1;	// enable sensor
+		(*enabled_count)++;
+	} else if (!paused && old == SENSORS_PROXY_ACTIVATE_ON) {
+		(*enabled_count)--;
+		if (!*enabled_count) {
+			do_activate = 1;	// disable sensor
+			smod->last_event_ns[handle] = 0;
+		}
+	}
+
+	if (!old) {
+		client->sensors_enabled++;
+		sfilter_reset(&client->filter[handle]);
+
+		// The sensor is already running for other clients, so hand out its
+		// last value right away instead of letting the new subscriber wait
+		// up to a full period (or forever for on-change sensors).
+		if (paused) {
+			ALOGV("fd%d: paused, last value of sensor %d deferred", client->sock_fd, handle);
+		} else if (resume_ns) {
+			smodule_client_start_backfill(client, handle, resume_ns);
+		} else if (enabled_count_old && smodule_last_event_fresh(smod, handle)) {
+			sensors_event_t event = smod->last_event[handle];
+			smodule_client_send_events(client, smodule_event_lane(&event), &event, 1);
+		}
+	} else if (!state) {
+		client->sensors_enabled--;
+		if (client->backfill_ns[handle]) {
+			client->backfill_ns[handle] = 0;
+			client->backfills--;
+		}
+	}
+
+	pthread_mutex_unlock(&smod->mutex);
+
+	ALOGI("fd%d: %sable sensor %d%s, do_activate %d", client->sock_fd, state ? "en" : "dis",
+	      handle, state == SENSORS_PROXY_ACTIVATE_PASSIVE ? " passively" : "", do_activate);
+
+	if (do_activate)
+		smodule_sensor_activate(client, handle, state == SENSORS_PROXY_ACTIVATE_ON);
+#if 1
+	{
+		int i;
+		for (i = 0; i <= smod->handle_last; i++) {
+			if (smod->sensors_enabled[i]) {
+				ALOGI("Sensor %d is enabled by %d client(s) with delay %lld ns",
+				      i, smod->sensors_enabled[i], smod->sensor_delay_ns[i]);
+			}
+		}
+	}
+#endif
+}
+
+// Subscribes the client to the derived stream of <handle> described by
+// <config> or ends the subscription. Each stream is computed once for all
+// clients with the same configuration and keeps its source sensor enabled
+// as long as it has subscribers. The source delay requested isn't part of
+// the configuration, the stream gets every event of the source anyway.
+static void smodule_client_update_derive(struct smodule_client *client, int handle, int enabled,
+					 const struct sensors_proxy_derive *cmd_config)
+{
+	struct smodule *smod = client->smod;
+	const struct sensor_t *s = smodule_sensor_get(smod, handle);
+	struct sensors_proxy_derive config = *cmd_config;
+	struct sderive *d = NULL, *unused = NULL;
+	int i, values, err, use = 0, aux_handle = -1;
+
+	values = sderive_config(&config, s ? sensors_codec_values(s->type) : 0);
+	if (values < 0) {
+		ALOGW("fd%d: derived stream %d can't be computed for sensor %d", client->sock_fd,
+		      config.kind, handle);
+		return;
+	}
+	config.period_ns = 0;
+
+	// Predictions turn the attitude by the rate of the gyroscope
+	if (config.kind == SENSORS_PROXY_DERIVE_PREDICT)
+		aux_handle = smod->gyro_handle;
+
+	pthread_mutex_lock(&smod->mutex);
+
+	for (i = 0; i < SMODULE_DERIVED_MAX; i++) {
+		struct sderive *u = &smod->derived[i];
+		if (!u->users) {
+			if (!unused)
+				unused = u;
+		} else if (u->handle == handle && sderive_match(&config, &u->config)) {
+			d = u;
+			break;
+		}
+	}
+
+	if (enabled) {
+		if (d && client->derived[d - smod->derived])
+			goto out;	// nop
+		if (!d) {
+			if (!unused) {
+				ALOGW("fd%d: no room for another derived stream", client->sock_fd);
+				goto out;
+			}
+			err = sderive_init(unused, handle, aux_handle, &config, values);
+			if (err) {
+				ALOGE("couldn't set up derived stream: %s", strerror(-err));
+				goto out;
+			}
+			d = unused;
+			use = 1;	// first subscriber
+		}
+		d->users++;
+		client->derived[d - smod->derived] = 1;
+		client->derived_delay_ns[d - smod->derived] = cmd_config->period_ns;
+		client->derived_count++;
+	} else {
+		if (!d || !client->derived[d - smod->derived])
+			goto out;	// nop
+		client->derived[d - smod->derived] = 0;
+		client->derived_count--;
+		d->users--;
+		if (!d->users) {
+			ALOGW_IF(d->out_dropped, "derived stream %d of sensor %d skipped %llu event(s)",
+				 config.kind, handle, (unsigned long long)d->out_dropped);
+			sderive_free(d);
+			use = 1;	// last subscriber
+		}
+	}
+
+	ALOGI("fd%d: %s derived stream %d of sensor %d, %d subscriber(s)", client->sock_fd,
+	      enabled ? "subscribed to" : "left", config.kind, handle, d->users);
+out:
+	pthread_mutex_unlock(&smod->mutex);
+
+	if (use) {
+		smodule_sensor_use(client, handle, enabled);
+		if (d->aux_handle >= 0)
+			smodule_sensor_use(client, d->aux_handle, enabled);
+	} else if (d) {
+		smodule_client_update_delay(client, handle);
+		if (d->aux_handle >= 0)
+			smodule_client_update_delay(client, d->aux_handle);
+	}
+}
+
+// Returns the number of events the client can take, see
+// SENSORS_PROXY_CMD_CREDIT
+static int smodule_client_credit(const struct smodule_client *client)
+{
+	int64_t credit;
+
+	if (!client->credited)
+		return INT_MAX;
+	credit = client->events_consumed + client->credit_window - client->events_sent;
+	return credit > 0 ? credit : 0;
+}
+
+// Drops an event due for the client, which sees a gap in the sequence
+// numbers of <handle>
+static void smodule_client_drop(struct smodule_client *client, int handle)
+{
+	client->sensor_seq[handle]++;
+	client->events_dropped++;
+}
+
+// Sends the events held back for the client, as many as its credit
+// allows. Must be called with smod->mutex held.
+static void smodule_client_flush_batch(struct smodule_client *client)
+{
+	const int credit = smodule_client_credit(client);
+	const int n = client->batch_count < credit ? client->batch_count : credit;
+
+	if (!n)
+		return;
+	smodule_client_send_events(client, SMODULE_LANE_BULK, client->batch, n);
+	client->batch_count -= n;
+	memmove(client->batch, &client->batch[n], sizeof(sensors_event_t) * client->batch_count);
+}
+
+// Reports the service level of the client
+static void smodule_client_send_budget(const struct smodule_client *client)
+{
+	struct sensors_proxy_budget budget;
+
+	if (!client->framed)
+		return;
+	memset(&budget, 0, sizeof(budget));
+	budget.level = client->budget_level;
+	budget.decimation = client->budget_level > 1 ? 1 << (client->budget_level - 1) : 1;
+	budget.batch_ns = client->budget_level ? SMODULE_BUDGET_BATCH_NS : 0;
+	budget.min_delay_ns = client->qos->min_delay_ns;
+	budget.events_shed = client->events_shed;
+	smodule_send_msg(client->sock_fd, SENSORS_PROXY_MSG_BUDGET, &budget, sizeof(budget), 1,
+			 MSG_DONTWAIT);
+}
+
+// Returns how long events of the client are held back, 0 if they aren't
+static int64_t smodule_client_batch_ns(const struct smodule_client *client)
+{
+	int64_t ns = client->budget_level ? SMODULE_BUDGET_BATCH_NS : 0;
+
+	if (client->adapt_batch_ns > ns)
+		ns = client->adapt_batch_ns;
+
+	if (client->background && client->bg_policy == SENSORS_PROXY_BACKGROUND_BATCH &&
+	    client->bg_period_ns > ns)
+		ns = client->bg_period_ns;
+	return ns;
+}
+
+// Adds <n> events to the ones held back for the client and sends them
+// all once the first has been held back long enough. Must be called with
+// smod->mutex held.
+static void smodule_client_hold(struct smodule_client *client, const sensors_event_t *events,
+				int n)
+{
+	for (int i = 0; i < n; i++) {
+		if (client->batch_count == SMODULE_BATCH_MAX)
+			smodule_client_flush_batch(client);
+		if (client->batch_count == SMODULE_BATCH_MAX) {
+			// No credit to make room
+			smodule_client_drop(client, events[i].sensor);
+			continue;
+		}
+		if (!client->batch_count) {
+			// The event loop flushes the batch if nothing else does
+			client->batch_ns = smodule_now_ns();
+			eventfd_write(client->smod->wake_fd, 1);
+		}
+		client->batch[client->batch_count++] = events[i];
+	}
+	if (client->batch_count &&
+	    smodule_now_ns() - client->batch_ns >= smodule_client_batch_ns(client))
+		smodule_client_flush_batch(client);
+}
+
+// Sends the events held back for the client once the first has been held
+// back long enough, also if no further event comes along to push them
+// out. Returns the time left until then for epoll_wait(), -1 if none are
+// held back or they wait for credit.
+static int smodule_client_expire_batch(struct smodule_client *client, int64_t now)
+{
+	int64_t left_ms = -1;
+
+	pthread_mutex_lock(&client->smod->mutex);
+	if (client->batch_count && smodule_client_credit(client)) {
+		left_ms = (client->batch_ns + smodule_client_batch_ns(client) - now + 999999) /
+		    1000000;
+		if (left_ms <= 0) {
+			smodule_client_flush_batch(client);
+			left_ms = -1;
+		}
+	}
+	pthread_mutex_unlock(&client->smod->mutex);
+	return left_ms;
+}
+
+// Applies the background policy of the client to the <n> events due for
+// it, the first <raw> of which are sensor events and the rest derived
+// ones. Returns the number of events left to send right away. Must be
+// called with smod->mutex held.
+static int smodule_client_throttle(struct smodule_client *client, sensors_event_t *events, int n,
+				   int raw)
+{
+	int i, count = 0;
+
+	switch (client->bg_policy) {
+	case SENSORS_PROXY_BACKGROUND_RATE:
+		for (i = 0; i < n; i++) {
+			const int handle = events[i].sensor;
+			if (i < raw && events[i].type != SENSOR_TYPE_META_DATA) {
+				if (events[i].timestamp - client->bg_last_ns[handle] < client->bg_period_ns)
+					continue;
+				client->bg_last_ns[handle] = events[i].timestamp;
+			}
+			events[count++] = events[i];
+		}
+		return count;
+
+	case SENSORS_PROXY_BACKGROUND_BATCH:
+		smodule_client_hold(client, events, n);
+		return 0;
+
+	case SENSORS_PROXY_BACKGROUND_PAUSE:
+		return 0;
+
+	default:
+		return n;
+	}
+}
+
+// Tells if <handle> reports continuously, so single events may be dropped
+static int smodule_sensor_continuous(const struct smodule *smod, int handle)
+{
+	const struct sensor_t *s = smodule_sensor_get(smod, handle);
+
+	return s && s->minDelay > 0;
+}
+
+// Downgrades the delivery to a client which didn't keep its budget: the
+// events are batched, continuous sensors are decimated from level 2 on
+// and dropped entirely while the budget is exhausted. <global> is the
+// state of the global budget before the client was served. Returns the
+// number of events left to send right away. Must be called with
+// smod->mutex held.
+static int smodule_client_downgrade(struct smodule_client *client, sensors_event_t *events, int n,
+				    int raw, int global)
+{
+	const struct smodule *smod = client->smod;
+	const int exhausted = global == SMODULE_BUDGET_EXHAUSTED ||
+	    smodule_budget_state(&client->budget) == SMODULE_BUDGET_EXHAUSTED;
+	const uint32_t decimation = client->budget_level > 1 ? 1 << (client->budget_level - 1) : 1;
+	int i, count = 0;
+
+	for (i = 0; i < n; i++) {
+		const int handle = events[i].sensor;
+		if (i < raw && events[i].type != SENSOR_TYPE_META_DATA &&
+		    smodule_sensor_continuous(smod, handle) &&
+		    (exhausted || client->budget_skip[handle]++ % decimation)) {
+			client->events_shed++;
+			continue;
+		}
+		events[count++] = events[i];
+	}
+	smodule_client_hold(client, events, count);
+	return 0;
+}
+
+// Limits the <n> events due for the client to its credit. Events held
+// back for lack of credit go first. Beyond the credit, events of
+// continuous sensors are dropped and the others held back. Returns the
+// number of events left to send right away. Must be called with
+// smod->mutex held.
+static int smodule_client_flow(struct smodule_client *client, sensors_event_t *events, int n)
+{
+	const struct smodule *smod = client->smod;
+	int credit, i;
+
+	if (client->batch_count && !smodule_client_batch_ns(client))
+		smodule_client_flush_batch(client);
+	credit = smodule_client_credit(client);
+	if (n <= credit)
+		return n;
+
+	for (i = credit; i < n; i++) {
+		if (events[i].type != SENSOR_TYPE_META_DATA &&
+		    smodule_sensor_continuous(smod, events[i].sensor))
+			smodule_client_drop(client, events[i].sensor);
+		else
+			smodule_client_hold(client, &events[i], 1);
+	}
+	return credit;
+}
+
+// Adapts the batching of a credited client to the rate it consumes its
+// events at. Must be called with smod->mutex held.
+static void smodule_client_adapt(struct smodule_client *client, int64_t now)
+{
+	const int64_t lag = client->events_sent - client->events_consumed;
+	const uint64_t sent = client->events_sent - client->adapt_sent;
+	const uint64_t consumed = client->events_consumed - client->adapt_consumed;
+	const int step = client->credit_window / 4;
+	const int draining = consumed + step >= sent;
+	const int behind = lag > client->credit_window - step ||
+	    (lag > client->credit_window / 2 && !draining);
+	int64_t batch_ns = client->adapt_batch_ns;
+
+	if (now - client->adapt_ns < SMODULE_ADAPT_PERIOD_NS)
+		return;
+	if (sent < (uint64_t)client->credit_window && lag <= client->credit_window - step &&
+	    now - client->adapt_ns < SMODULE_ADAPT_RECOVER_NS)
+		return;
+
+	if (lag > client->credit_window / 2 || !draining)
+		client->adapt_caught_up_ns = 0;
+	else if (!client->adapt_caught_up_ns)
+		client->adapt_caught_up_ns = now;
+
+	if (behind) {
+		batch_ns = batch_ns ? batch_ns * 2 : SMODULE_ADAPT_BATCH_MIN_NS;
+	} else if (batch_ns && client->adapt_caught_up_ns &&
+		   now - client->adapt_caught_up_ns >= SMODULE_ADAPT_RECOVER_NS) {
+		batch_ns = batch_ns > SMODULE_ADAPT_BATCH_MIN_NS ?
+		    batch_ns - SMODULE_ADAPT_BATCH_MIN_NS : 0;
+		client->adapt_caught_up_ns = now;
+	}
+	if (batch_ns > client->latency_ns)
+		batch_ns = client->latency_ns;
+
+	client->adapt_ns = now;
+	client->adapt_sent = client->events_sent;
+	client->adapt_consumed = client->events_consumed;
+	if (batch_ns == client->adapt_batch_ns)
+		return;
+
+	if (!client->adapt_batch_ns)
+		ALOGI("fd%d: %lld event(s) behind, batching", client->sock_fd, (long long)lag);
+	else if (!batch_ns)
+		ALOGI("fd%d: caught up, not batching anymore", client->sock_fd);
+	ALOGV("fd%d: %lld event(s) behind, batching for %lld ns", client->sock_fd,
+	      (long long)lag, batch_ns);
+	client->adapt_batch_ns = batch_ns;
+	if (!smodule_client_batch_ns(client))
+		smodule_client_flush_batch(client);
+}
+
+// Adapts the downgrade level of the client after it has been served, to
+// its budget and the global one, which was in state <global> before. As
+// clients are served in priority order, those served last are downgraded
+// first if all of them together exceed the global budget. Must be called
+// with smod->mutex held.
+static void smodule_client_budget_update(struct smodule_client *client, int global, int64_t now)
+{
+	int state = smodule_budget_state(&client->budget);
+	int level = client->budget_level;
+
+	if (global < state)
+		state = global;
+	if (state < SMODULE_BUDGET_OK)
+		client->budget_ok_ns = 0;
+	else if (!client->budget_ok_ns)
+		client->budget_ok_ns = now;
+
+	if (state <= SMODULE_BUDGET_DEBT && level < SMODULE_BUDGET_LEVEL_MAX &&
+	    now - client->budget_level_ns >= SMODULE_BUDGET_STEP_NS)
+		level++;
+	else if (level && client->budget_ok_ns &&
+		 now - client->budget_ok_ns >= SMODULE_BUDGET_RECOVER_NS &&
+		 now - client->budget_level_ns >= SMODULE_BUDGET_RECOVER_NS)
+		level--;
+	if (level == client->budget_level)
+		return;
+
+	ALOGW("fd%d: %sgraded to level %d, %llu event(s) shed", client->sock_fd,
+	      level > client->budget_level ? "down" : "up", level,
+	      (unsigned long long)client->events_shed);
+	client->budget_level = level;
+	client->budget_level_ns = now;
+	if (!smodule_client_batch_ns(client))
+		smodule_client_flush_batch(client);
+	smodule_client_send_budget(client);
+}
+
+// Tells if the client is to be throttled with the foreground container
+// known to the server, clients which didn't name theirs always are
+static int smodule_client_backgrounded(const struct smodule_client *client)
+{
+	const struct smodule *smod = client->smod;
+
+	return smod->foreground_set &&
+	    (!client->container[0] || strcmp(client->container, smod->foreground));
+}
+
+// Tells if the background <policy> a client asks for is at least as strict
+// as the one of its QoS class. The container manager picks the policy
+// through the class, clients may only throttle themselves further.
+static int smodule_client_background_stricter(const struct smodule_client *client, int policy,
+					      int64_t period_ns)
+{
+	if (policy == SENSORS_PROXY_BACKGROUND_PAUSE ||
+	    client->qos->bg_policy == SENSORS_PROXY_BACKGROUND_NONE)
+		return 1;
+	return policy == client->qos->bg_policy && period_ns >= client->qos->bg_period_ns;
+}
+
+// Applies the background <policy> to the client and moves it to the
+// background or foreground as the container manager told. Paused
+// subscriptions are taken back from their sensors, so they may switch off,
+// unless the container is about to come to the foreground. The client gets
+// the last value of every sensor still running once it is resumed.
+static void smodule_client_update_background(struct smodule_client *client, int policy,
+					     int64_t period_ns)
+{
+	struct smodule *smod = client->smod;
+	const int background = smodule_client_backgrounded(client);
+	const int prepared = background && client->container[0] &&
+	    !strcmp(client->container, smod->prepared);
+	int i, paused_old, paused, held_old;
+
+	pthread_mutex_lock(&smod->mutex);
+
+	if (background == client->background && prepared == client->prepared &&
+	    policy == client->bg_policy && period_ns == client->bg_period_ns) {
+		pthread_mutex_unlock(&smod->mutex);
+		return;	// nop
+	}
+	paused_old = smodule_client_paused(client);
+	held_old = client->background && client->bg_policy == SENSORS_PROXY_BACKGROUND_PAUSE;
+	client->background = background;
+	client->prepared = prepared;
+	client->bg_policy = policy;
+	client->bg_period_ns = period_ns;
+	paused = smodule_client_paused(client);
+
+	if (!smodule_client_batch_ns(client))
+		smodule_client_flush_batch(client);
+
+	// Catch up with the sensors which kept running meanwhile
+	if (held_old && !(background && policy == SENSORS_PROXY_BACKGROUND_PAUSE)) {
+		for (i = 0; i <= smod->handle_last; i++) {
+			if (client->sensor_enabled[i] && smodule_last_event_fresh(smod, i)) {
+				sensors_event_t event = smod->last_event[i];
+				smodule_client_send_events(client, smodule_event_lane(&event),
+							   &event, 1);
+			}
+		}
+	}
+
+	pthread_mutex_unlock(&smod->mutex);
+
+	ALOGI("fd%d: container '%s' in the %s%s, policy %d period %lld", client->sock_fd,
+	      client->container, background ? "background" : "foreground",
+	      prepared ? " (prepared)" : "", policy, period_ns);
+
+	for (i = 0; i <= smod->handle_last; i++) {
+		if (client->sensor_enabled[i] != SENSORS_PROXY_ACTIVATE_ON)
+			continue;
+		if (paused != paused_old)
+			smodule_sensor_use(client, i, !paused);
+		else
+			smodule_client_update_delay(client, i);
+	}
+}
+
+// Assigns the QoS class and possibly the container of the client by the
+// credentials of its process, which it can't forge
+static void smodule_client_identify(struct smodule_client *client)
+{
+	struct smodule *smod = client->smod;
+	const struct sqos_peer *peer = NULL;
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	int size;
+
+	if (getsockopt(client->sock_fd, SOL_SOCKET, SO_PEERCRED, &cred, &len)) {
+		ALOGE("fd%d: couldn't get peer credentials: %s", client->sock_fd, strerror(errno));
+		client->pid = -1;
+		client->uid = (uid_t)-1;
+	} else {
+		client->pid = cred.pid;
+		client->uid = cred.uid;
+		peer = sqos_find(&smod->qos, cred.uid);
+	}
+
+	client->qos = &smod->qos.classes[peer ? peer->class_index : 0];
+	if (peer && peer->container[0]) {
+		strcpy(client->container, peer->container);
+		client->container_fixed = 1;
+	}
+
+	// Bound the events piling up for a client which doesn't keep up
+	if (client->qos->queue_depth) {
+		size = client->qos->queue_depth * sizeof(sensors_event_t);
+		if (setsockopt(client->sock_fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)))
+			ALOGE("fd%d: couldn't set send buffer size: %s", client->sock_fd,
+			      strerror(errno));
+	}
+
+	ALOGI("fd%d: pid %d uid %d, QoS class %s, container '%s'", client->sock_fd,
+	      client->pid, client->uid, client->qos->name, client->container);
+}
+
+static struct smodule_client *smodule_client_new(struct smodule *smod)
+{
+	struct smodule_client *client;
+	struct sockaddr_in remote;
+	socklen_t remote_addrlen = sizeof(remote);
+	socklen_t optlen;
+	int fd, err;
+
+	fd = accept(smod->sock_fd, (struct sockaddr *)&remote, &remote_addrlen);
+	if (fd < 0) {
+		ALOGE("fd%d: couldn't accept client connection: %s",
+		      smod->sock_fd, strerror(errno));
+		goto err;
+	}
+
+	client = (struct smodule_client *)calloc(1, sizeof(*client));
+	if (!client) {
+		ALOGE("couldn't allocate memory for client connection");
+		goto err_accept;
+	}
+
+	client->sensor_enabled = (char *)calloc(smod->handle_last + 1, sizeof(char));
+	if (!client->sensor_enabled) {
+		ALOGE("couldn't allocate memory for sensor enabled array");
+		goto err_calloc_client;
+	}
+
+	client->sensor_delay_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	if (!client->sensor_delay_ns) {
+		ALOGE("couldn't allocate memory for sensor delay array");
+		goto err_calloc_sensor_enabled;
+	}
+
+	client->sensor_delay_min_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	client->sensor_delay_max_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	if (!client->sensor_delay_min_ns || !client->sensor_delay_max_ns) {
+		ALOGE("couldn't allocate memory for sensor delay band arrays");
+		goto err_calloc_sensor_delay_band;
+	}
+
+	client->sensor_seq = (uint32_t *)calloc(smod->handle_last + 1, sizeof(uint32_t));
+	if (!client->sensor_seq) {
+		ALOGE("couldn't allocate memory for sensor sequence array");
+		goto err_calloc_sensor_delay_band;
+	}
+
+	client->filter = (struct sfilter *)calloc(smod->handle_last + 1, sizeof(struct sfilter));
+	if (!client->filter) {
+		ALOGE("couldn't allocate memory for sensor filter array");
+		goto err_calloc_sensor_seq;
+	}
+
+	client->bg_last_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	if (!client->bg_last_ns) {
+		ALOGE("couldn't allocate memory for background timestamp array");
+		goto err_calloc_filter;
+	}
+
+	client->budget_skip = (uint32_t *)calloc(smod->handle_last + 1, sizeof(uint32_t));
+	client->batch = (sensors_event_t *)malloc(sizeof(sensors_event_t) * SMODULE_BATCH_MAX);
+	if (!client->budget_skip || !client->batch) {
+		ALOGE("couldn't allocate memory for batching and decimation");
+		goto err_calloc_bg_last_ns;
+	}
+
+	client->command = (struct smodule_command *)calloc(smod->handle_last + 1,
+							    sizeof(struct smodule_command));
+	client->backfill_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	if (!client->command || !client->backfill_ns) {
+		ALOGE("couldn't allocate memory for command and backfill arrays");
+		goto err_calloc_command;
+	}
+
+	client->smod = smod;
+	client->sock_fd = fd;
+	client->lane_fd = -1;
+	client->sndbuf = 0;
+	optlen = sizeof(client->sndbuf);
+	getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &client->sndbuf, &optlen);
+	smodule_client_identify(client);
+	client->bg_policy = client->qos->bg_policy;
+	client->bg_period_ns = client->qos->bg_period_ns;
+	smodule_budget_init(&client->budget, client->qos->events_per_s, client->qos->bytes_per_s);
+	smodule_budget_init(&client->commands, SMODULE_COMMAND_RATE, 0);
+	smodule_client_update_background(client, client->bg_policy, client->bg_period_ns);
+	epoll_add_fd(smod->epoll_fd, fd, client);
+
+	err = smodule_client_send_list(client);
+
+	ALOGI("new client connected on fd %d\n", fd);
+
+	return client;
+
+err_calloc_command:
+	free(client->backfill_ns);
+	free(client->command);
+err_calloc_bg_last_ns:
+	free(client->batch);
+	free(client->budget_skip);
+	free(client->bg_last_ns);
+err_calloc_filter:
+	free(client->filter);
+err_calloc_sensor_seq:
+	free(client->sensor_seq);
+err_calloc_sensor_delay_band:
+	free(client->sensor_delay_max_ns);
+	free(client->sensor_delay_min_ns);
+	free(client->sensor_delay_ns);
+err_calloc_sensor_enabled:
+	free(client->sensor_enabled);
+err_calloc_client:
+	free(client);
+err_accept:
+	close(fd);
+err:
+	return NULL;
+}
+
+static int smodule_client_free(struct smodule_client *client)
+{
+	struct smodule *smod = client->smod;
+	int i;
+
+	ALOGI("fd%d: removing this sensor client\n", client->sock_fd);
+
+	// First disable sensors if necessary
+	for (i = 0; i <= smod->handle_last; i++) {
+		if (client->sensor_enabled[i])
+			smodule_client_update_activate(client, i, 0, 0);
+	}
+	for (i = 0; i < SMODULE_DERIVED_MAX; i++) {
+		if (client->derived[i])
+			smodule_client_update_derive(client, smod->derived[i].handle, 0,
+						     &smod->derived[i].config);
+	}
+
+	epoll_del_fd(smod->epoll_fd, client->sock_fd);
+	smodule_remove_client(smod, client);
+	smodule_client_log_stats(client);
+	if (client->lane_fd >= 0)
+		close(client->lane_fd);
+	if (client->reply)
+		free(client->reply);
+	if (client->command)
+		free(client->command);
+	if (client->backfill_ns)
+		free(client->backfill_ns);
+	if (client->batch)
+		free(client->batch);
+	if (client->budget_skip)
+		free(client->budget_skip);
+	if (client->bg_last_ns)
+		free(client->bg_last_ns);
+	if (client->filter)
+		free(client->filter);
+	if (client->sensor_seq)
+		free(client->sensor_seq);
+	if (client->sensor_delay_max_ns)
+		free(client->sensor_delay_max_ns);
+	if (client->sensor_delay_min_ns)
+		free(client->sensor_delay_min_ns);
+	if (client->sensor_delay_ns)
+		free(client->sensor_delay_ns);
+	if (client->sensor_enabled)
+		free(client->sensor_enabled);
+	free(client);
+
+	return 0;
+}
+
+// Answers SENSORS_PROXY_CMD_GET_STATS, like events the reply is dropped if
+// the socket is full
+static void smodule_client_send_stats(struct smodule_client *client)
+{
+	struct sensors_proxy_stats stats;
+
+	memset(&stats, 0, sizeof(stats));
+	pthread_mutex_lock(&client->smod->mutex);
+	stats.events_sent = client->events_sent;
+	stats.events_dropped = client->events_dropped;
+	stats.commands_received = client->commands_received;
+	stats.commands_merged = client->commands_merged;
+	pthread_mutex_unlock(&client->smod->mutex);
+	smodule_send_msg(client->sock_fd, SENSORS_PROXY_MSG_STATS, &stats, sizeof(stats), 1,
+			 MSG_DONTWAIT);
+}
+
+// Creates the urgent lane of the client and hands its other end over. The
+// client waits for the answer, so it gets one without fd on errors.
+static void smodule_client_open_lane(struct smodule_client *client)
+{
+	struct smodule *smod = client->smod;
+	int sv[2];
+
+	if (client->lane_fd >= 0) {
+		ALOGW("fd%d: urgent lane already open", client->sock_fd);
+		goto err_reply;
+	}
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv)) {
+		ALOGE("fd%d: couldn't create urgent lane: %s", client->sock_fd, strerror(errno));
+		goto err_reply;
+	}
+	if (smodule_client_send_fd(client, SENSORS_PROXY_MSG_LANE, sv[1])) {
+		close(sv[0]);
+		close(sv[1]);
+		goto err_reply;
+	}
+	close(sv[1]);
+
+	pthread_mutex_lock(&smod->mutex);
+	client->lane_fd = sv[0];
+	pthread_mutex_unlock(&smod->mutex);
+	return;
+
+err_reply:
+	smodule_send_msg(client->sock_fd, SENSORS_PROXY_MSG_LANE, NULL, 0, 0, 0);
+}
+
+// Runs the commands in <command> for <handle> of the client
+static void smodule_client_apply_command(struct smodule_client *client, int handle,
+					 const struct smodule_command *command)
+{
+	if (command->kinds & SMODULE_COMMAND_ACTIVATE)
+		smodule_client_update_activate(client, handle, command->enabled, 0);
+	if (command->kinds & SMODULE_COMMAND_DELAY_BAND) {
+		client->sensor_delay_min_ns[handle] = command->delay_min_ns;
+		client->sensor_delay_max_ns[handle] = command->delay_max_ns;
+	}
+	if (command->kinds & SMODULE_COMMAND_DELAY)
+		client->sensor_delay_ns[handle] = command->delay_ns;
+
+	// We also may need to update the sensor delay
+	smodule_client_update_delay(client, handle);
+
+	// Tell the client it won't get the rate it asked for
+	if ((command->kinds & SMODULE_COMMAND_DELAY) &&
+	    smodule_client_delay(client, command->delay_ns) != command->delay_ns) {
+		ALOGW("fd%d: delay limited to %lld ns", client->sock_fd, client->qos->min_delay_ns);
+		smodule_client_send_budget(client);
+	}
+}
+
+// Runs the command of kind <kind> for <handle> of the client right away,
+// unless the client exceeds its command rate or already has commands held
+// back for the handle. Then the command is held back until the window
+// ends, replacing an earlier one of the same kind.
+static void smodule_client_command(struct smodule_client *client, int handle, int kind,
+				   const struct smodule_command *command)
+{
+	struct smodule_command *held = &client->command[handle];
+
+	client->commands_received++;
+	if (!held->kinds) {
+		const int64_t now = smodule_now_ns();
+
+		smodule_budget_refill(&client->commands, now);
+		smodule_budget_charge(&client->commands, 1, 0);
+		if (smodule_budget_state(&client->commands) >= SMODULE_BUDGET_OK) {
+			smodule_client_apply_command(client, handle, command);
+			return;
+		}
+		if (!client->commands_held++)
+			client->commands_held_ns = now;
+	} else if (held->kinds & kind) {
+		client->commands_merged++;
+	}
+
+	held->kinds |= kind;
+	switch (kind) {
+	case SMODULE_COMMAND_ACTIVATE:
+		held->enabled = command->enabled;
+		break;
+	case SMODULE_COMMAND_DELAY:
+		held->delay_ns = command->delay_ns;
+		break;
+	case SMODULE_COMMAND_DELAY_BAND:
+		held->delay_min_ns = command->delay_min_ns;
+		held->delay_max_ns = command->delay_max_ns;
+		break;
+	}
+}
+
+// Runs the commands held back for <handle> of the client right away, e.g.
+// before a command which doesn't queue up behind them
+static void smodule_client_flush_command(struct smodule_client *client, int handle)
+{
+	if (!client->command[handle].kinds)
+		return;
+	smodule_client_apply_command(client, handle, &client->command[handle]);
+	client->command[handle].kinds = 0;
+	client->commands_held--;
+}
+
+// Runs the commands held back for the client once their window ended.
+// Returns the time left until then for epoll_wait(), -1 if none are held
+// back.
+static int smodule_client_release_commands(struct smodule_client *client, int64_t now)
+{
+	const struct smodule *smod = client->smod;
+	int64_t left_ms;
+	int i;
+
+	if (!client->commands_held)
+		return -1;
+	left_ms = (client->commands_held_ns + SMODULE_COMMAND_WINDOW_NS - now + 999999) / 1000000;
+	if (left_ms > 0)
+		return left_ms;
+
+	ALOGV("fd%d: running commands held back for %d handle(s), %llu merged",
+	      client->sock_fd, client->commands_held, (unsigned long long)client->commands_merged);
+	for (i = 0; i <= smod->handle_last; i++)
+		smodule_client_flush_command(client, i);
+	return -1;
+}
+
+// Receives the next command of the client. Commands of the first protocol
+// version are zero-extended, the first one of full size switches the
+// client to framed messages. Returns 0 on success, -1 with errno set
+// otherwise, ECONNRESET if the client went away.
+static int smodule_client_recv_cmd(struct smodule_client *client, struct sensors_proxy_cmd *cmd)
+{
+	int n;
+
+	memset(cmd, 0, sizeof(*cmd));
+	n = recv(client->sock_fd, cmd, sizeof(*cmd), 0);
+	if (n <= 0) {
+		ALOGE("fd%d: recv failed: %s",
+		      client->sock_fd, n < 0 ? strerror(errno) : "peer orderly shutdown");
+		if (n == 0)
+			errno = ECONNRESET;	// handle orderly shutdown as error
+		return -1;
+	}
+	if (n == SENSORS_PROXY_CMD_LEGACY_SIZE && !client->framed)
+		return 0;
+	if (n != sizeof(*cmd)) {
+		ALOGW("fd%d: command of %d bytes", client->sock_fd, n);
+		errno = EBADMSG;
+		return -1;
+	}
+	if (!client->framed) {
+		pthread_mutex_lock(&client->smod->mutex);
+		client->framed = 1;
+		pthread_mutex_unlock(&client->smod->mutex);
+	}
+	return 0;
+}
+
+static void smodule_client_handle_event(struct smodule_client *client, struct epoll_event *event)
+{
+	ALOGV("fd%d: events=%x", client->sock_fd, event->events);
+
+	if (event->events & EPOLLOUT)
+		smodule_client_flush_reply(client);
+
+	if (event->events & EPOLLIN) {
+		struct sensors_proxy_cmd cmd;
+		int err = smodule_client_recv_cmd(client, &cmd);
+		if (err) {
+			if (errno == ECONNRESET) {
+				// Peer resetted the connection, remove client and clean up
+				smodule_client_free(client);
+			} else {
+				ALOGE("fd%d: recv client data failed unexpectedly",
+				      client->sock_fd);
 			}
+		} else if (cmd.handle < 0 || cmd.handle > client->smod->handle_last) {
+			ALOGW("fd%d: ignoring command %d for invalid sensor %d",
+			      client->sock_fd, cmd.cmd, cmd.handle);
 		} else {
+			struct smodule_command command;
+
 			switch (cmd.cmd) {
 			case SENSORS_PROXY_CMD_ACTIVATE:
-				smodule_client_update_activate(client, cmd.handle,
-							       cmd.activate_enabled);
+				command.kinds = SMODULE_COMMAND_ACTIVATE;
+				command.enabled = cmd.activate_enabled;
+				smodule_client_command(client, cmd.handle, command.kinds, &command);
+				break;
+
+			case SENSORS_PROXY_CMD_RESUME:
+				ALOGI("fd%d: resume: handle=%d since %lld", client->sock_fd,
+				      cmd.handle, cmd.resume_ns);
+				smodule_client_flush_command(client, cmd.handle);
+				smodule_client_update_activate(client, cmd.handle, 1, cmd.resume_ns);
+				smodule_client_update_delay(client, cmd.handle);
+				break;
+
+			case SENSORS_PROXY_CMD_SET_DELAY:{
+					ALOGI("fd%d: setDelay: handle=%d ns=%lld",
+					      client->sock_fd, cmd.handle, cmd.set_delay_ns);
+
+					command.kinds = SMODULE_COMMAND_DELAY;
+					command.delay_ns = cmd.set_delay_ns;
+					smodule_client_command(client, cmd.handle, command.kinds,
+							       &command);
+					break;
+				}
+			case SENSORS_PROXY_CMD_SET_DELAY_BAND:
+				ALOGI("fd%d: setDelayBand: handle=%d min=%lld max=%lld", client->sock_fd,
+				      cmd.handle, cmd.delay_band.min_ns, cmd.delay_band.max_ns);
+
+				if (cmd.delay_band.min_ns &&
+				    (cmd.delay_band.min_ns < 0 ||
+				     cmd.delay_band.max_ns < cmd.delay_band.min_ns)) {
+					ALOGW("fd%d: invalid delay band", client->sock_fd);
+					break;
+				}
+				command.kinds = SMODULE_COMMAND_DELAY_BAND;
+				command.delay_min_ns = cmd.delay_band.min_ns;
+				command.delay_max_ns = cmd.delay_band.min_ns ? cmd.delay_band.max_ns : 0;
+				smodule_client_command(client, cmd.handle, command.kinds, &command);
+				break;
+
+			case SENSORS_PROXY_CMD_SET_ENCODING:
+				ALOGI("fd%d: setEncoding: encoding=%d", client->sock_fd, cmd.encoding);
+
+				if (cmd.encoding != SENSORS_PROXY_ENCODING_FLOAT &&
+				    cmd.encoding != SENSORS_PROXY_ENCODING_Q16) {
+					ALOGW("fd%d: unknown encoding %d", client->sock_fd, cmd.encoding);
+					break;
+				}
+				pthread_mutex_lock(&client->smod->mutex);
+				client->encoding = cmd.encoding;
+				pthread_mutex_unlock(&client->smod->mutex);
+				break;
+
+			case SENSORS_PROXY_CMD_OPEN_LANE:
+				ALOGI("fd%d: openLane", client->sock_fd);
+				smodule_client_open_lane(client);
+				break;
+
+			case SENSORS_PROXY_CMD_CREDIT:
+				ALOGV("fd%d: credit: consumed=%llu window=%d", client->sock_fd,
+				      (unsigned long long)cmd.credit.consumed, cmd.credit.window);
+
+				if (cmd.credit.window <= 0) {
+					ALOGW("fd%d: invalid credit window", client->sock_fd);
+					break;
+				}
+				pthread_mutex_lock(&client->smod->mutex);
+				client->credited = 1;
+				client->credit_window = cmd.credit.window;
+				client->events_consumed = cmd.credit.consumed;
+				client->latency_ns = cmd.credit.latency_ms > 0 ?
+				    cmd.credit.latency_ms * 1000000LL : 0;
+				if (!smodule_client_batch_ns(client))
+					smodule_client_flush_batch(client);
+				pthread_mutex_unlock(&client->smod->mutex);
+				break;
 
-				// We also may need to update the sensor delay
-				smodule_client_update_delay(client, cmd.handle);
+			case SENSORS_PROXY_CMD_GET_STATS:
+				ALOGV("fd%d: getStats", client->sock_fd);
+				smodule_client_send_stats(client);
+				break;
 
+			case SENSORS_PROXY_CMD_GET_LATEST:
+				ALOGI("fd%d: getLatest", client->sock_fd);
+				smodule_client_send_fd(client, SENSORS_PROXY_MSG_LATEST,
+						       client->smod->latest_fd);
 				break;
 
-			case SENSORS_PROXY_CMD_SET_DELAY:{
-					ALOGI("fd%d: setDelay: handle=%d ns=%lld",
-					      client->sock_fd, cmd.handle, cmd.set_delay_ns);
+			case SENSORS_PROXY_CMD_GET_HISTORY:
+				ALOGI("fd%d: getHistory: handle=%d t0=%lld t1=%lld max=%d",
+				      client->sock_fd, cmd.handle, cmd.history.t0_ns,
+				      cmd.history.t1_ns, cmd.history.max);
+				smodule_client_send_history(client, &cmd);
+				break;
+
+			case SENSORS_PROXY_CMD_GET_ROLLUP:
+				ALOGI("fd%d: getRollup: handle=%d level=%d t0=%lld t1=%lld max=%d",
+				      client->sock_fd, cmd.handle, cmd.history.level,
+				      cmd.history.t0_ns, cmd.history.t1_ns, cmd.history.max);
+				smodule_client_send_rollups(client, &cmd);
+				break;
+
+			case SENSORS_PROXY_CMD_SET_FILTER:
+				ALOGI("fd%d: setFilter: handle=%d mode=%d value=%f", client->sock_fd,
+				      cmd.handle, cmd.filter.mode, cmd.filter.value);
+				smodule_client_flush_command(client, cmd.handle);
+				smodule_client_update_filter(client, cmd.handle, cmd.filter.mode,
+							     cmd.filter.value);
+				break;
+
+			case SENSORS_PROXY_CMD_DERIVE:
+				ALOGI("fd%d: derive: handle=%d enabled=%d kind=%d period=%lld",
+				      client->sock_fd, cmd.handle, cmd.derive.enabled,
+				      cmd.derive.config.kind, cmd.derive.config.period_ns);
+				smodule_client_flush_command(client, cmd.handle);
+				smodule_client_update_derive(client, cmd.handle, cmd.derive.enabled,
+							     &cmd.derive.config);
+				break;
+
+			case SENSORS_PROXY_CMD_SET_CONTAINER:
+				cmd.container[SENSORS_PROXY_CONTAINER_CHARS - 1] = '\0';
+				ALOGI("fd%d: setContainer: %s", client->sock_fd, cmd.container);
+
+				if (client->container_fixed) {
+					if (strcmp(cmd.container, client->container))
+						ALOGW("fd%d: client claims container '%s'",
+						      client->sock_fd, cmd.container);
+				} else {
+					strcpy(client->container, cmd.container);
+				}
+				smodule_client_update_background(client, client->bg_policy,
+								 client->bg_period_ns);
+				break;
 
-					// First store the clients delay setting
-					client->sensor_delay_ns[cmd.handle] = cmd.set_delay_ns;
-					smodule_client_update_delay(client, cmd.handle);
+			case SENSORS_PROXY_CMD_SET_BACKGROUND:
+				ALOGI("fd%d: setBackground: policy=%d period=%lld", client->sock_fd,
+				      cmd.background.policy, cmd.background.period_ns);
+
+				if (cmd.background.policy < SENSORS_PROXY_BACKGROUND_NONE ||
+				    cmd.background.policy > SENSORS_PROXY_BACKGROUND_PAUSE ||
+				    ((cmd.background.policy == SENSORS_PROXY_BACKGROUND_RATE ||
+				      cmd.background.policy == SENSORS_PROXY_BACKGROUND_BATCH) &&
+				     cmd.background.period_ns <= 0)) {
+					ALOGW("fd%d: invalid background policy", client->sock_fd);
 					break;
 				}
+				if (!smodule_client_background_stricter(client, cmd.background.policy,
+									cmd.background.period_ns)) {
+					cmd.background.policy = client->qos->bg_policy;
+					cmd.background.period_ns = client->qos->bg_period_ns;
+				}
+				smodule_client_update_background(client, cmd.background.policy,
+								 cmd.background.period_ns);
+				break;
+
 			default:
 				break;
 			}
 		}
-	} else {
+	} else if (event->events != EPOLLOUT) {
 		ALOGI("fd%d: unexpected event: events=%x\n", client->sock_fd, event->events);
 		if (errno == ECONNRESET) {
 			// Peer resetted the connection, remove client and clean up
@@ -403,11 +2365,217 @@ static void smodule_client_handle_event(struct smodule_client *client, struct ep
 
 // Sensors module functions
 //
+
+// Feeds the hardware events <events> into the fusion and appends the
+// events of the enabled fusion sensors to <out>, which must have room for
+// SMODULE_VIRTUAL_MAX events per hardware event. Must be called with
+// smod->mutex held. Returns the number of events appended.
+static int smodule_virtual_process(struct smodule *smod, const sensors_event_t *events, int n,
+				   sensors_event_t *out)
+{
+	struct sfusion *f = &smod->fusion;
+	int i, j, count = 0, users = 0;
+
+	f->use_mag = 0;
+	for (j = 0; j < smod->virtual_count; j++) {
+		const struct smodule_virtual *v = &smod->virtual_sensors[j];
+		if (!smodule_virtual_fused(v->type))
+			continue;
+		users += smod->sensors_enabled[v->handle];
+		if (v->type == SENSOR_TYPE_ROTATION_VECTOR && smod->sensors_enabled[v->handle])
+			f->use_mag = 1;
+	}
+	if (!users)
+		return 0;
+
+	for (i = 0; i < n; i++) {
+		const sensors_event_t *ev = &events[i];
+
+		if (ev->type == SENSOR_TYPE_META_DATA)
+			continue;
+		if (ev->sensor == smod->accel_handle) {
+			sfusion_accel(f, ev->data);
+		} else if (ev->sensor == smod->mag_handle) {
+			sfusion_mag(f, ev->data);
+		} else if (ev->sensor == smod->gyro_handle) {
+			if (sfusion_gyro(f, ev->data, ev->timestamp))
+				continue;
+			for (j = 0; j < smod->virtual_count; j++) {
+				const struct smodule_virtual *v = &smod->virtual_sensors[j];
+				sensors_event_t *o = &out[count];
+
+				if (!smodule_virtual_fused(v->type) || !smod->sensors_enabled[v->handle])
+					continue;
+				memset(o, 0, sizeof(*o));
+				o->version = sizeof(sensors_event_t);
+				o->sensor = v->handle;
+				o->type = v->type;
+				o->timestamp = ev->timestamp;
+				switch (v->type) {
+				case SENSOR_TYPE_GRAVITY:
+					sfusion_gravity(f, o->data);
+					break;
+				case SENSOR_TYPE_LINEAR_ACCELERATION:
+					sfusion_linear_accel(f, o->data);
+					break;
+				case SENSOR_TYPE_ROTATION_VECTOR:
+					sfusion_rotation_vector(f, o->data);
+					break;
+				}
+				count++;
+			}
+		}
+	}
+	return count;
+}
+
+static int smodule_virtual_enabled(const struct smodule *smod, int type)
+{
+	for (int i = 0; i < smod->virtual_count; i++) {
+		const struct smodule_virtual *v = &smod->virtual_sensors[i];
+		if (v->type == type)
+			return smod->sensors_enabled[v->handle] ? v->handle : -1;
+	}
+	return -1;
+}
+
+// Updates the calibration estimates with the hardware events <events>,
+// calibrates gyroscope and magnetometer events in place and appends the
+// events of the enabled uncalibrated sensors to <out>. Must be called
+// with smod->mutex held. Returns the number of events appended.
+static int smodule_calibrate(struct smodule *smod, sensors_event_t *events, int n,
+			     sensors_event_t *out)
+{
+	float raw[3];
+	int i, type, handle, count = 0;
+
+	for (i = 0; i < n; i++) {
+		sensors_event_t *ev = &events[i];
+		sensors_event_t *o = &out[count];
+
+		if (ev->type == SENSOR_TYPE_META_DATA)
+			continue;
+		memcpy(raw, ev->data, sizeof(raw));
+		memset(o, 0, sizeof(*o));
+		if (ev->sensor == smod->gyro_handle && smod->calib_gyro) {
+			smod->calib_changed |= scalib_gyro_update(&smod->gyro_calib, raw, ev->timestamp);
+			scalib_gyro_apply(&smod->gyro_calib, raw, ev->data, &o->data[3]);
+			memcpy(o->data, raw, sizeof(raw));
+			if (smod->gyro_calib.valid)
+				ev->gyro.status = SENSOR_STATUS_ACCURACY_HIGH;
+			type = SENSOR_TYPE_GYROSCOPE_UNCALIBRATED;
+		} else if (ev->sensor == smod->mag_handle && smod->calib_mag) {
+			smod->calib_changed |= scalib_mag_update(&smod->mag_calib, raw);
+			scalib_mag_apply(&smod->mag_calib, raw, o->data, &o->data[3], ev->data);
+			if (smod->mag_calib.valid)
+				ev->magnetic.status = SENSOR_STATUS_ACCURACY_HIGH;
+			type = SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED;
+		} else {
+			continue;
+		}
+		handle = smodule_virtual_enabled(smod, type);
+		if (handle < 0)
+			continue;
+
+		o->version = sizeof(sensors_event_t);
+		o->sensor = handle;
+		o->type = type;
+		o->timestamp = ev->timestamp;
+		count++;
+	}
+	return count;
+}
+
+// Saves a copy of the calibration estimates, the poll thread goes on
+// updating them while the file is written and synced
+static void smodule_calib_save(struct smodule *smod)
+{
+	const char *gyro = "", *mag = "";
+	struct scalib_gyro gyro_calib;
+	struct scalib_mag mag_calib;
+
+	if (smod->gyro_handle >= 0)
+		gyro = smodule_sensor_get(smod, smod->gyro_handle)->name;
+	if (smod->mag_handle >= 0)
+		mag = smodule_sensor_get(smod, smod->mag_handle)->name;
+
+	pthread_mutex_lock(&smod->mutex);
+	gyro_calib = smod->gyro_calib;
+	mag_calib = smod->mag_calib;
+	smod->calib_changed = 0;
+	smod->calib_saved_ns = smodule_now_ns();
+	pthread_mutex_unlock(&smod->mutex);
+
+	if (scalib_save(SMODULE_CALIB_PATH, &gyro_calib, gyro, &mag_calib, mag)) {
+		ALOGE("couldn't save calibration to %s: %s", SMODULE_CALIB_PATH, strerror(errno));
+		pthread_mutex_lock(&smod->mutex);
+		smod->calib_changed = 1;	// try again after the interval
+		pthread_mutex_unlock(&smod->mutex);
+		return;
+	}
+	ALOGI("calibration saved: gyro bias %f %f %f, mag offset %f %f %f scale %f %f %f",
+	      gyro_calib.bias[0], gyro_calib.bias[1], gyro_calib.bias[2],
+	      mag_calib.center[0], mag_calib.center[1], mag_calib.center[2],
+	      mag_calib.scale[0], mag_calib.scale[1], mag_calib.scale[2]);
+}
+
+// Puts the clients into the order they are served in with the <n> events
+// of a poll round: earliest deadline first, and for equal deadlines those
+// in the foreground first, both groups by the priority of their QoS class.
+// Must be called with smod->mutex held.
+static int smodule_dispatch_order(const struct smodule *smod, const sensors_event_t *events,
+				  int n, struct smodule_client **order)
+{
+	int i, j, count = 0;
+
+	for (i = 0; i < smod->client_count; i++) {
+		if (!smod->clients[i]->background)
+			order[count++] = smod->clients[i];
+	}
+	for (i = 0; i < smod->client_count; i++) {
+		if (smod->clients[i]->background)
+			order[count++] = smod->clients[i];
+	}
+
+	// The deadline of a client is the earliest one of the events due for
+	// it, held back or new
+	for (i = 0; i < count; i++) {
+		struct smodule_client *client = order[i];
+		int64_t deadline = LLONG_MAX;
+
+		if (client->batch_count)
+			deadline = client->batch[0].timestamp +
+			    smodule_client_latency_ns(client, SMODULE_LANE_BULK, &client->batch[0]);
+		for (j = 0; j < n; j++) {
+			int64_t d;
+			if (!client->sensor_enabled[events[j].sensor])
+				continue;
+			d = events[j].timestamp +
+			    smodule_client_latency_ns(client, smodule_event_lane(&events[j]),
+						      &events[j]);
+			if (d < deadline)
+				deadline = d;
+		}
+		client->deadline_ns = deadline;
+	}
+	for (i = 1; i < count; i++) {
+		struct smodule_client *client = order[i];
+		for (j = i; j > 0 && order[j - 1]->deadline_ns > client->deadline_ns; j--)
+			order[j] = order[j - 1];
+		order[j] = client;
+	}
+	return count;
+}
+
 static void *smodule_poll_thread(void *arg)
 {
 	struct smodule *smod = (struct smodule *)arg;
-	sensors_event_t events[smod->sensor_count];
-	int ret, n, i, j;
+	sensors_event_t events[smod->hw_sensor_count * (1 + SMODULE_VIRTUAL_MAX)];
+	sensors_event_t *out = smod->dispatch;
+	sensors_event_t urgent[smod->hw_sensor_count * (1 + SMODULE_VIRTUAL_MAX)];
+	struct smodule_client *order[SMODULE_CLIENT_MAX];
+	int64_t now;
+	int n, i, j, clients, global;
 
 	ALOGI("%s: thread started: smod@%p", __func__, smod);
 
@@ -418,7 +2586,7 @@ static void *smodule_poll_thread(void *arg)
 	// is still room for optimization.
 	//
 	while (!smod->stop_thread) {
-		n = smod->device->poll(smod->device, events, smod->sensor_count);
+		n = smod->device->poll(smod->device, events, smod->hw_sensor_count);
 		ALOGV("%s: poll returned: %d", __func__, n);
 		if (n <= 0) {
 			ALOGE("sensor poll failed: %s", n < 0 ? strerror(-n) : "returned 0");
@@ -426,21 +2594,106 @@ static void *smodule_poll_thread(void *arg)
 		}
 		// Policy: send sensor data to clients with at least one sensor enabled
 		pthread_mutex_lock(&smod->mutex);
-		for (i = 0; i < smod->client_count; i++) {
-			struct smodule_client *client = smod->clients[i];
-			if (client->sensors_enabled <= 0)
+
+		n += smodule_calibrate(smod, events, n, &events[n]);
+		n += smodule_virtual_process(smod, events, n, &events[n]);
+
+		// Remember the last event of each sensor for new subscribers
+		// and readers of the latest value page
+		for (j = 0; j < n; j++) {
+			const int handle = events[j].sensor;
+			if (events[j].type == SENSOR_TYPE_META_DATA || !smod->sensors_enabled[handle])
 				continue;
+			smod->last_event[handle] = events[j];
+			smod->last_event_ns[handle] = smodule_now_ns();
+			smodule_latest_write(smod, &events[j]);
+			shistory_add(&smod->history[handle], &events[j]);
+			srollup_add(&smod->rollup[handle], &events[j]);
+		}
+		// Derived streams are computed once for all their subscribers
+		for (j = 0; j < SMODULE_DERIVED_MAX; j++) {
+			if (smod->derived[j].users)
+				sderive_run(&smod->derived[j], events, n);
+		}
+		now = smodule_now_ns();
+		smodule_budget_refill(&smod->budget, now);
+		clients = smodule_dispatch_order(smod, events, n, order);
+		for (i = 0; i < clients; i++) {
+			struct smodule_client *client = order[i];
+			int count = 0, raw, nurgent = 0;
+
+			if (client->sensors_enabled <= 0 && !client->derived_count)
+				continue;
+			smodule_budget_refill(&client->budget, now);
+			global = smodule_budget_state(&smod->budget);
 			for (j = 0; j < n; j++) {
-				if (client->sensor_enabled[events[j].sensor]) {
-					ret = send(client->sock_fd, &events[j],
-						   sizeof(sensors_event_t), 0);
-					if (ret < 0) {
-						ALOGE("couldn't send sensor event %d to fd %d: %s",
-						      j, client->sock_fd, strerror(errno));
-						break;
-					}
-				}
+				if (!client->sensor_enabled[events[j].sensor] ||
+				    client->backfill_ns[events[j].sensor])
+					continue;
+				if (smodule_event_lane(&events[j]) == SMODULE_LANE_URGENT)
+					urgent[nurgent++] = events[j];
+				else
+					out[count++] = events[j];
+			}
+			// Filter before the fan-out, so rejected events never cost a send
+			if (count && client->filters_active)
+				count = sfilter_run(client->filter, smod->handle_last, out, count);
+			if (nurgent && client->filters_active)
+				nurgent = sfilter_run(client->filter, smod->handle_last, urgent,
+						      nurgent);
+			// Wake-up events go out first and aren't batched or decimated,
+			// only a paused client doesn't get them
+			if (nurgent && !(client->background &&
+					 client->bg_policy == SENSORS_PROXY_BACKGROUND_PAUSE))
+				smodule_client_send_events(client, SMODULE_LANE_URGENT, urgent,
+							   nurgent);
+			raw = count;
+			for (j = 0; j < SMODULE_DERIVED_MAX; j++) {
+				const struct sderive *d = &smod->derived[j];
+				if (!client->derived[j] || !d->out_count)
+					continue;
+				memcpy(&out[count], d->out, sizeof(sensors_event_t) * d->out_count);
+				count += d->out_count;
+			}
+			// Containers in the background get little or nothing
+			if (client->background)
+				count = smodule_client_throttle(client, out, count, raw);
+			// ... and so do clients which exceed their budget
+			if (client->budget_level)
+				count = smodule_client_downgrade(client, out, count, raw, global);
+			// ... and slow ones get fewer and larger packets
+			if (count && client->adapt_batch_ns) {
+				smodule_client_hold(client, out, count);
+				count = 0;
+			}
+			// ... and nothing beyond what they can take
+			if (client->credited)
+				count = smodule_client_flow(client, out, count);
+			// One packet per client and poll round instead of one per event,
+			// derived events always take the bulk lane
+			if (count)
+				smodule_client_send_events(client, SMODULE_LANE_BULK, out, count);
+			smodule_client_budget_update(client, global, now);
+			if (client->credited && client->latency_ns)
+				smodule_client_adapt(client, now);
+		}
+
+		// Replays continue as far as the clients take them
+		for (i = 0; i < smod->client_count; i++) {
+			if (smod->clients[i]->backfills)
+				smodule_client_backfill(smod->clients[i]);
+		}
+
+		// Log the statistics of clients which lost events recently
+		if (smodule_now_ns() - smod->stats_logged_ns > SMODULE_STATS_INTERVAL_NS) {
+			for (i = 0; i < smod->client_count; i++) {
+				struct smodule_client *client = smod->clients[i];
+				if (client->events_dropped == client->events_dropped_logged)
+					continue;
+				smodule_client_log_stats(client);
+				client->events_dropped_logged = client->events_dropped;
 			}
+			smod->stats_logged_ns = smodule_now_ns();
 		}
 		pthread_mutex_unlock(&smod->mutex);
 	}
@@ -452,15 +2705,19 @@ static int smodule_add_client(struct smodule *smod, struct smodule_client *clien
 	int i, err = -1;
 
 	pthread_mutex_lock(&smod->mutex);
-	for (i = 0; i < SMODULE_CLIENT_MAX; i++) {
-		if (!smod->clients[i]) {
-			smod->clients[i] = client;
-			smod->client_count = i + 1;
-			ALOGI("added client@%p, fd=%d: client_count=%d\n",
-			      client, client->sock_fd, smod->client_count);
-			err = 0;
-			break;
+	if (smod->client_count < SMODULE_CLIENT_MAX) {
+		// Keep the clients ordered by priority, the poll thread serves
+		// them in this order
+		for (i = smod->client_count; i > 0; i--) {
+			if (smod->clients[i - 1]->qos->priority <= client->qos->priority)
+				break;
+			smod->clients[i] = smod->clients[i - 1];
 		}
+		smod->clients[i] = client;
+		smod->client_count++;
+		ALOGI("added client@%p, fd=%d: client_count=%d\n",
+		      client, client->sock_fd, smod->client_count);
+		err = 0;
 	}
 	pthread_mutex_unlock(&smod->mutex);
 
@@ -491,10 +2748,363 @@ static int smodule_remove_client(struct smodule *smod, struct smodule_client *cl
 	return err;
 }
 
+// Maps the latest value page writable for the server and initializes it
+static int smodule_latest_map(struct smodule *smod, int fd)
+{
+	smod->latest = (struct sensors_proxy_latest_hdr *)mmap(NULL, smod->latest_size,
+							       PROT_READ | PROT_WRITE,
+							       MAP_SHARED, fd, 0);
+	if (smod->latest == MAP_FAILED) {
+		ALOGE("couldn't map latest value page: %s", strerror(errno));
+		return -1;
+	}
+	memset(smod->latest, 0, smod->latest_size);
+	smod->latest->magic = SENSORS_PROXY_LATEST_MAGIC;
+	smod->latest->version = SENSORS_PROXY_LATEST_VERSION;
+	smod->latest->slot_count = smod->handle_last + 1;
+	smod->latest->slot_size = sizeof(struct sensors_proxy_latest_slot);
+	return 0;
+}
+
+// Creates the latest value page, preferably as memfd. Once the server
+// mapped it, the memfd is sealed against writes and the ashmem region
+// restricted to PROT_READ. Both apply to the file itself, so a client
+// can't get write access by reopening its fd through /proc either.
+static int smodule_latest_create(struct smodule *smod)
+{
+	int fd = -1;
+
+	smod->latest_size = sizeof(struct sensors_proxy_latest_hdr) +
+	    sizeof(struct sensors_proxy_latest_slot) * (smod->handle_last + 1);
+
+#ifdef __NR_memfd_create
+	fd = syscall(__NR_memfd_create, "sensors-latest", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#endif
+	if (fd >= 0) {
+		if (ftruncate(fd, smod->latest_size) ||
+		    fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW)) {
+			ALOGE("couldn't set up latest value memfd: %s", strerror(errno));
+			goto err_fd;
+		}
+		if (smodule_latest_map(smod, fd))
+			goto err_fd;
+		if (!fcntl(fd, F_ADD_SEALS, F_SEAL_FUTURE_WRITE | F_SEAL_SEAL))
+			goto out;
+
+		// Kernel older than 5.1, fall back to ashmem
+		ALOGI("couldn't seal latest value memfd: %s", strerror(errno));
+		munmap(smod->latest, smod->latest_size);
+		close(fd);
+	}
+
+	fd = ashmem_create_region("sensors-latest", smod->latest_size);
+	if (fd < 0) {
+		ALOGE("couldn't create latest value region: %s", strerror(errno));
+		return -1;
+	}
+	if (smodule_latest_map(smod, fd))
+		goto err_fd;
+	if (ashmem_set_prot_region(fd, PROT_READ)) {
+		ALOGE("couldn't restrict latest value region: %s", strerror(errno));
+		goto err_unmap;
+	}
+
+out:
+	smod->latest_fd = fd;
+	ALOGI("latest value page: %zu bytes, fd %d", smod->latest_size, smod->latest_fd);
+	return 0;
+
+err_unmap:
+	munmap(smod->latest, smod->latest_size);
+err_fd:
+	close(fd);
+	return -1;
+}
+
+// Creates the listening control socket of the container manager, leaves
+// 'ctrl_fd' at -1 on errors
+static int smodule_ctrl_create(struct smodule *smod)
+{
+	struct sockaddr_un addr;
+	int err;
+
+	smod->ctrl_conn_fd = -1;
+	smod->ctrl_fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+	if (smod->ctrl_fd < 0) {
+		ALOGE("couldn't open control socket: %s", strerror(errno));
+		smod->ctrl_fd = -1;
+		return -1;
+	}
+
+	err = unlink(SENSORS_PROXY_CTRL_PATH);
+	if (err && errno != ENOENT)
+		ALOGE("couldn't unlink %s: %s", SENSORS_PROXY_CTRL_PATH, strerror(errno));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	snprintf(addr.sun_path, UNIX_PATH_MAX, "%s", SENSORS_PROXY_CTRL_PATH);
+	err = bind(smod->ctrl_fd, (struct sockaddr *)&addr, sizeof(addr));
+	if (err) {
+		ALOGE("couldn't bind control socket: %s", strerror(errno));
+		goto err_socket;
+	}
+	chmod(SENSORS_PROXY_CTRL_PATH, 0600);
+
+	err = listen(smod->ctrl_fd, 1);
+	if (err) {
+		ALOGE("couldn't listen on control socket: %s", strerror(errno));
+		goto err_socket;
+	}
+
+	err = epoll_add_fd(smod->epoll_fd, smod->ctrl_fd, &smod->ctrl_fd);
+	if (err)
+		goto err_socket;
+	return 0;
+
+err_socket:
+	close(smod->ctrl_fd);
+	smod->ctrl_fd = -1;
+	return -1;
+}
+
+// Applies the container states to all clients
+static void smodule_ctrl_update_clients(struct smodule *smod)
+{
+	// Clients are only added and removed by this thread
+	for (int i = 0; i < smod->client_count; i++) {
+		struct smodule_client *client = smod->clients[i];
+		smodule_client_update_background(client, client->bg_policy, client->bg_period_ns);
+	}
+}
+
+// Returns the time left until a prepared switch is undone for epoll_wait()
+static int smodule_ctrl_timeout_ms(struct smodule *smod)
+{
+	int64_t left_ms;
+
+	if (!smod->prepared[0])
+		return -1;
+	left_ms = SENSORS_PROXY_CTRL_PREPARE_TIMEOUT_MS -
+	    (smodule_now_ns() - smod->prepared_ns) / 1000000;
+	if (left_ms > 0)
+		return left_ms;
+
+	ALOGI("switch to container '%s' didn't happen", smod->prepared);
+	smod->prepared[0] = '\0';
+	smodule_ctrl_update_clients(smod);
+	return -1;
+}
+
+// Saves the calibration estimates at most once per interval while they
+// change, the poll thread never waits for the flash. Returns the time left
+// until they are checked again for epoll_wait().
+static int smodule_calib_timeout_ms(struct smodule *smod)
+{
+	int64_t left_ms;
+	int changed;
+
+	pthread_mutex_lock(&smod->mutex);
+	changed = smod->calib_changed;
+	left_ms = (smod->calib_saved_ns + SMODULE_CALIB_SAVE_INTERVAL_NS - smodule_now_ns()) /
+	    1000000;
+	pthread_mutex_unlock(&smod->mutex);
+
+	if (left_ms > 0)
+		return left_ms;
+	if (changed)
+		smodule_calib_save(smod);
+	return SMODULE_CALIB_SAVE_INTERVAL_NS / 1000000;
+}
+
+// Runs the timers of the event loop which are due and returns the time
+// left until the next one for epoll_wait(), -1 if none is running
+static int smodule_timeout_ms(struct smodule *smod)
+{
+	const int64_t now = smodule_now_ns();
+	int timeout_ms = smodule_ctrl_timeout_ms(smod);
+	const int calib_ms = smodule_calib_timeout_ms(smod);
+
+	if (timeout_ms < 0 || calib_ms < timeout_ms)
+		timeout_ms = calib_ms;
+
+	for (int i = 0; i < smod->client_count; i++) {
+		const int left_ms = smodule_client_release_commands(smod->clients[i], now);
+		const int batch_ms = smodule_client_expire_batch(smod->clients[i], now);
+		if (left_ms >= 0 && (timeout_ms < 0 || left_ms < timeout_ms))
+			timeout_ms = left_ms;
+		if (batch_ms >= 0 && (timeout_ms < 0 || batch_ms < timeout_ms))
+			timeout_ms = batch_ms;
+	}
+	return timeout_ms;
+}
+
+// Accepts the connection of the container manager, replacing a previous one
+static void smodule_ctrl_accept(struct smodule *smod)
+{
+	const int fd = accept(smod->ctrl_fd, NULL, NULL);
+
+	if (fd < 0) {
+		ALOGE("fd%d: couldn't accept control connection: %s", smod->ctrl_fd,
+		      strerror(errno));
+		return;
+	}
+	if (smod->ctrl_conn_fd >= 0) {
+		epoll_del_fd(smod->epoll_fd, smod->ctrl_conn_fd);
+		close(smod->ctrl_conn_fd);
+	}
+	smod->ctrl_conn_fd = fd;
+	epoll_add_fd(smod->epoll_fd, fd, &smod->ctrl_conn_fd);
+	ALOGI("container manager connected on fd %d", fd);
+}
+
+static void smodule_ctrl_handle_event(struct smodule *smod, struct epoll_event *event)
+{
+	struct sensors_proxy_ctrl ctrl;
+
+	if (!(event->events & EPOLLIN) || recv_all(smod->ctrl_conn_fd, &ctrl, sizeof(ctrl))) {
+		ALOGI("fd%d: container manager disconnected", smod->ctrl_conn_fd);
+		epoll_del_fd(smod->epoll_fd, smod->ctrl_conn_fd);
+		close(smod->ctrl_conn_fd);
+		smod->ctrl_conn_fd = -1;
+		return;
+	}
+
+	ctrl.container[SENSORS_PROXY_CONTAINER_CHARS - 1] = '\0';
+	switch (ctrl.cmd) {
+	case SENSORS_PROXY_CTRL_FOREGROUND:
+		ALOGI("container '%s' in the foreground", ctrl.container);
+		strcpy(smod->foreground, ctrl.container);
+		smod->foreground_set = 1;
+		smod->prepared[0] = '\0';
+		break;
+	case SENSORS_PROXY_CTRL_BACKGROUND:
+		ALOGI("no container in the foreground");
+		smod->foreground[0] = '\0';
+		smod->foreground_set = 1;
+		smod->prepared[0] = '\0';
+		break;
+	case SENSORS_PROXY_CTRL_PREPARE:
+		ALOGI("preparing switch to container '%s'", ctrl.container);
+		strcpy(smod->prepared, ctrl.container);
+		smod->prepared_ns = smodule_now_ns();
+		break;
+	default:
+		ALOGW("fd%d: unknown control command %d", smod->ctrl_conn_fd, ctrl.cmd);
+		return;
+	}
+
+	smodule_ctrl_update_clients(smod);
+}
+
+static int smodule_find_type(const struct smodule *smod, int type)
+{
+	for (int i = 0; i < smod->hw_sensor_count; i++) {
+		if (smod->sensor_list[i].type == type)
+			return smod->sensor_list[i].handle;
+	}
+	return -1;
+}
+
+// Appends virtual sensor <type> computed from <deps> to the sensor list,
+// unless the hardware provides it already or a dependency is missing
+static void smodule_virtual_add(struct smodule *smod, int type, const char *name,
+				float max_range, float resolution, const int *deps, int dep_count)
+{
+	struct smodule_virtual *v = &smod->virtual_sensors[smod->virtual_count];
+	struct sensor_t *s = &smod->sensor_list[smod->sensor_count];
+	int i;
+
+	if (smodule_find_type(smod, type) >= 0 || smod->sensor_count >= SENSORS_MAX)
+		return;
+	for (i = 0; i < dep_count; i++) {
+		if (deps[i] < 0)
+			return;
+	}
+
+	memset(s, 0, sizeof(*s));
+	s->name = name;
+	s->vendor = SMODULE_VIRTUAL_VENDOR;
+	s->version = 1;
+	s->handle = smod->handle_last + 1;
+	s->type = type;
+	s->maxRange = max_range;
+	s->resolution = resolution;
+	for (i = 0; i < dep_count; i++)
+		s->power += smodule_sensor_get(smod, deps[i])->power;
+	s->minDelay = smodule_sensor_get(smod, deps[0])->minDelay;
+
+	v->handle = s->handle;
+	v->type = type;
+	memcpy(v->deps, deps, sizeof(*deps) * dep_count);
+	v->dep_count = dep_count;
+
+	ALOGI("Virtual sensor %s: handle %d type %d", name, s->handle, type);
+	smod->handle_last = s->handle;
+	smod->sensor_count++;
+	smod->virtual_count++;
+}
+
+// Copies the hardware sensor list and appends the virtual sensors
+static int smodule_virtual_create(struct smodule *smod, const struct sensor_t *hw_list)
+{
+	const struct sensor_t *accel, *s;
+	int deps[SMODULE_VIRTUAL_DEPS_MAX];
+
+	smod->sensor_list = (struct sensor_t *)calloc(smod->hw_sensor_count + SMODULE_VIRTUAL_MAX,
+						      sizeof(struct sensor_t));
+	if (!smod->sensor_list) {
+		ALOGE("couldn't allocate memory for sensor list");
+		return -1;
+	}
+	memcpy(smod->sensor_list, hw_list, sizeof(struct sensor_t) * smod->hw_sensor_count);
+	smod->sensor_count = smod->hw_sensor_count;
+
+	smod->accel_handle = smodule_find_type(smod, SENSOR_TYPE_ACCELEROMETER);
+	smod->gyro_handle = smodule_find_type(smod, SENSOR_TYPE_GYROSCOPE);
+	smod->mag_handle = smodule_find_type(smod, SENSOR_TYPE_MAGNETIC_FIELD);
+
+	// The server calibrates gyroscope and magnetometer and provides their
+	// raw values and bias, unless the HAL lists the uncalibrated sensors
+	// itself: then it calibrates the others already
+	smod->calib_gyro = smod->gyro_handle >= 0 &&
+	    smodule_find_type(smod, SENSOR_TYPE_GYROSCOPE_UNCALIBRATED) < 0;
+	smod->calib_mag = smod->mag_handle >= 0 &&
+	    smodule_find_type(smod, SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED) < 0;
+	if (smod->calib_gyro) {
+		s = smodule_sensor_get(smod, smod->gyro_handle);
+		smodule_virtual_add(smod, SENSOR_TYPE_GYROSCOPE_UNCALIBRATED, "Uncalibrated Gyroscope",
+				    s->maxRange, s->resolution, &smod->gyro_handle, 1);
+	}
+	if (smod->calib_mag) {
+		s = smodule_sensor_get(smod, smod->mag_handle);
+		smodule_virtual_add(smod, SENSOR_TYPE_MAGNETIC_FIELD_UNCALIBRATED,
+				    "Uncalibrated Magnetic Field", s->maxRange, s->resolution,
+				    &smod->mag_handle, 1);
+	}
+
+	if (smod->accel_handle < 0 || smod->gyro_handle < 0)
+		return 0;	// nothing to fuse
+	accel = smodule_sensor_get(smod, smod->accel_handle);
+
+	// The gyroscope drives the fusion
+	deps[0] = smod->gyro_handle;
+	deps[1] = smod->accel_handle;
+	deps[2] = smod->mag_handle;
+	smodule_virtual_add(smod, SENSOR_TYPE_GRAVITY, "Gravity Sensor",
+			    GRAVITY_EARTH, accel->resolution, deps, 2);
+	smodule_virtual_add(smod, SENSOR_TYPE_LINEAR_ACCELERATION, "Linear Acceleration Sensor",
+			    accel->maxRange, accel->resolution, deps, 2);
+	smodule_virtual_add(smod, SENSOR_TYPE_ROTATION_VECTOR, "Rotation Vector Sensor",
+			    1.0f, 1.0f / (1 << 24), deps, 3);
+
+	return 0;
+}
+
 static struct smodule *smodule_new(const char *hw_module_id)
 {
 	struct sensors_module_t *module;
 	struct sockaddr_un server;
+	const struct sensor_t *hw_list;
 	struct smodule *smod;
 	pthread_attr_t attr;
 	int err;
@@ -528,15 +3138,15 @@ static struct smodule *smodule_new(const char *hw_module_id)
 	}
 
 	// Get list of sensors for that sensor device
-	smod->sensor_count = module->get_sensors_list(module, &smod->sensor_list);
-	if (smod->sensor_count <= 0) {
-		ALOGE("get_sensor_list() returned %d", smod->sensor_count);
+	smod->hw_sensor_count = module->get_sensors_list(module, &hw_list);
+	if (smod->hw_sensor_count <= 0) {
+		ALOGE("get_sensor_list() returned %d", smod->hw_sensor_count);
 		goto err_sensors_open;
 	}
 
-	ALOGI("Sensors found: %d", smod->sensor_count);
-	for (int i = 0; i < smod->sensor_count; i++) {
-		const struct sensor_t *s = &smod->sensor_list[i];
+	ALOGI("Sensors found: %d", smod->hw_sensor_count);
+	for (int i = 0; i < smod->hw_sensor_count; i++) {
+		const struct sensor_t *s = &hw_list[i];
 		if (s->handle > smod->handle_last)
 			smod->handle_last = s->handle;
 		ALOGI("Name %s vendor %s version %d handle %d type %d "
@@ -544,12 +3154,36 @@ static struct smodule *smodule_new(const char *hw_module_id)
 		      s->name, s->vendor, s->version, s->handle, s->type,
 		      s->maxRange, s->resolution, s->power, s->minDelay);
 	}
+
+	err = smodule_virtual_create(smod, hw_list);
+	if (err)
+		goto err_sensors_open;
 	ALOGI("Last sensor handle: %d", smod->handle_last);
 
+	// Continue with the calibration of the last run
+	scalib_gyro_init(&smod->gyro_calib);
+	scalib_mag_init(&smod->mag_calib);
+	err = scalib_load(SMODULE_CALIB_PATH, &smod->gyro_calib,
+			  smod->gyro_handle >= 0 ? smodule_sensor_get(smod, smod->gyro_handle)->name : "",
+			  &smod->mag_calib,
+			  smod->mag_handle >= 0 ? smodule_sensor_get(smod, smod->mag_handle)->name : "");
+	ALOGI_IF(err, "no calibration loaded from %s: %s", SMODULE_CALIB_PATH, strerror(errno));
+	ALOGI_IF(!err, "calibration loaded: gyro %s, mag %s",
+		 smod->gyro_calib.valid ? "valid" : "none", smod->mag_calib.valid ? "valid" : "none");
+
+	sqos_init(&smod->qos);
+	err = sqos_load(&smod->qos, SMODULE_QOS_PATH);
+	ALOGI_IF(err < 0, "no QoS configuration loaded from %s: %s", SMODULE_QOS_PATH,
+		 strerror(errno));
+	ALOGE_IF(err > 0, "%s:%d: invalid QoS configuration", SMODULE_QOS_PATH, err);
+	ALOGI_IF(!err, "QoS configuration loaded: %d class(es), %d peer range(s)",
+		 smod->qos.class_count, smod->qos.peer_count);
+	smodule_budget_init(&smod->budget, smod->qos.events_per_s, smod->qos.bytes_per_s);
+
 	smod->sensors_enabled = (int *)calloc(smod->handle_last + 1, sizeof(int));
 	if (!smod->sensors_enabled) {
 		ALOGE("couldn't allocate memory for sensors enabled array");
-		goto err_sensors_open;
+		goto err_virtual_create;
 	}
 
 	smod->sensor_delay_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
@@ -558,11 +3192,74 @@ static struct smodule *smodule_new(const char *hw_module_id)
 		goto err_calloc_sensors_enabled;
 	}
 
+	smod->q16_scale = (float *)calloc(smod->handle_last + 1, sizeof(float));
+	if (!smod->q16_scale) {
+		ALOGE("couldn't allocate memory for q16 scale array");
+		goto err_calloc_sensor_delay_ns;
+	}
+	for (int i = 0; i < smod->sensor_count; i++) {
+		const struct sensor_t *s = &smod->sensor_list[i];
+		smod->q16_scale[s->handle] = sensors_codec_q16_scale(s);
+		ALOGI_IF(smod->q16_scale[s->handle] > 0, "Sensor %d supports Q16 encoding, scale %f",
+			 s->handle, smod->q16_scale[s->handle]);
+	}
+
+	smod->last_event = (sensors_event_t *)calloc(smod->handle_last + 1, sizeof(sensors_event_t));
+	smod->last_event_ns = (int64_t *) calloc(smod->handle_last + 1, sizeof(int64_t));
+	if (!smod->last_event || !smod->last_event_ns) {
+		ALOGE("couldn't allocate memory for last event cache");
+		goto err_calloc_last_event;
+	}
+
+	err = smodule_latest_create(smod);
+	if (err)
+		goto err_calloc_last_event;
+
+	smod->history = (struct shistory *)calloc(smod->handle_last + 1, sizeof(struct shistory));
+	if (!smod->history) {
+		ALOGE("couldn't allocate memory for history array");
+		goto err_latest_create;
+	}
+	for (int i = 0; i < smod->sensor_count; i++) {
+		const struct sensor_t *s = &smod->sensor_list[i];
+		err = shistory_init(&smod->history[s->handle],
+				    shistory_capacity(s, SMODULE_HISTORY_NS));
+		if (err) {
+			ALOGE("couldn't allocate history of sensor %d: %s", s->handle, strerror(-err));
+			goto err_history_init;
+		}
+		ALOGI("Sensor %d retains %u event(s)", s->handle, smod->history[s->handle].capacity);
+	}
+
+	smod->rollup = (struct srollup *)calloc(smod->handle_last + 1, sizeof(struct srollup));
+	if (!smod->rollup) {
+		ALOGE("couldn't allocate memory for rollup array");
+		goto err_history_init;
+	}
+	for (int i = 0; i < smod->sensor_count; i++) {
+		const struct sensor_t *s = &smod->sensor_list[i];
+		err = srollup_init(&smod->rollup[s->handle], sensors_codec_values(s->type));
+		if (err) {
+			ALOGE("couldn't allocate rollups of sensor %d: %s", s->handle, strerror(-err));
+			goto err_rollup_init;
+		}
+	}
+
+	// The events of a poll round a client gets: hardware and virtual ones,
+	// and what its derived streams produce from them at most
+	smod->dispatch = (sensors_event_t *)malloc(sizeof(sensors_event_t) *
+						   smod->hw_sensor_count * (1 + SMODULE_VIRTUAL_MAX) *
+						   (1 + SMODULE_DERIVED_MAX * SDERIVE_OUT_MAX));
+	if (!smod->dispatch) {
+		ALOGE("couldn't allocate memory for dispatching events");
+		goto err_rollup_init;
+	}
+
 	// We use epoll to monitor multiple file descriptors
 	smod->epoll_fd = epoll_create(EPOLL_DEFAULT_SIZE);
 	if (smod->epoll_fd < 0) {
 		ALOGE("couldn't create epoll instance: %s", strerror(errno));
-		goto err_calloc_sensor_delay_ns;
+		goto err_malloc_dispatch;
 	}
 
 	// We use TCP stream sockets for communication
@@ -598,30 +3295,69 @@ static struct smodule *smodule_new(const char *hw_module_id)
 	if (err)
 		goto err_socket;
 
+	smod->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (smod->wake_fd < 0) {
+		ALOGE("couldn't create eventfd: %s", strerror(errno));
+		goto err_socket;
+	}
+	err = epoll_add_fd(smod->epoll_fd, smod->wake_fd, &smod->wake_fd);
+	if (err)
+		goto err_eventfd;
+
+	// Without the container manager all clients are served like in the
+	// foreground, better than no sensors at all
+	err = smodule_ctrl_create(smod);
+	if (err)
+		ALOGW("continuing without control socket");
+
 	// We need a mutex to protect the list of sensor clients.
 	err = pthread_mutex_init(&smod->mutex, NULL);
 	if (err) {
 		ALOGE("couldn't initialze mutex: %s", strerror(-err));
-		goto err_socket;
+		goto err_ctrl_create;
 	}
 	// Finally we start the sensor data polling thread.
 	pthread_attr_init(&attr);
 	err = pthread_create(&smod->poll_thread, &attr, smodule_poll_thread, smod);
 	if (err) {
 		ALOGE("couldn't create sensor polling thread: %s", strerror(-err));
-		goto err_socket;
+		goto err_ctrl_create;
 	}
 
 	return smod;
 
+err_ctrl_create:
+	if (smod->ctrl_fd >= 0)
+		close(smod->ctrl_fd);
+err_eventfd:
+	close(smod->wake_fd);
 err_socket:
 	close(smod->sock_fd);
 err_epoll_create:
 	close(smod->epoll_fd);
+err_malloc_dispatch:
+	free(smod->dispatch);
+err_rollup_init:
+	for (int i = 0; i <= smod->handle_last; i++)
+		srollup_free(&smod->rollup[i]);
+	free(smod->rollup);
+err_history_init:
+	for (int i = 0; i <= smod->handle_last; i++)
+		shistory_free(&smod->history[i]);
+	free(smod->history);
+err_latest_create:
+	munmap(smod->latest, smod->latest_size);
+	close(smod->latest_fd);
+err_calloc_last_event:
+	free(smod->last_event);
+	free(smod->last_event_ns);
+	free(smod->q16_scale);
 err_calloc_sensors_enabled:
 	free(smod->sensors_enabled);
 err_calloc_sensor_delay_ns:
 	free(smod->sensor_delay_ns);
+err_virtual_create:
+	free(smod->sensor_list);
 err_sensors_open:
 	sensors_close(smod->device);
 err_calloc_smod:
@@ -637,11 +3373,37 @@ static void smodule_free(struct smodule *smod)
 	pthread_kill(smod->poll_thread, SIGSTOP);
 	pthread_join(smod->poll_thread, NULL);
 
+	if (smod->calib_changed)
+		smodule_calib_save(smod);
+
 	// Now cleanup
+	if (smod->ctrl_conn_fd >= 0)
+		close(smod->ctrl_conn_fd);
+	if (smod->ctrl_fd >= 0)
+		close(smod->ctrl_fd);
+	close(smod->wake_fd);
 	close(smod->sock_fd);
 	close(smod->epoll_fd);
 	free(smod->sensors_enabled);
 	free(smod->sensor_delay_ns);
+	free(smod->q16_scale);
+	free(smod->last_event);
+	free(smod->last_event_ns);
+	smod->latest->magic = 0;	// tells readers the page is stale
+	munmap(smod->latest, smod->latest_size);
+	close(smod->latest_fd);
+	for (int i = 0; i <= smod->handle_last; i++)
+		shistory_free(&smod->history[i]);
+	free(smod->history);
+	for (int i = 0; i <= smod->handle_last; i++)
+		srollup_free(&smod->rollup[i]);
+	free(smod->rollup);
+	for (int i = 0; i < SMODULE_DERIVED_MAX; i++) {
+		if (smod->derived[i].users)
+			sderive_free(&smod->derived[i]);
+	}
+	free(smod->dispatch);
+	free(smod->sensor_list);
 	sensors_close(smod->device);
 	free(smod);
 }
@@ -664,7 +3426,8 @@ void smodule_event_loop(struct smodule *smod)
 	struct epoll_event events[EPOLL_EVENTS_MAX];
 
 	while (1) {
-		const int nfds = epoll_wait(smod->epoll_fd, events, EPOLL_EVENTS_MAX, -1);
+		const int nfds = epoll_wait(smod->epoll_fd, events, EPOLL_EVENTS_MAX,
+					    smodule_timeout_ms(smod));
 		int i;
 
 		if (nfds < 0) {
@@ -678,6 +3441,14 @@ void smodule_event_loop(struct smodule *smod)
 			struct epoll_event *event = &events[i];
 			if (event->data.ptr == smod) {
 				smodule_handle_event(smod, event);
+			} else if (event->data.ptr == &smod->wake_fd) {
+				eventfd_t value;
+				// Only makes the loop pick up the timeout of new batches
+				eventfd_read(smod->wake_fd, &value);
+			} else if (event->data.ptr == &smod->ctrl_fd) {
+				smodule_ctrl_accept(smod);
+			} else if (event->data.ptr == &smod->ctrl_conn_fd) {
+				smodule_ctrl_handle_event(smod, event);
 			} else {
 				struct smodule_client *client =
 				    (struct smodule_client *)event->data.ptr;